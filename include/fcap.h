@@ -2,10 +2,30 @@
 #define FCAP_H
 
 #include <fcap_pkt.h>
+#include <fcap_pool.h>
+#include <fcap_queue.h>
 
 /* Standard FCAP port == 1434 */
 #define FCAP_PORT (1024 + 'F' + 'C' + 'A' + 'P')
 
+/* The number of message IDs, one for each value of the 7 bit header field */
+#define FCAP_NUM_MESSAGE_IDS 128
+
+/* The most packets fcap_poll will handle from one transport per call */
+#ifndef FCAP_POLL_BUDGET
+#define FCAP_POLL_BUDGET 32
+#endif
+
+/*
+ * The longest fcap_poll_wait will sleep when it can't wait on every transport,
+ * or has output queued up which it needs to retry
+ */
+#ifndef FCAP_WAIT_RETRY_MS
+#define FCAP_WAIT_RETRY_MS 1
+#endif
+
+struct fcap;
+
 /**
  * @brief all info needed to manage and use a transport transport
  * @param priv any private context data the transport needs to maintain
@@ -14,11 +34,33 @@
  * or -errno on failure. This fuction should never block
  * @param send_bytes a function to call to send bytes out on this transport, 
  * returns number of bytes sent or -errno on failure. 
+ * @param flush an optional function for transports which queue sent bytes
+ * rather than sending them straight away. It sends everything queued and
+ * returns the number of packets still queued (because the transport is under
+ * pressure, they will be retried on the next flush) or -errno if the
+ * transport itself has failed. A packet which can never be sent, such as one
+ * to an unreachable peer, is dropped rather than failing the flush. This
+ * function should never block
+ * @param take_drops an optional function for transports with a flush, which
+ * returns the number of packets dropped by flush since it was last called
+ * @param get_fd an optional function which returns a file descriptor that
+ * becomes readable when get_bytes has data, so fcap_poll_wait can sleep on it.
+ * Returns -1 if the transport has no such descriptor
+ * @param peer an optional transport in the same process which receives
+ * everything sent on this one, such as the other end of a loopback. Packets
+ * are handed straight to the app using @peer instead of being sent, whenever
+ * that app isn't already busy handling a packet
+ * @param app the app using this transport, set by fcap_init_instance
 */
 struct fcap_transport {
 	void *priv;
 	int (*get_bytes)(void *priv, uint8_t *bytes, size_t length);
 	int (*send_bytes)(void *priv, uint8_t *bytes, size_t length);
+	int (*flush)(void *priv);
+	int (*take_drops)(void *priv);
+	int (*get_fd)(void *priv);
+	struct fcap_transport *peer;
+	struct fcap *app;
 };
 typedef struct fcap_transport *FTransport;
 
@@ -26,12 +68,14 @@ typedef struct fcap_transport *FTransport;
  * @brief context object to pass around with a packet
  * @param transport the transport the message came from
  * @param pkt a pointer to the packet buffer
+ * @param view an index of the keys in @pkt, only set for inbound packets
  * @param is_outbound is this packet being sent out of the device (true) or 
  * is from an external peer and inbound (false)
 */
 struct fcap_event {
 	FTransport transport;
 	FPacket pkt;
+	FView view;
 	uint8_t is_outbound;
 };
 typedef struct fcap_event *FEvent;
@@ -57,6 +101,8 @@ enum handler_code {
  * should continue as normal with other middleware or returning to the user
  * FCAP_RESPOND = the middleware has filled out a response packet and should
  * be sent straight back to the requesters - do not pass go, do not collect $200
+ * The response packet is NULL for outbound requests, which can't be answered
+ * locally, so a middleware must check it before filling it in
  * @param on_response handles response events both inbound and outbound, from 
  * the transports perspective. returns an enum handler_code. 
  * //TODO: fill the return codes...
@@ -70,6 +116,87 @@ struct fcap_middleware {
 };
 typedef struct fcap_middleware *FMiddleware;
 
+/**
+ * @brief called once a tracked request is done with
+ * @param app the app which sent the request
+ * @param event the response event, NULL if the request timed out
+ * @param status FCAP_ENONE if a response arrived or FCAP_ETIMEDOUT
+ * @param priv the context given when the request was sent
+*/
+typedef void (*FDoneFn)(struct fcap *app, FEvent event, FError status,
+			void *priv);
+
+/**
+ * @brief a request waiting for its response
+ * @param on_done called with the response or on timeout
+ * @param priv passed to @on_done
+ * @param deadline_us when the request times out, 0 if it never does
+*/
+struct fcap_pending_req {
+	FDoneFn on_done;
+	void *priv;
+	uint64_t deadline_us;
+};
+
+/**
+ * @brief the requests waiting for a response on one transport, indexed by
+ * message ID so a response is matched to its request directly
+ * @param used a bitmap of the message IDs in use, bit n is ID n
+ * @param next_id the next message ID to try handing out
+ * @param num_pending the number of message IDs in use
+ * @param window the most requests which may be tracked at once, 0 for one
+ * per message ID
+ * @param reqs the request using each message ID
+*/
+struct fcap_pending {
+	uint64_t used[FCAP_NUM_MESSAGE_IDS / 64];
+	uint8_t next_id;
+	uint8_t num_pending;
+	uint8_t window;
+	struct fcap_pending_req reqs[FCAP_NUM_MESSAGE_IDS];
+};
+
+/**
+ * @brief what an app has done on a transport
+ * @param pkts_in the number of packets received
+ * @param bytes_in the number of bytes received
+ * @param pkts_out the number of packets sent
+ * @param bytes_out the number of bytes sent
+ * @param requests the number of requests received
+ * @param responses the number of responses received
+ * @param aborts the number of packets a middleware dropped, in either
+ * direction
+ * @param send_failures the number of packets the transport failed to send,
+ * including ones it had queued and failed to flush
+ * @param decode_rejects the number of malformed packets dropped
+ * @param empty_polls the number of times the transport was polled and had
+ * nothing ready
+*/
+struct fcap_metrics {
+	uint64_t pkts_in;
+	uint64_t bytes_in;
+	uint64_t pkts_out;
+	uint64_t bytes_out;
+	uint64_t requests;
+	uint64_t responses;
+	uint64_t aborts;
+	uint64_t send_failures;
+	uint64_t decode_rejects;
+	uint64_t empty_polls;
+};
+
+/**
+ * @brief the metrics counted for one transport. Only the thread polling the
+ * app writes @count, so counting is a plain load and store, and a reset only
+ * moves @base so it can never be lost to a count made at the same time
+ * @param count everything counted since the app was initialised
+ * @param base @count as of the last reset
+*/
+struct fcap_counters {
+	struct fcap_metrics count;
+	struct fcap_metrics base;
+};
+
 /**
  * @brief an fcap instance
  * @param num_transports the number of setup transports
@@ -77,26 +204,100 @@ typedef struct fcap_middleware *FMiddleware;
  * @param transports an array of transport pointers
  * @param middlewares an array of middleware pointers
  * @param out_pkt the tx packet buffer
+ * @param out_builder tracks the keys and length of the tx packet buffer
  * @param in_pkt the rx_packet buffer
+ * @param in_view the key index of the rx packet buffer
+ * @param pending the requests waiting for a response, one table per transport.
+ * If NULL, message IDs aren't assigned and requests can't be tracked. Set up
+ * by FCAP_CREATE_APP_TRACKED, or passed to fcap_init_app
+ * @param next_deadline_us the earliest a tracked request may time out, 0 if
+ * none can
+ * @param counters the metrics of each transport, NULL to not count anything.
+ * Set up by FCAP_CREATE_APP, or point it at an array after fcap_init_app
+ * @param pool an optional pool which packets are received into, in place of
+ * @in_pkt, so handlers can hold on to them with fcap_pool_hold. @in_pkt is
+ * still used whenever the pool runs dry
+ * @param queue an optional queue which other threads send built packets
+ * through, drained onto the transports by fcap_poll. Nothing else in the app
+ * may be touched from other threads
+ * @param wait_fd the epoll instance used by fcap_poll_wait, -1 until first used
+ * @param wait_all whether every transport can be waited on by @wait_fd
+ * @param spin_max_us the longest fcap_poll_wait may spin before sleeping
+ * @param spin_us how long fcap_poll_wait currently spins before sleeping,
+ * adapted between 0 and @spin_max_us
+ * @param busy the number of packets the app is in the middle of handling,
+ * packets from a peer transport are queued rather than handed over while set
+ * @param priv any private context the handlers of this app need
+ * @param on_request handles requests no middleware has handled, in place of
+ * the global fcap_user_recv_req
+ * @param on_response handles responses no middleware has handled, in place of
+ * the global fcap_user_recv_res
 */
 struct fcap {
-	const uint8_t num_transports;
-	const uint8_t num_middleware;
+	uint8_t num_transports;
+	uint8_t num_middleware;
 	const FTransport *transports;
 	const FMiddleware *middleware;
 	struct fcap_packet out_pkt;
+	struct fcap_builder out_builder;
 	struct fcap_packet in_pkt;
+	struct fcap_view in_view;
+	struct fcap_pending *pending;
+	uint64_t next_deadline_us;
+	struct fcap_counters *counters;
+	FPool pool;
+	FQueue queue;
+	int wait_fd;
+	uint8_t wait_all;
+	uint32_t spin_max_us;
+	uint32_t spin_us;
+	uint8_t busy;
+	void *priv;
+	enum handler_code (*on_request)(struct fcap *app, FEvent event,
+					FPacket res);
+	enum handler_code (*on_response)(struct fcap *app, FEvent event);
 };
 typedef struct fcap *FApp;
 
-#define FCAP_CREATE_APP(name, transports_in, middleware_in)                    \
+/*
+ * Any further arguments are used to initialise the rest of the app, such as
+ * the handlers: .priv = &ctx, .on_request = my_req, .on_response = my_res
+ * or a packet pool: .pool = my_pool or an outbound queue: .queue = my_queue
+ *
+ * The app doesn't track requests, as per fcap_init_app with no pending
+ * tables. Use FCAP_CREATE_APP_TRACKED for one which does
+ */
+#define FCAP_CREATE_APP(name, transports_in, middleware_in, ...)               \
+	FCAP_CREATE_APP_WITH(name, transports_in, middleware_in, NULL,         \
+			     __VA_ARGS__)
+
+/*
+ * As per FCAP_CREATE_APP, along with a table of pending requests per
+ * transport, so message IDs are assigned and requests can be tracked
+ */
+#define FCAP_CREATE_APP_TRACKED(name, transports_in, middleware_in, ...)       \
+	struct fcap_pending name##_pending                                     \
+		[sizeof(transports_in) / sizeof(FTransport)] = {};             \
+	FCAP_CREATE_APP_WITH(name, transports_in, middleware_in,               \
+			     name##_pending, __VA_ARGS__)
+
+#define FCAP_CREATE_APP_WITH(name, transports_in, middleware_in, pending_in,   \
+			     ...)                                              \
+	struct fcap_counters name##_counters                                   \
+		[sizeof(transports_in) / sizeof(FTransport)] = {};             \
 	struct fcap name##_internal = {                                        \
 		.num_transports = transports_in##_size,                        \
 		.num_middleware = middleware_in##_size,                        \
 		.transports = transports_in,                                   \
 		.middleware = middleware_in,                                   \
 		.out_pkt = {},                                                 \
+		.out_builder = { .pkt = &name##_internal.out_pkt },            \
 		.in_pkt = {},                                                  \
+		.in_view = {},                                                 \
+		.pending = pending_in,                                         \
+		.counters = name##_counters,                                   \
+		.wait_fd = -1,                                                 \
+		__VA_ARGS__                                                    \
 	};                                                                     \
 	const FApp name = &name##_internal;
 
@@ -115,25 +316,177 @@ typedef struct fcap *FApp;
 */
 void fcap_init_instance(FApp app);
 
+/**
+ * @brief initialises an fcap instance at runtime, for when the app can't be
+ * created statically, such as one app per worker thread
+ * @param app the application instance to initialise
+ * @param transports an array of transport pointers
+ * @param num_transports the size of the @transports array
+ * @param middleware an array of middleware pointers
+ * @param num_middleware the size of the @middleware array
+ * @param pending an array of @num_transports tables to track requests in, or
+ * NULL if the app never tracks requests
+*/
+void fcap_init_app(FApp app,
+		   const FTransport *transports,
+		   uint8_t num_transports,
+		   const FMiddleware *middleware,
+		   uint8_t num_middleware,
+		   struct fcap_pending *pending);
+
+/**
+ * @brief releases everything an app has set up for itself, should be called
+ * on shutdown
+ * @param app the application instance to clean up
+*/
+void fcap_cleanup_instance(FApp app);
+
 /**
  * @brief sends the packet out on specific transport
+ * @note the packet is given the next free message ID of the transport, so
+ * -FCAP_EAGAIN is returned if every ID is in use by a tracked request
+ * @note transports which queue their output only send it when flushed, which
+ * happens at the end of every fcap_poll or by calling fcap_flush
 */
 FError fcap_send_req(FApp app, FTransport transport);
 
+/**
+ * @brief sends a packet built outside of the app out on a specific transport,
+ * such as one from a pool. Unlike fcap_send_req, this is safe to call from a
+ * handler as it leaves the app's own packet buffers alone
+ * @param app the fcap app to send from
+ * @param transport the transport to send on
+ * @param builder the builder of the packet to send
+ * @returns the number of bytes sent or -errno on failure
+ * @note the transport copies the packet, so it can be reused or released
+ * straight after this returns. Message IDs are assigned as per fcap_send_req
+*/
+FError fcap_send_pkt(FApp app, FTransport transport, FBuilder builder);
+
+/**
+ * @brief sends the packet out on a specific transport as per fcap_send_req,
+ * and tracks it until its response arrives or it times out
+ * @param app the fcap app to send from
+ * @param transport the transport to send on
+ * @param timeout_ms how long to wait for the response, 0 to wait forever
+ * @param on_done called once with the response, or on timeout, from within
+ * fcap_poll. The app's on_response handler isn't called for the response
+ * @param priv passed to @on_done
+ * @returns the message ID of the request or -errno on failure, -FCAP_EAGAIN
+ * if the transport's window of tracked requests is full
+*/
+FError fcap_send_req_cb(FApp app,
+			FTransport transport,
+			uint32_t timeout_ms,
+			FDoneFn on_done,
+			void *priv);
+
+/**
+ * @brief sends a packet built outside of the app, as per fcap_send_pkt, and
+ * tracks it as per fcap_send_req_cb. Requests can be sent one after another
+ * without waiting for their responses, up to the transport's window
+ * @param app the fcap app to send from
+ * @param transport the transport to send on
+ * @param builder the builder of the request to send
+ * @param timeout_ms how long to wait for the response, 0 to wait forever
+ * @param on_done the continuation of this request, called once with the
+ * response, or on timeout, from within fcap_poll
+ * @param priv passed to @on_done
+ * @returns the message ID of the request or -errno on failure, -FCAP_EAGAIN
+ * if the transport's window of tracked requests is full
+*/
+FError fcap_send_async(FApp app,
+		       FTransport transport,
+		       FBuilder builder,
+		       uint32_t timeout_ms,
+		       FDoneFn on_done,
+		       void *priv);
+
+/**
+ * @brief limits how many tracked requests can be waiting for a response on a
+ * transport at once, to avoid overrunning a peer
+ * @param app the fcap app to configure
+ * @param transport the transport to limit
+ * @param window the most requests at once, 0 for one per message ID
+ * @returns 0 on success or -FCAP_EINVAL if the app doesn't track requests on
+ * @transport
+ * @note the window is reset by fcap_init_instance
+*/
+int fcap_set_window(FApp app, FTransport transport, uint8_t window);
+
+/**
+ * @brief flushes the queued output of every transport, even if one of them
+ * fails
+ * @param app the fcap app to flush
+ * @returns the number of packets still queued across all transports or the
+ * first -errno of a transport which failed. Packets a transport dropped are
+ * counted as send failures, and aren't an error
+*/
+int fcap_flush(FApp app);
+
+/**
+ * @brief takes a snapshot of an app's metrics, safe to call from any thread
+ * @param app the fcap app to look at
+ * @param transport the transport to look at, NULL for the sum of every
+ * transport
+ * @param metrics filled in with what has been counted since the last reset
+ * @returns 0 on success or -FCAP_EINVAL if the app doesn't count metrics or
+ * @transport isn't one of the app's
+ * @note the counters are read one at a time, so a snapshot taken while the
+ * app is polling may be a few packets out between counters
+*/
+int fcap_get_metrics(FApp app, FTransport transport,
+		     struct fcap_metrics *metrics);
+
+/**
+ * @brief starts an app's metrics counting from 0 again, safe to call from any
+ * thread
+ * @param app the fcap app to reset
+ * @param transport the transport to reset, NULL for every transport
+ * @returns 0 on success or -FCAP_EINVAL if the app doesn't count metrics or
+ * @transport isn't one of the app's
+*/
+int fcap_reset_metrics(FApp app, FTransport transport);
+
 /**
  * @brief loop which asks each transport if there is any data available to read
+ * and handles everything each transport has ready, up to FCAP_POLL_BUDGET
+ * packets per transport, then times out any tracked requests which are due and
+ * sends what other threads have queued up in the app's queue
  * @param app the fcap app to check for data
- * @returns 0 on success or -errno on failure
+ * @returns the number of packets handled or -errno on failure
  * @note Ownership of the packet buffer is lost when yielding to this function
  * call. I.e. any built packets will be reset after calling this fn.
- * Use it or lose it baby!
+ * Use it or lose it baby! Packets from the app's pool are the exception, they
+ * last for as long as a handler holds a reference to them
+*/
+int fcap_poll(FApp app);
+
+/**
+ * @brief polls the app, sleeping until a transport has data if there is none
+ * @param app the fcap app to check for data
+ * @param timeout_ms the longest to sleep for, or -1 to sleep until data arrives
+ * @returns the number of packets handled, 0 on timeout, or -errno on failure
+ * @note transports without a get_fd function can't wake the app, so while
+ * there are any the sleep is limited to FCAP_WAIT_RETRY_MS. The sleep also
+ * ends in time to time out the next tracked request which is due
+*/
+int fcap_poll_wait(FApp app, int timeout_ms);
+
+/**
+ * @brief lets fcap_poll_wait spin on fcap_poll for a while before sleeping,
+ * trading CPU for latency. The spin adapts, growing while data tends to
+ * arrive soon after the app goes idle and shrinking while it doesn't
+ * @param app the fcap app to configure
+ * @param max_us the longest to spin for, 0 to always sleep straight away
 */
-FError fcap_poll(FApp app);
+void fcap_set_spin(FApp app, uint32_t max_us);
 
 /**
  * @brief a the default callback when a request is received
- * This function will be called when any transport receives a request packet
- * and no middleware has handed it.
+ * This function will be called when any transport receives a request packet,
+ * no middleware has handed it and the app has no on_request handler. It is
+ * optional when every app has its own handler.
  * @param app the application the packet came from
  * @param event the event info, including the request packet
  * @param res the response packet to fill if the user wants to respond to this
@@ -143,11 +496,12 @@ FError fcap_poll(FApp app);
  * do nothing or FCAP_ABORT if there is a critical issue.
 */
 extern enum handler_code
-fcap_user_recv_req(FApp app, FEvent event, FPacket res);
+fcap_user_recv_req(FApp app, FEvent event, FPacket res) __attribute__((weak));
 
 /**
- * @brief the default callback when a response is received and no other
- * middleware has handled it.
+ * @brief the default callback when a response is received, no other
+ * middleware has handled it and the app has no on_response handler. It is
+ * optional when every app has its own handler.
  * @param app the application which the response came from
  * @param event the event data including the response packet
  * @returns a handler code indicating how the response was delt with.
@@ -155,8 +509,15 @@ fcap_user_recv_req(FApp app, FEvent event, FPacket res);
  * of the stack. FCAP_CONTINUE means you got the response and handled it.
  * FCAP_RESPONDED has the same effect as FCAP_CONTINUE.
 */
-extern enum handler_code fcap_user_recv_res(FApp app, FEvent event);
+extern enum handler_code
+fcap_user_recv_res(FApp app, FEvent event) __attribute__((weak));
 
+/**
+ * @brief adds a key to the app's tx packet, through its builder
+ * @note the app resyncs the builder after handing the packet to middleware
+ * and handlers. A handler which changes the packet with fcap_add_key and then
+ * adds more with these must call fcap_builder_sync on &app->out_builder first
+*/
 int fcap_app_add_key_bin(FApp app, FKey key, uint8_t *data, size_t len);
 int fcap_app_add_key_u8(FApp app, FKey key, uint8_t value);
 int fcap_app_add_key_u16(FApp app, FKey key, uint16_t value);
@@ -165,6 +526,10 @@ int fcap_app_add_key_i32(FApp app, FKey key, int32_t value);
 int fcap_app_add_key_i64(FApp app, FKey key, int64_t value);
 int fcap_app_add_key_f32(FApp app, FKey key, float value);
 int fcap_app_add_key_d64(FApp app, FKey key, double value);
+/*
+ * Getters read from the packet currently being handled by fcap_poll, through
+ * its key index
+ */
 int fcap_app_get_key_bin(FApp app, FKey key, uint8_t *data, size_t len);
 int fcap_app_get_key_u8(FApp app, FKey key, uint8_t *value);
 int fcap_app_get_key_u16(FApp app, FKey key, uint16_t *value);
@@ -0,0 +1,121 @@
+#ifndef FCAP_DGRAM_H
+#define FCAP_DGRAM_H
+
+#include <fcap_pkt.h>
+#include <sys/socket.h>
+
+/* The most datagrams pulled from the socket in a single syscall */
+#ifndef FCAP_DGRAM_BATCH_SIZE
+#define FCAP_DGRAM_BATCH_SIZE 16
+#endif
+
+/* The most datagrams queued to be sent in a single syscall */
+#ifndef FCAP_DGRAM_QUEUE_SIZE
+#define FCAP_DGRAM_QUEUE_SIZE 32
+#endif
+
+/* How long a send will wait for the socket when the queue is full */
+#ifndef FCAP_DGRAM_SEND_TIMEOUT_MS
+#define FCAP_DGRAM_SEND_TIMEOUT_MS 10
+#endif
+
+/*
+ * The batched receive and queued send shared by the datagram socket
+ * transports, fcap_udp and fcap_unix, which only differ in how their socket is
+ * set up. Their transport functions hand straight on to these
+ */
+
+/**
+ * @brief the socket and the rings of a datagram socket transport
+ * @param sockfd the bound socket
+ * @param dest_addr the address of the peer, unused when replying to senders
+ * @param dest_len the length of @dest_addr
+ * @param reply whether datagrams are sent back to whoever sent the last
+ * datagram read, rather than to @dest_addr
+ * @param rx_head the next datagram in @rx_bufs to hand out
+ * @param rx_count the number of datagrams in @rx_bufs
+ * @param rx_lens the length of each datagram in @rx_bufs
+ * @param rx_addrs the sender of each datagram in @rx_bufs
+ * @param rx_addr_lens the length of each address in @rx_addrs
+ * @param rx_bufs datagrams received in a single batch, waiting to be read
+ * @param last_addr the sender of the last datagram read, where replies go
+ * @param last_len the length of @last_addr, 0 if there is nobody to reply to
+ * @param tx_head the oldest datagram in @tx_bufs
+ * @param tx_count the number of datagrams in @tx_bufs
+ * @param tx_drops the number of datagrams flush has dropped as they could
+ * never be sent, since fcap_dgram_take_drops was last called
+ * @param tx_lens the length of each datagram in @tx_bufs
+ * @param tx_addrs the destination of each datagram in @tx_bufs when replying
+ * @param tx_addr_lens the length of each address in @tx_addrs
+ * @param tx_bufs a ring of datagrams waiting to be sent
+*/
+struct fcap_dgram {
+	int sockfd;
+	struct sockaddr_storage dest_addr;
+	socklen_t dest_len;
+	uint8_t reply;
+	uint8_t rx_head;
+	uint8_t rx_count;
+	uint8_t rx_lens[FCAP_DGRAM_BATCH_SIZE];
+	struct sockaddr_storage rx_addrs[FCAP_DGRAM_BATCH_SIZE];
+	socklen_t rx_addr_lens[FCAP_DGRAM_BATCH_SIZE];
+	uint8_t rx_bufs[FCAP_DGRAM_BATCH_SIZE][MTU];
+	struct sockaddr_storage last_addr;
+	socklen_t last_len;
+	uint8_t tx_head;
+	uint8_t tx_count;
+	uint32_t tx_drops;
+	uint8_t tx_lens[FCAP_DGRAM_QUEUE_SIZE];
+	struct sockaddr_storage tx_addrs[FCAP_DGRAM_QUEUE_SIZE];
+	socklen_t tx_addr_lens[FCAP_DGRAM_QUEUE_SIZE];
+	uint8_t tx_bufs[FCAP_DGRAM_QUEUE_SIZE][MTU];
+};
+
+/**
+ * @brief empties the rings and sets where datagrams are sent
+ * @param dgram the datagram socket
+ * @param sockfd the socket, already bound
+ * @param dest_addr the address of the peer, NULL to reply to whoever sent the
+ * last datagram read, as a server would
+ * @param dest_len the length of @dest_addr
+*/
+void fcap_dgram_init(struct fcap_dgram *dgram,
+		     int sockfd,
+		     const void *dest_addr,
+		     socklen_t dest_len);
+
+/**
+ * @brief get bytes function as per fcap.h spec
+ * @note datagrams are received up to FCAP_DGRAM_BATCH_SIZE at a time with a
+ * single syscall, and handed out one per call
+*/
+int fcap_dgram_get_bytes(struct fcap_dgram *dgram,
+			 uint8_t *bytes,
+			 size_t length);
+
+/**
+ * @brief send bytes function as per fcap.h spec
+ * @note the bytes are queued and only sent when the transport is flushed. If
+ * the queue is full it is flushed first, waiting up to
+ * FCAP_DGRAM_SEND_TIMEOUT_MS for the socket, and -FCAP_EAGAIN is returned if
+ * there is still no room. When replying to senders, -FCAP_EINVAL is returned
+ * if nothing has been received to reply to
+*/
+int fcap_dgram_send_bytes(struct fcap_dgram *dgram,
+			  uint8_t *bytes,
+			  size_t length);
+
+/**
+ * @brief flush function as per fcap.h spec
+ * @note every queued datagram is sent with a single syscall. A datagram the
+ * kernel refuses, such as one to an address nothing is listening on, is
+ * dropped and the rest of the queue is still sent
+*/
+int fcap_dgram_flush(struct fcap_dgram *dgram);
+
+/**
+ * @brief take drops function as per fcap.h spec
+*/
+int fcap_dgram_take_drops(struct fcap_dgram *dgram);
+
+#endif /* FCAP_DGRAM_H */
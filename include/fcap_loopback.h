@@ -0,0 +1,57 @@
+#ifndef FCAP_LOOPBACK_H
+#define FCAP_LOOPBACK_H
+
+#include <fcap.h>
+
+/* The most packets which can be waiting to be read, must be a power of 2 */
+#ifndef FCAP_LOOPBACK_QUEUE_SIZE
+#define FCAP_LOOPBACK_QUEUE_SIZE 32
+#endif
+
+/**
+ * @brief the private context of one end of an in-process loopback
+ * @param peer the other end, which sent bytes are delivered to
+ * @param head the total number of packets read from @bufs
+ * @param tail the total number of packets written to @bufs
+ * @param lens the length of each packet in @bufs
+ * @param bufs a ring of packets waiting to be read
+*/
+typedef struct fcap_loopback {
+	struct fcap_loopback *peer;
+	uint32_t head;
+	uint32_t tail;
+	uint8_t lens[FCAP_LOOPBACK_QUEUE_SIZE];
+	uint8_t bufs[FCAP_LOOPBACK_QUEUE_SIZE][MTU];
+} fcap_loopback_t;
+
+/**
+ * @brief send bytes function as per fcap.h spec
+ * @returns the number of bytes sent or -FCAP_EAGAIN if the peer's ring is full
+*/
+int fcap_loopback_send_bytes(void *priv, uint8_t *bytes, size_t length);
+
+/**
+ * @brief get bytes function as per fcap.h spec
+*/
+int fcap_loopback_get_bytes(void *priv, uint8_t *bytes, size_t length);
+
+#define FCAP_CREATE_LOOPBACK_TRANSPORT(name)                                   \
+	struct fcap_loopback name##_priv;                                      \
+	struct fcap_transport name = {                                         \
+		.priv = &name##_priv,                                          \
+		.get_bytes = fcap_loopback_get_bytes,                          \
+		.send_bytes = fcap_loopback_send_bytes,                        \
+	};
+
+/**
+ * @brief connects two loopback transports to each other, so what is sent on
+ * one is received on the other. Once the apps using them are initialised,
+ * packets are handed straight to the app at the other end where possible,
+ * only going through the rings when that app is busy
+ * @param a one end of the loopback
+ * @param b the other end of the loopback
+ * @note both ends must be used from the same thread
+*/
+void fcap_loopback_connect(FTransport a, FTransport b);
+
+#endif /* FCAP_LOOPBACK_H */
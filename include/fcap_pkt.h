@@ -15,6 +15,8 @@ typedef enum fcap_error {
 	FCAP_EINVAL,
 	FCAP_ENOKEY,
 	FCAP_ETYPE,
+	FCAP_EAGAIN,
+	FCAP_ETIMEDOUT,
 } FError;
 
 typedef enum fcap_type {
@@ -28,6 +30,9 @@ typedef enum fcap_type {
 	FCAP_DOUBLE,
 } FType;
 
+/* The size of the value of each FType, binary values carry their own length */
+extern const size_t fcap_type_sizes[FCAP_DOUBLE + 1];
+
 typedef enum fcap_pkt_type {
 	FCAP_REQUEST = 0,
 	FCAP_RESPONSE,
@@ -100,11 +105,60 @@ struct fcap_packet {
 } __attribute__((packed));
 typedef struct fcap_packet *FPacket;
 
+/**
+ * @brief tracks a packet while it is being built so that adding a key,
+ * checking for duplicates and getting the length never walk the packet
+ * @param pkt the packet being built
+ * @param keys a bitmap of the keys already in the packet, bit n is key n
+ * @param num_bytes the number of ktv bytes used so far
+ * @note the builder owns its packet. If anything else changes the packet,
+ * such as fcap_add_key, fcap_builder_sync must be called before the builder
+ * is used again
+*/
+struct fcap_builder {
+	FPacket pkt;
+	uint32_t keys;
+	uint16_t num_bytes;
+};
+typedef struct fcap_builder *FBuilder;
+
+/**
+ * @brief an index over the KTVs of a packet, built in a single pass so that
+ * every later lookup is a direct index rather than a walk of the packet
+ * @param pkt the packet which has been indexed
+ * @param keys a bitmap of the keys present in the packet, bit n is key n
+ * @param offsets the offset of each present key's KTV into pkt->ktv_bytes
+ * @param types the type of each present key
+ * @note the view is only valid until the packet is next modified
+*/
+struct fcap_view {
+	FPacket pkt;
+	uint32_t keys;
+	uint8_t offsets[NUM_KEYS];
+	uint8_t types[NUM_KEYS];
+};
+typedef struct fcap_view *FView;
+
+/**
+ * @brief one key of a batch added with fcap_add_keys
+ * @param key the key
+ * @param type the type of the value
+ * @param value a pointer to the bytes of the value
+ * @param size the length of the value, as per fcap_add_key
+*/
+struct fcap_key_desc {
+	FKey key;
+	FType type;
+	const void *value;
+	size_t size;
+};
+
 /* Creating & Sending Packets */
 
 /**
  * @brief Resets a packet to defaults
  * @param pkt the packet to reset / initialise
+ * @note only the header is reset, so this is cheap to call on every packet
 */
 void fcap_init_packet(FPacket pkt);
 
@@ -123,11 +177,25 @@ int fcap_get_num_bytes(FPacket pkt);
  * @param size the length of the value you want to copy in, this should match 
  * the protocol defined length of the @type field
  * @returns 0 on success or -FCAP_ERROR on failure
- * @note -EINVAL will be returned if adding a key that already exists
+ * @note -EINVAL will be returned if adding a key that already exists and
+ * -ENOMEM if the key would not fit in the packet
  */
 int fcap_add_key(FPacket pkt, FKey key, FType type, void *value,
 		 size_t size);
 
+/**
+ * @brief adds a batch of keys to a packet in a single pass, rather than
+ * walking the packet once per key
+ * @param pkt the packet to add the keys to
+ * @param descs the keys to add, in the order they are written
+ * @param n the number of keys in @descs
+ * @returns 0 on success or -FCAP_ERROR on failure
+ * @note the whole batch is checked before any of it is written, so on failure
+ * the packet is left as it was. -EINVAL is returned for a bad or duplicated
+ * key and -ENOMEM if the batch would not fit in the packet
+*/
+int fcap_add_keys(FPacket pkt, const struct fcap_key_desc *descs, size_t n);
+
 /**
  * @brief gets a specific key from the packet
  * @param pkt the packet to get the key from
@@ -183,6 +251,258 @@ int fcap_get_key_i64(FPacket pkt, FKey key, int64_t *value);
 int fcap_get_key_f32(FPacket pkt, FKey key, float *value);
 int fcap_get_key_d64(FPacket pkt, FKey key, double *value);
 
+/* Building Packets */
+
+/**
+ * @brief resets a packet and starts building it
+ * @param builder the builder to track the packet with
+ * @param pkt the packet to build
+*/
+void fcap_builder_init(FBuilder builder, FPacket pkt);
+
+/**
+ * @brief rebuilds the builder's keys and length by walking its packet
+ * @param builder the builder to sync
+ * @note only needed once the packet has been changed other than through the
+ * builder
+*/
+void fcap_builder_sync(FBuilder builder);
+
+/**
+ * @brief adds a given key to the packet being built, as per fcap_add_key
+ * @param builder the builder of the packet to add the key to
+ * @param key they key to the value to
+ * @param type the type of the value
+ * @param value a pointer to some bytes which will be copied into the packet
+ * @param size the length of the value you want to copy in
+ * @returns 0 on success or -FCAP_ERROR on failure
+ * @note -EINVAL will be returned if adding a key that already exists and
+ * -ENOMEM if the key would not fit in the packet
+*/
+int fcap_builder_add_key(FBuilder builder, FKey key, FType type, void *value,
+			 size_t size);
+
+/**
+ * @brief adds a batch of keys to the packet being built, as per fcap_add_keys
+*/
+int fcap_builder_add_keys(FBuilder builder, const struct fcap_key_desc *descs,
+			  size_t n);
+
+/**
+ * @brief gets the number of used bytes of the packet being built, inclusive
+ * of all headers and data bytes
+*/
+int fcap_builder_get_num_bytes(FBuilder builder);
+
+int fcap_builder_add_key_bin(FBuilder builder, FKey key, uint8_t *data,
+			     size_t len);
+int fcap_builder_add_key_u8(FBuilder builder, FKey key, uint8_t value);
+int fcap_builder_add_key_u16(FBuilder builder, FKey key, uint16_t value);
+int fcap_builder_add_key_i16(FBuilder builder, FKey key, int16_t value);
+int fcap_builder_add_key_i32(FBuilder builder, FKey key, int32_t value);
+int fcap_builder_add_key_i64(FBuilder builder, FKey key, int64_t value);
+int fcap_builder_add_key_f32(FBuilder builder, FKey key, float value);
+int fcap_builder_add_key_d64(FBuilder builder, FKey key, double value);
+
+/* Reading Packets Through a View */
+
+/**
+ * @brief indexes every KTV in a packet so keys can be looked up directly
+ * @param view the view to fill
+ * @param pkt the packet to index
+ * @returns 0 on success or -FCAP_ERROR on failure
+ * @note this function trusts the packet, it does not validate it
+*/
+int fcap_view_init(FView view, FPacket pkt);
+
+/**
+ * @brief validates bytes received into a packet and indexes its keys, in a
+ * single pass and without copying the packet
+ * @param view the view to fill with the index of the packet
+ * @param pkt the packet holding the received bytes
+ * @param num_bytes the number of bytes received into @pkt
+ * @returns 0 on success or -FCAP_EINVAL if the packet is malformed
+ * @note the header version, key count, binary lengths and total length are
+ * all checked against @num_bytes, as are duplicated keys
+*/
+int fcap_decode_packet(FView view, FPacket pkt, size_t num_bytes);
+
+/**
+ * @brief returns if the viewed packet has the requested key
+ * @param view the view of the packet to check
+ * @param key the key to look for
+ * @returns 1 if the key exists, 0 if not, -errno on failure
+*/
+int fcap_view_has_key(FView view, FKey key);
+
+/**
+ * @brief gets a specific key from the viewed packet, as per fcap_get_key
+ * @param view the view of the packet to get the key from
+ * @param key the requested key
+ * @param data an output buffer for the value to be placed in
+ * @param size the size of the output buffer
+ * @returns the FType of the key on success or -FCAP_ERROR on failure
+ */
+int fcap_view_get_key(FView view, FKey key, void *data, size_t size);
+
+int fcap_view_get_key_bin(FView view, FKey key, uint8_t *data, size_t len);
+int fcap_view_get_key_u8(FView view, FKey key, uint8_t *value);
+int fcap_view_get_key_u16(FView view, FKey key, uint16_t *value);
+int fcap_view_get_key_i16(FView view, FKey key, int16_t *value);
+int fcap_view_get_key_i32(FView view, FKey key, int32_t *value);
+int fcap_view_get_key_i64(FView view, FKey key, int64_t *value);
+int fcap_view_get_key_f32(FView view, FKey key, float *value);
+int fcap_view_get_key_d64(FView view, FKey key, double *value);
+
+/* Walking Packets */
+
+/**
+ * @brief a single KTV of a packet, pointing into the packet
+ * @param key the key
+ * @param type the type of the value
+ * @param value the bytes of the value, after the length byte of a binary
+ * @param len the number of bytes in @value
+*/
+struct fcap_entry {
+	FKey key;
+	FType type;
+	const uint8_t *value;
+	size_t len;
+};
+
+/**
+ * @brief walks the KTVs of a packet in the order they were added
+ * @param pkt the packet being walked
+ * @param idx the offset of the next KTV into pkt->ktv_bytes
+ * @param end the number of KTV bytes received
+ * @param remaining the number of KTVs not yet returned
+*/
+struct fcap_iter {
+	FPacket pkt;
+	size_t idx;
+	size_t end;
+	uint8_t remaining;
+};
+
+/**
+ * @brief called for each KTV of a packet by fcap_visit_packet
+ * @param priv the private data passed to fcap_visit_packet
+ * @param entry the KTV, which is only valid during the call
+ * @returns 0 to carry on to the next KTV, anything else stops the walk
+*/
+typedef int (*FVisitFn)(void *priv, const struct fcap_entry *entry);
+
+/**
+ * @brief starts walking a packet
+ * @param iter the iterator to start
+ * @param pkt the packet to walk
+ * @param num_bytes the number of bytes received into @pkt, or
+ * fcap_get_num_bytes for a packet built locally
+ * @returns 0 on success or -FCAP_EINVAL if @num_bytes can't hold the header
+*/
+int fcap_iter_begin(struct fcap_iter *iter, FPacket pkt, size_t num_bytes);
+
+/**
+ * @brief gets the next KTV of a packet, without copying its value
+ * @param iter the iterator, started by fcap_iter_begin
+ * @param entry filled with the next KTV
+ * @returns 1 if @entry was filled, 0 once every KTV has been returned or
+ * -FCAP_EINVAL if the next KTV runs past @num_bytes
+ * @note only the bounds are checked, use fcap_decode_packet to also check for
+ * duplicated keys and trailing bytes
+*/
+int fcap_iter_next(struct fcap_iter *iter, struct fcap_entry *entry);
+
+/**
+ * @brief calls a function for each KTV of a packet, as per fcap_iter_next
+ * @param pkt the packet to walk
+ * @param num_bytes the number of bytes received into @pkt
+ * @param fn the function to call
+ * @param priv private data passed to @fn
+ * @returns 0 once every KTV has been visited, the first non-zero return of
+ * @fn if it stopped the walk or -FCAP_EINVAL if the packet is malformed
+*/
+int fcap_visit_packet(FPacket pkt, size_t num_bytes, FVisitFn fn, void *priv);
+
+/* Packing Structs */
+
+/**
+ * @brief maps a key to a member of a plain C struct
+ * @param key the key
+ * @param type the type of the value
+ * @param offset the offset of the member into the struct
+ * @param size the size of the member, binary members start with a length byte
+ * followed by room for the longest value, as per fcap_get_key_bin
+*/
+struct fcap_field {
+	FKey key;
+	FType type;
+	size_t offset;
+	size_t size;
+};
+
+#define FCAP_FIELD(key_in, type_in, struct_type, member)                       \
+	{                                                                      \
+		.key = key_in,                                                 \
+		.type = type_in,                                               \
+		.offset = offsetof(struct_type, member),                       \
+		.size = sizeof(((struct_type *)0)->member),                    \
+	}
+
+/**
+ * @brief a checked table of fields, indexed by key so a packet can be
+ * unpacked without searching the table
+ * @param fields the fields, in the order they are packed
+ * @param num_fields the number of @fields
+ * @param keys a bitmap of the keys in @fields, bit n is key n
+ * @param index the position in @fields of each key in @keys
+*/
+struct fcap_struct_desc {
+	const struct fcap_field *fields;
+	uint8_t num_fields;
+	uint32_t keys;
+	uint8_t index[NUM_KEYS];
+};
+
+/**
+ * @brief checks a table of fields and indexes it by key
+ * @param desc the descriptor to fill
+ * @param fields the fields, which must outlive @desc
+ * @param num_fields the number of @fields
+ * @returns 0 on success or -FCAP_EINVAL if a key is repeated, a member has the
+ * wrong size for its type or there are more fields than a packet can hold
+*/
+int fcap_struct_desc_init(struct fcap_struct_desc *desc,
+			  const struct fcap_field *fields, size_t num_fields);
+
+/**
+ * @brief adds a key for every field of a struct to a packet, as per
+ * fcap_add_keys
+ * @param pkt the packet to add the keys to
+ * @param desc the fields to add
+ * @param src the struct to read the values from
+ * @returns 0 on success or -FCAP_ERROR on failure, in which case the packet
+ * is left as it was
+*/
+int fcap_pack_struct(FPacket pkt, const struct fcap_struct_desc *desc,
+		     const void *src);
+
+/**
+ * @brief fills the fields of a struct from a packet, in a single walk of it
+ * @param pkt the packet to read
+ * @param desc the fields to fill
+ * @param dst the struct to fill
+ * @returns the number of fields filled on success or -FCAP_ERROR on failure
+ * @note keys not in @desc are skipped and members whose key isn't in the
+ * packet are left as they were. -FCAP_ETYPE is returned if a key has another
+ * type than its field and -FCAP_ENOMEM if a binary value doesn't fit, in which
+ * case the fields before it have already been filled
+ * @note like fcap_get_key, this trusts the packet, decode received bytes
+ * first
+*/
+int fcap_unpack_struct(FPacket pkt, const struct fcap_struct_desc *desc,
+		       void *dst);
+
 #ifdef FCAP_DEBUG
 void fcap_debug_ktv(uint8_t *bytes, size_t max_size);
 void fcap_debug_packet(FPacket pkt);
@@ -0,0 +1,448 @@
+#ifndef FCAP_PKT_HPP
+#define FCAP_PKT_HPP
+
+#if __cplusplus < 201703L
+#error "fcap_pkt.hpp needs C++17"
+#endif
+
+#include <array>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
+
+#if __has_include(<version>)
+#include <version>
+#endif
+#if __has_include(<span>)
+#include <span>
+#endif
+
+extern "C" {
+#include <fcap_pkt.h>
+#include <fcap_pool.h>
+}
+
+/*
+ * A thin C++ layer over fcap_pkt.h. Every class holds the C struct it wraps
+ * and nothing else, so nothing here allocates, and values are read in place:
+ *
+ *   fcpp::view view;
+ *   fcpp::span<const uint8_t> blob;
+ *
+ *   if (view.decode(pkt, num_bytes) == 0 && view.get(KEY_F, blob) == 0)
+ *           use(blob.data(), blob.size());
+ *
+ *   for (fcpp::ktv ktv : view)
+ *           printf("%d: %zu bytes\n", ktv.key, ktv.value.size());
+ */
+namespace fcpp
+{
+
+#ifdef __cpp_lib_span
+template <typename T> using span = std::span<T>;
+#else
+/**
+ * @brief a pointer and a length, standing in for std::span before C++20
+*/
+template <typename T> class span
+{
+	T *ptr = nullptr;
+	size_t len = 0;
+
+    public:
+	constexpr span() noexcept = default;
+	constexpr span(T *data, size_t size) noexcept : ptr(data), len(size)
+	{
+	}
+
+	constexpr T *data() const noexcept
+	{
+		return ptr;
+	}
+	constexpr size_t size() const noexcept
+	{
+		return len;
+	}
+	constexpr bool empty() const noexcept
+	{
+		return len == 0;
+	}
+	constexpr T &operator[](size_t i) const noexcept
+	{
+		return ptr[i];
+	}
+	constexpr T *begin() const noexcept
+	{
+		return ptr;
+	}
+	constexpr T *end() const noexcept
+	{
+		return ptr + len;
+	}
+};
+#endif
+
+namespace detail
+{
+
+/**
+ * @brief the FCAP type of a C++ type, and the size of the KTV header in front
+ * of its value
+*/
+template <typename T> struct type_info {
+	static constexpr bool valid = false;
+};
+
+#define FCAP_CPP_TYPE(cpp_type, fcap_type)                                     \
+	template <> struct type_info<cpp_type> {                               \
+		static constexpr bool valid = true;                            \
+		static constexpr FType type = fcap_type;                       \
+		static constexpr size_t header_size = 1;                       \
+	};
+
+FCAP_CPP_TYPE(uint8_t, FCAP_UINT8)
+FCAP_CPP_TYPE(uint16_t, FCAP_UINT16)
+FCAP_CPP_TYPE(int16_t, FCAP_INT16)
+FCAP_CPP_TYPE(int32_t, FCAP_INT32)
+FCAP_CPP_TYPE(int64_t, FCAP_INT64)
+FCAP_CPP_TYPE(float, FCAP_FLOAT)
+FCAP_CPP_TYPE(double, FCAP_DOUBLE)
+
+#undef FCAP_CPP_TYPE
+
+/* Binary values of a fixed length, after the length byte */
+template <size_t N> struct type_info<std::array<uint8_t, N>> {
+	static constexpr bool valid = N <= UINT8_MAX;
+	static constexpr FType type = FCAP_BINARY;
+	static constexpr size_t header_size = 2;
+};
+
+} // namespace detail
+
+/**
+ * @brief owns one reference to a packet from a pool, released when the handle
+ * is destroyed. Handles can be moved but not copied, so a reference is never
+ * released twice
+*/
+class packet
+{
+	FPool pool = nullptr;
+	FPacket pkt = nullptr;
+
+	packet(FPool pool, FPacket pkt) noexcept : pool(pool), pkt(pkt)
+	{
+	}
+
+    public:
+	packet() noexcept = default;
+
+	packet(packet &&other) noexcept : pool(other.pool), pkt(other.pkt)
+	{
+		other.pkt = nullptr;
+	}
+
+	packet &operator=(packet &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			pool = other.pool;
+			pkt = other.pkt;
+			other.pkt = nullptr;
+		}
+
+		return *this;
+	}
+
+	packet(const packet &) = delete;
+	packet &operator=(const packet &) = delete;
+
+	~packet()
+	{
+		reset();
+	}
+
+	/**
+	 * @brief takes a free packet from a pool, as per fcap_pool_acquire
+	 * @returns the handle, which is empty if every packet is in use
+	*/
+	static packet acquire(FPool pool) noexcept
+	{
+		return packet(pool, fcap_pool_acquire(pool));
+	}
+
+	/**
+	 * @brief takes another reference to a packet already acquired from a
+	 * pool, so it outlives the handler it was passed to
+	 * @returns the handle, which is empty if @pkt isn't from @pool
+	*/
+	static packet hold(FPool pool, FPacket pkt) noexcept
+	{
+		if (fcap_pool_hold(pool, pkt) < 0)
+			return packet();
+
+		return packet(pool, pkt);
+	}
+
+	/**
+	 * @brief releases the reference held, leaving the handle empty
+	*/
+	void reset() noexcept
+	{
+		if (pkt)
+			fcap_pool_release(pool, pkt);
+		pkt = nullptr;
+	}
+
+	FPacket get() const noexcept
+	{
+		return pkt;
+	}
+
+	FPacket operator->() const noexcept
+	{
+		return pkt;
+	}
+
+	explicit operator bool() const noexcept
+	{
+		return pkt != nullptr;
+	}
+};
+
+/**
+ * @brief builds a packet in place, as per fcap_builder
+*/
+class builder
+{
+	struct fcap_builder b;
+
+    public:
+	explicit builder(FPacket pkt) noexcept
+	{
+		fcap_builder_init(&b, pkt);
+	}
+
+	/**
+	 * @brief adds a key, its FType is the one of the C++ type of @value
+	 * @returns 0 on success or -FCAP_ERROR as per fcap_builder_add_key
+	 * @note a value of a type FCAP doesn't have fails to compile rather
+	 * than being converted
+	*/
+	template <typename T> int add(FKey key, const T &value) noexcept
+	{
+		static_assert(detail::type_info<T>::valid,
+			      "FCAP has no type for this C++ type");
+
+		return fcap_builder_add_key(&b,
+					    key,
+					    detail::type_info<T>::type,
+					    const_cast<T *>(&value),
+					    sizeof(value));
+	}
+
+	/**
+	 * @brief adds a binary key, copying the bytes straight into the packet
+	*/
+	int add(FKey key, span<const uint8_t> value) noexcept
+	{
+		return fcap_builder_add_key_bin(
+			&b, key, const_cast<uint8_t *>(value.data()),
+			value.size());
+	}
+
+	int num_bytes() noexcept
+	{
+		return fcap_builder_get_num_bytes(&b);
+	}
+
+	/**
+	 * @brief catches up with changes made to the packet other than
+	 * through the builder, as per fcap_builder_sync
+	*/
+	void sync() noexcept
+	{
+		fcap_builder_sync(&b);
+	}
+
+	FBuilder get() noexcept
+	{
+		return &b;
+	}
+};
+
+/**
+ * @brief a single KTV of a packet
+ * @param key the key
+ * @param type the type of the value
+ * @param value the bytes of the value inside the packet, without the length
+ * byte of a binary
+*/
+struct ktv {
+	FKey key;
+	FType type;
+	span<const uint8_t> value;
+};
+
+/**
+ * @brief reads a packet in place through a fcap_view
+ * @note like the view, values are only valid until the packet is modified
+*/
+class view
+{
+	struct fcap_view v = {};
+
+	ktv at(int key) const noexcept
+	{
+		const uint8_t *bytes = &v.pkt->ktv_bytes[v.offsets[key]];
+		FType type = static_cast<FType>(v.types[key]);
+
+		if (type == FCAP_BINARY)
+			return { static_cast<FKey>(key),
+				 type,
+				 { bytes + 2, bytes[1] } };
+
+		return { static_cast<FKey>(key),
+			 type,
+			 { bytes + 1, fcap_type_sizes[type] } };
+	}
+
+    public:
+	/**
+	 * @brief visits each key of the packet in key order
+	*/
+	class iterator
+	{
+		const view *owner;
+		uint32_t keys;
+
+	    public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = ktv;
+		using difference_type = std::ptrdiff_t;
+		using pointer = const ktv *;
+		using reference = ktv;
+
+		iterator(const view *owner, uint32_t keys) noexcept
+			: owner(owner), keys(keys)
+		{
+		}
+
+		ktv operator*() const noexcept
+		{
+			return owner->at(__builtin_ctz(keys));
+		}
+
+		iterator &operator++() noexcept
+		{
+			keys &= keys - 1;
+			return *this;
+		}
+
+		iterator operator++(int) noexcept
+		{
+			iterator prev = *this;
+			++*this;
+			return prev;
+		}
+
+		bool operator==(const iterator &other) const noexcept
+		{
+			return keys == other.keys;
+		}
+
+		bool operator!=(const iterator &other) const noexcept
+		{
+			return keys != other.keys;
+		}
+	};
+
+	/**
+	 * @brief validates and indexes received bytes, as per
+	 * fcap_decode_packet
+	*/
+	int decode(FPacket pkt, size_t num_bytes) noexcept
+	{
+		return fcap_decode_packet(&v, pkt, num_bytes);
+	}
+
+	/**
+	 * @brief indexes a trusted packet, as per fcap_view_init
+	*/
+	int init(FPacket pkt) noexcept
+	{
+		return fcap_view_init(&v, pkt);
+	}
+
+	bool has(FKey key) const noexcept
+	{
+		return key < NUM_KEYS && ((v.keys >> key) & 1);
+	}
+
+	/**
+	 * @brief reads the value of a key, which must be of exactly the FType
+	 * of @T
+	 * @returns 0 on success, -FCAP_ENOKEY if the key isn't in the packet or
+	 * -FCAP_ETYPE if it has another type or binary length
+	*/
+	template <typename T> int get(FKey key, T &value) const noexcept
+	{
+		static_assert(detail::type_info<T>::valid,
+			      "FCAP has no type for this C++ type");
+
+		if (!has(key))
+			return -FCAP_ENOKEY;
+
+		ktv kv = at(key);
+		if (kv.type != detail::type_info<T>::type ||
+		    kv.value.size() != sizeof(value))
+			return -FCAP_ETYPE;
+
+		std::memcpy(&value, kv.value.data(), sizeof(value));
+
+		return 0;
+	}
+
+	/**
+	 * @brief points @value at a binary value inside the packet, no bytes
+	 * are copied
+	 * @returns 0 on success, -FCAP_ENOKEY if the key isn't in the packet or
+	 * -FCAP_ETYPE if it isn't binary
+	*/
+	int get(FKey key, span<const uint8_t> &value) const noexcept
+	{
+		if (!has(key))
+			return -FCAP_ENOKEY;
+
+		ktv kv = at(key);
+		if (kv.type != FCAP_BINARY)
+			return -FCAP_ETYPE;
+
+		value = kv.value;
+
+		return 0;
+	}
+
+	iterator begin() const noexcept
+	{
+		return iterator(this, v.keys);
+	}
+
+	iterator end() const noexcept
+	{
+		return iterator(this, 0);
+	}
+
+	size_t size() const noexcept
+	{
+		return __builtin_popcount(v.keys);
+	}
+
+	FView get() noexcept
+	{
+		return &v;
+	}
+};
+
+} // namespace fcpp
+
+#endif /* FCAP_PKT_HPP */
@@ -0,0 +1,72 @@
+#ifndef FCAP_POOL_H
+#define FCAP_POOL_H
+
+#include <fcap_pkt.h>
+
+/**
+ * @brief a packet buffer owned by a pool
+ * @param pkt the packet, first so a packet from the pool is also its entry
+ * @param refs the number of references held to the packet, 0 when free
+*/
+struct fcap_pool_entry {
+	struct fcap_packet pkt;
+	uint8_t refs;
+};
+
+/**
+ * @brief a fixed number of packet buffers which can be acquired and released
+ * without allocating
+ * @param size the number of packets in the pool
+ * @param num_free the number of packets not currently acquired
+ * @param used a bitmap of the acquired packets, bit n is entry n
+ * @param entries the packets
+*/
+struct fcap_pool {
+	uint16_t size;
+	uint16_t num_free;
+	uint32_t *used;
+	struct fcap_pool_entry *entries;
+};
+typedef struct fcap_pool *FPool;
+
+#define FCAP_CREATE_POOL(name, size_in)                                        \
+	struct fcap_pool_entry name##_entries[size_in] = {};                   \
+	uint32_t name##_used[((size_in) + 31) / 32] = {};                      \
+	struct fcap_pool name##_internal = {                                   \
+		.size = size_in,                                               \
+		.num_free = size_in,                                           \
+		.used = name##_used,                                           \
+		.entries = name##_entries,                                     \
+	};                                                                     \
+	const FPool name = &name##_internal;
+
+/**
+ * @brief takes a free packet from the pool, with one reference held
+ * @param pool the pool to take the packet from
+ * @returns the packet or NULL if every packet is in use
+ * @note the contents of the packet are left as they were, use
+ * fcap_builder_init or fcap_init_packet before building it
+*/
+FPacket fcap_pool_acquire(FPool pool);
+
+/**
+ * @brief takes another reference to a packet, so it isn't given back to the
+ * pool until that reference is released too
+ * @param pool the pool the packet came from
+ * @param pkt the packet to hold
+ * @returns the number of references held or -FCAP_EINVAL if the packet isn't
+ * an acquired packet from @pool
+*/
+int fcap_pool_hold(FPool pool, FPacket pkt);
+
+/**
+ * @brief releases a reference to a packet, giving it back to the pool once
+ * no references are left
+ * @param pool the pool the packet came from
+ * @param pkt the packet to release
+ * @returns the number of references still held or -FCAP_EINVAL if the packet
+ * isn't an acquired packet from @pool
+*/
+int fcap_pool_release(FPool pool, FPacket pkt);
+
+#endif /* FCAP_POOL_H */
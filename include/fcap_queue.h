@@ -0,0 +1,114 @@
+#ifndef FCAP_QUEUE_H
+#define FCAP_QUEUE_H
+
+#include <fcap_pkt.h>
+
+/* Slots written by different threads are kept on separate cache lines */
+#ifndef FCAP_CACHE_LINE_SIZE
+#define FCAP_CACHE_LINE_SIZE 64
+#endif
+
+struct fcap_transport;
+
+/**
+ * @brief a built packet waiting in a queue to be sent
+ * @param seq which lap of the queue the slot is ready for, relative to the
+ * slot's index so that a zeroed queue is ready to use
+ * @param transport the transport to send the packet on
+ * @param builder the builder of @pkt
+ * @param pkt the packet
+*/
+struct fcap_queue_slot {
+	uint32_t seq;
+	struct fcap_transport *transport;
+	struct fcap_builder builder;
+	struct fcap_packet pkt;
+} __attribute__((aligned(FCAP_CACHE_LINE_SIZE)));
+
+/**
+ * @brief a bounded lock-free queue of built packets, which any number of
+ * threads may send through and a single thread drains
+ * @param size the number of slots, a power of 2
+ * @param slots the packets
+ * @param efd an eventfd which senders write when the queue may have gone from
+ * empty to not, -1 until fcap_queue_get_fd creates it
+ * @param tail the next position to be claimed by a sender
+ * @param head the next position to be drained
+ * @param signalled set by the sender which wrote @efd, so the others don't
+ * until the drainer has emptied the queue and cleared it
+ * @note @size, @slots and @efd are rarely written, so they have a line of
+ * their own rather than sharing one with either index
+*/
+struct fcap_queue {
+	uint32_t size;
+	struct fcap_queue_slot *slots;
+	int efd;
+	uint32_t tail __attribute__((aligned(FCAP_CACHE_LINE_SIZE)));
+	uint32_t head __attribute__((aligned(FCAP_CACHE_LINE_SIZE)));
+	uint32_t signalled __attribute__((aligned(FCAP_CACHE_LINE_SIZE)));
+};
+typedef struct fcap_queue *FQueue;
+
+/* The size must be a power of 2 */
+#define FCAP_CREATE_QUEUE(name, size_in)                                       \
+	struct fcap_queue_slot name##_slots[size_in] = {};                     \
+	struct fcap_queue name##_internal = {                                  \
+		.size = size_in,                                               \
+		.slots = name##_slots,                                         \
+		.efd = -1,                                                     \
+		.tail = 0,                                                     \
+		.head = 0,                                                     \
+	};                                                                     \
+	const FQueue name = &name##_internal;
+
+/**
+ * @brief copies a built packet into the queue, to be sent on a transport by
+ * the thread draining the queue. Safe to call from any thread
+ * @param queue the queue to send through
+ * @param transport the transport to send the packet on
+ * @param builder the built packet, which may be reused straight away
+ * @returns 0 on success, -FCAP_EINVAL on bad arguments or -FCAP_EAGAIN if the
+ * queue is full
+ * @note as with fcap_send_pkt, the message ID is assigned when the packet is
+ * actually sent
+*/
+int fcap_queue_send(FQueue queue,
+		    struct fcap_transport *transport,
+		    FBuilder builder);
+
+/**
+ * @brief gets the oldest packet in the queue without removing it. Must only
+ * be called by the thread draining the queue
+ * @param queue the queue to look at
+ * @returns the slot of the packet or NULL if the queue is empty, in which case
+ * the eventfd is cleared
+*/
+struct fcap_queue_slot *fcap_queue_peek(FQueue queue);
+
+/**
+ * @brief removes the oldest packet from the queue, freeing its slot for
+ * senders. Must only be called by the thread draining the queue, after
+ * fcap_queue_peek has returned a packet
+ * @param queue the queue to remove the packet from
+*/
+void fcap_queue_pop(FQueue queue);
+
+/**
+ * @brief gets an eventfd which becomes readable when packets are sent through
+ * the queue, creating it on first use. Must only be called by the thread
+ * draining the queue
+ * @param queue the queue to wait on
+ * @returns the eventfd or -errno on failure
+ * @note the eventfd is only written when the queue was empty, so it is
+ * edge-triggered: drain the queue until fcap_queue_peek returns NULL before
+ * waiting on it again
+*/
+int fcap_queue_get_fd(FQueue queue);
+
+/**
+ * @brief closes the queue's eventfd, if it has one
+ * @param queue the queue to clean up
+*/
+void fcap_queue_cleanup(FQueue queue);
+
+#endif /* FCAP_QUEUE_H */
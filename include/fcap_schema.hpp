@@ -0,0 +1,294 @@
+#ifndef FCAP_SCHEMA_HPP
+#define FCAP_SCHEMA_HPP
+
+#if __cplusplus < 201703L
+#error "fcap_schema.hpp needs C++17"
+#endif
+
+#include <fcap_pkt.hpp>
+
+#include <tuple>
+
+/*
+ * Messages with a fixed shape, declared as a list of (key, C++ type) fields:
+ *
+ *   using telemetry = fcpp::schema<fcpp::field<KEY_A, uint16_t>,
+ *                                  fcpp::field<KEY_B, double>>;
+ *
+ * The offset of every KTV is worked out at compile time, so encoding writes
+ * each value straight to its place and decoding checks the packet has exactly
+ * that layout with a compare per key, then reads each value with a single
+ * load. Asking for a key which isn't in the schema, or passing a value of the
+ * wrong type, fails to compile.
+ *
+ * The namespace is fcpp as struct fcap already takes the name fcap.
+ */
+namespace fcpp
+{
+
+/**
+ * @brief a single key of a schema and the C++ type of its value
+ * @param Key the key
+ * @param T the type of the value, one of the fixed width integers FCAP has,
+ * float, double or std::array<uint8_t, N> for binary
+*/
+template <FKey Key, typename T> struct field {
+	static_assert(detail::type_info<T>::valid,
+		      "FCAP has no type for this C++ type");
+	static_assert(Key < NUM_KEYS, "not a valid key");
+
+	static constexpr FKey key = Key;
+	using type = T;
+	static constexpr FType fcap_type = detail::type_info<T>::type;
+	static constexpr size_t header_size = detail::type_info<T>::header_size;
+	static constexpr size_t size = header_size + sizeof(T);
+
+	/* The key sits in the low 5 bits of the KTV header, the type above */
+	static constexpr uint8_t ktv_header =
+		static_cast<uint8_t>(Key | (fcap_type << 5));
+};
+
+/**
+ * @brief a message with a fixed set of keys in a fixed order
+ * @param Fields the fcpp::field of each key, in the order they are encoded
+*/
+template <typename... Fields> class schema
+{
+	static constexpr size_t num_fields = sizeof...(Fields);
+
+	static constexpr std::array<FKey, num_fields> keys = { Fields::key... };
+
+	static constexpr std::array<uint8_t, num_fields> ktv_headers = {
+		Fields::ktv_header...
+	};
+
+	static constexpr std::array<size_t, num_fields> offsets = [] {
+		std::array<size_t, num_fields> offs{};
+		size_t sizes[] = { Fields::size... };
+		size_t off = 0;
+
+		for (size_t i = 0; i < num_fields; i++) {
+			offs[i] = off;
+			off += sizes[i];
+		}
+
+		return offs;
+	}();
+
+	static constexpr size_t ktv_size = (Fields::size + ...);
+
+	static constexpr bool unique_keys()
+	{
+		for (size_t i = 0; i < num_fields; i++) {
+			for (size_t j = i + 1; j < num_fields; j++) {
+				if (keys[i] == keys[j])
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	static_assert(num_fields > 0, "a schema needs at least one key");
+	static_assert(num_fields < NUM_KEYS,
+		      "the header can't count that many keys");
+	static_assert(unique_keys(), "a key is in the schema more than once");
+	static_assert(ktv_size <= sizeof(ktv_bytes_t),
+		      "the schema doesn't fit in a packet");
+
+	template <size_t I> using field_at =
+		std::tuple_element_t<I, std::tuple<Fields...>>;
+
+	template <FKey Key> static constexpr size_t find()
+	{
+		for (size_t i = 0; i < num_fields; i++) {
+			if (keys[i] == Key)
+				return i;
+		}
+
+		return num_fields;
+	}
+
+	template <FKey Key> static constexpr size_t index_of()
+	{
+		static_assert(find<Key>() < num_fields,
+			      "the key isn't in the schema");
+		return find<Key>();
+	}
+
+	template <size_t I>
+	static void write(FPacket pkt, const typename field_at<I>::type &value)
+	{
+		uint8_t *ktv = &pkt->ktv_bytes[offsets[I]];
+
+		ktv[0] = ktv_headers[I];
+		if constexpr (field_at<I>::fcap_type == FCAP_BINARY)
+			ktv[1] = sizeof(value);
+
+		std::memcpy(ktv + field_at<I>::header_size,
+			    &value,
+			    sizeof(value));
+	}
+
+	template <typename... Args> static constexpr bool same_types()
+	{
+		if constexpr (sizeof...(Args) != num_fields)
+			return false;
+		else
+			return (std::is_same_v<Args, typename Fields::type> &&
+				...);
+	}
+
+	template <size_t... I>
+	static void write_all(FPacket pkt,
+			      std::index_sequence<I...>,
+			      const typename Fields::type &...values)
+	{
+		(write<I>(pkt, values), ...);
+	}
+
+	template <size_t I> static auto read(const struct fcap_packet *pkt)
+	{
+		typename field_at<I>::type value;
+
+		std::memcpy(&value,
+			    &pkt->ktv_bytes[offsets[I] +
+					    field_at<I>::header_size],
+			    sizeof(value));
+
+		return value;
+	}
+
+	template <size_t... I>
+	static std::tuple<typename Fields::type...>
+	read_all(const struct fcap_packet *pkt, std::index_sequence<I...>)
+	{
+		return { read<I>(pkt)... };
+	}
+
+    public:
+	/* The value of every key, in schema order */
+	using values = std::tuple<typename Fields::type...>;
+
+	/* The type of a key's value */
+	template <FKey Key>
+	using type_of = typename field_at<index_of<Key>()>::type;
+
+	/* The length of every packet of this schema */
+	static constexpr size_t num_bytes =
+		sizeof(struct fcap_header) + ktv_size;
+
+	/**
+	 * @brief fills a builder's packet with a value for every key, leaving
+	 * the message ID and type as they are
+	 * @param builder an initialised builder, any keys already added are
+	 * replaced
+	 * @param values the value of each key, in schema order
+	 * @note each value must have exactly the type of its key, as with set,
+	 * so a value is never silently converted
+	*/
+	template <typename... Args>
+	static void encode(FBuilder builder, const Args &...values)
+	{
+		static_assert(sizeof...(Args) == num_fields,
+			      "a value is needed for every key of the schema");
+		static_assert(same_types<Args...>(),
+			      "a value has the wrong type for its key");
+
+		write_all(builder->pkt,
+			  std::index_sequence_for<Fields...>{},
+			  values...);
+
+		builder->pkt->header.num_keys = num_fields;
+		builder->keys = ((1u << Fields::key) | ...);
+		builder->num_bytes = ktv_size;
+	}
+
+	static void encode(FBuilder builder, const values &vals)
+	{
+		std::apply([builder](const auto &...v) { encode(builder, v...); },
+			   vals);
+	}
+
+	/**
+	 * @brief checks a received packet has exactly the layout of this
+	 * schema, so its values can be read directly
+	 * @param pkt the packet received
+	 * @param num_bytes the number of bytes received
+	*/
+	static bool matches(const struct fcap_packet *pkt, size_t num_bytes)
+	{
+		if (num_bytes != schema::num_bytes ||
+		    pkt->header.num_keys != num_fields)
+			return false;
+
+		for (size_t i = 0; i < num_fields; i++) {
+			if (pkt->ktv_bytes[offsets[i]] != ktv_headers[i])
+				return false;
+		}
+
+		return check_lengths(pkt, std::index_sequence_for<Fields...>{});
+	}
+
+	/**
+	 * @brief reads every value out of a received packet
+	 * @param pkt the packet received
+	 * @param num_bytes the number of bytes received
+	 * @param out filled in with the value of each key, in schema order
+	 * @returns 0 on success or -FCAP_EINVAL if the packet doesn't have the
+	 * layout of this schema, for instance because its keys were added in
+	 * another order, in which case use a fcap_view
+	*/
+	static int decode(const struct fcap_packet *pkt,
+			  size_t num_bytes,
+			  values &out)
+	{
+		if (!matches(pkt, num_bytes))
+			return -FCAP_EINVAL;
+
+		out = read_all(pkt, std::index_sequence_for<Fields...>{});
+
+		return 0;
+	}
+
+	/**
+	 * @brief reads a single value out of a packet which matches the schema
+	*/
+	template <FKey Key> static type_of<Key> get(const struct fcap_packet *pkt)
+	{
+		return read<index_of<Key>()>(pkt);
+	}
+
+	/**
+	 * @brief changes a single value of a packet which matches the schema
+	 * @note the value must have exactly the type of the key, so a value
+	 * is never silently narrowed
+	*/
+	template <FKey Key, typename T> static void set(FPacket pkt, const T &value)
+	{
+		static_assert(std::is_same_v<T, type_of<Key>>,
+			      "the value has the wrong type for the key");
+		write<index_of<Key>()>(pkt, value);
+	}
+
+    private:
+	template <size_t... I>
+	static bool check_lengths(const struct fcap_packet *pkt,
+				  std::index_sequence<I...>)
+	{
+		return (check_length<I>(pkt) && ...);
+	}
+
+	template <size_t I> static bool check_length(const struct fcap_packet *pkt)
+	{
+		if constexpr (field_at<I>::fcap_type == FCAP_BINARY)
+			return pkt->ktv_bytes[offsets[I] + 1] ==
+			       sizeof(typename field_at<I>::type);
+		else
+			return true;
+	}
+};
+
+} // namespace fcpp
+
+#endif /* FCAP_SCHEMA_HPP */
@@ -0,0 +1,93 @@
+#ifndef FCAP_SHARD_H
+#define FCAP_SHARD_H
+
+#include <fcap.h>
+#include <fcap_udp.h>
+#include <pthread.h>
+
+/* The longest a worker sleeps before checking if it has been stopped */
+#ifndef FCAP_SHARD_WAIT_MS
+#define FCAP_SHARD_WAIT_MS 100
+#endif
+
+/**
+ * @brief a worker thread running its own fcap app on its own udp socket
+ * @param app the worker's fcap instance
+ * @param udp_priv the worker's udp socket
+ * @param udp the worker's udp transport
+ * @param transports the transport array of @app
+ * @param pending the pending request table of @app
+ * @param counters the metrics of @app, see fcap_get_metrics
+ * @param thread the thread running the worker
+ * @param cpu the core the worker is pinned to, -1 if not pinned
+ * @param running cleared to stop the worker
+ * @param error the first error the worker's app returned, 0 if none. The
+ * worker keeps running after an error
+*/
+struct fcap_worker {
+	struct fcap app;
+	struct fcap_udp udp_priv;
+	struct fcap_transport udp;
+	FTransport transports[1];
+	struct fcap_pending pending[1];
+	struct fcap_counters counters[1];
+	pthread_t thread;
+	int cpu;
+	int running;
+	int error;
+};
+
+/**
+ * @brief how to set up each worker of a sharded server
+ * @param server_port the port every worker listens on
+ * @param middleware the middleware shared by every worker, which must be safe
+ * to call from several threads at once
+ * @param num_middleware the size of the @middleware array
+ * @param on_request the request handler of every worker
+ * @param on_response the response handler of every worker
+ * @param priv an array of private contexts, one per worker, or NULL
+ * @param first_cpu the core to pin the first worker to, the next worker is
+ * pinned to the next core and so on. -1 to not pin the workers
+*/
+struct fcap_shard_config {
+	int server_port;
+	const FMiddleware *middleware;
+	uint8_t num_middleware;
+	enum handler_code (*on_request)(FApp app, FEvent event, FPacket res);
+	enum handler_code (*on_response)(FApp app, FEvent event);
+	void **priv;
+	int first_cpu;
+};
+
+#define FCAP_CREATE_WORKERS(name, num)                                         \
+	struct fcap_worker name[num];                                          \
+	const int name##_size = num;
+
+/**
+ * @brief starts a worker thread per worker, each with its own app and its own
+ * udp socket bound to the same port with SO_REUSEPORT, so the kernel spreads
+ * peers between the workers. Each worker responds to whichever peer sent the
+ * request
+ * @param workers the workers to start
+ * @param num_workers the size of the @workers array
+ * @param config how to set up each worker
+ * @returns 0 on success or -errno on failure, in which case no worker is left
+ * running
+ * @note a peer is always handled by the same worker for as long as the set of
+ * workers doesn't change, so workers don't share any state
+*/
+int fcap_shard_start(struct fcap_worker *workers,
+		     int num_workers,
+		     const struct fcap_shard_config *config);
+
+/**
+ * @brief stops every worker, waiting for each to finish what it's handling,
+ * and cleans up their apps and sockets
+ * @param workers the workers to stop
+ * @param num_workers the size of the @workers array
+ * @returns 0 if no worker hit an error, otherwise the first error of the first
+ * worker which did
+*/
+int fcap_shard_stop(struct fcap_worker *workers, int num_workers);
+
+#endif /* FCAP_SHARD_H */
@@ -0,0 +1,135 @@
+#ifndef FCAP_SHM_H
+#define FCAP_SHM_H
+
+#include <fcap_pkt.h>
+#include <limits.h>
+
+/* The number of packets each direction of a ring can hold, a power of 2 */
+#ifndef FCAP_SHM_RING_SIZE
+#define FCAP_SHM_RING_SIZE 256
+#endif
+
+/* Indices written by different processes are kept on separate cache lines */
+#ifndef FCAP_CACHE_LINE_SIZE
+#define FCAP_CACHE_LINE_SIZE 64
+#endif
+
+/**
+ * @brief one direction of a shared memory channel, written by a single
+ * producer and read by a single consumer
+ * @param tail the total number of packets written, only stored by the producer
+ * @param head the total number of packets read, only stored by the consumer
+ * @param signalled set by the producer when it has woken the consumer, so the
+ * consumer only clears its eventfd when there is something to clear
+ * @param lens the length of each packet in @bufs
+ * @param bufs the packets
+*/
+struct fcap_shm_ring {
+	uint32_t tail __attribute__((aligned(FCAP_CACHE_LINE_SIZE)));
+	uint32_t head __attribute__((aligned(FCAP_CACHE_LINE_SIZE)));
+	uint32_t signalled __attribute__((aligned(FCAP_CACHE_LINE_SIZE)));
+	uint8_t lens[FCAP_SHM_RING_SIZE]
+		__attribute__((aligned(FCAP_CACHE_LINE_SIZE)));
+	uint8_t bufs[FCAP_SHM_RING_SIZE][MTU];
+};
+
+/**
+ * @brief the memory shared by both ends of a channel, the end which created
+ * it sends on the first ring and the other end sends on the second
+*/
+struct fcap_shm_region {
+	struct fcap_shm_ring rings[2];
+};
+
+/**
+ * @brief the private context of one end of a shared memory transport
+ * @param region the mapped shared memory
+ * @param rx the ring this end reads from
+ * @param tx the ring this end writes to
+ * @param rx_tail the last tail of @rx seen, so it is only reloaded once every
+ * packet up to it has been read
+ * @param tx_head the last head of @tx seen, so it is only reloaded once the
+ * ring looks full
+ * @param rx_efd an eventfd which becomes readable when @rx has data, -1 if
+ * wakeups aren't used
+ * @param tx_efd the eventfd of the other end, -1 if wakeups aren't used
+ * @param missed_wakeups the number of packets sent whose wakeup of the other
+ * end failed
+ * @param name the name of the shared memory object, empty if it has none
+ * @param owner whether this end created the named object and removes it
+*/
+typedef struct fcap_shm {
+	struct fcap_shm_region *region;
+	struct fcap_shm_ring *rx;
+	struct fcap_shm_ring *tx;
+	uint32_t rx_tail;
+	uint32_t tx_head;
+	int rx_efd;
+	int tx_efd;
+	uint32_t missed_wakeups;
+	char name[NAME_MAX];
+	uint8_t owner;
+} fcap_shm_t;
+
+/**
+ * @brief send bytes function as per fcap.h spec
+ * @returns the number of bytes sent or -FCAP_EAGAIN if the ring is full
+ * @note the other end is only woken when the ring was empty, a busy consumer
+ * never costs the producer a syscall. A wakeup which fails is counted in
+ * missed_wakeups, the packet is still sent
+*/
+int fcap_shm_send_bytes(void *priv, uint8_t *bytes, size_t length);
+
+/**
+ * @brief get bytes function as per fcap.h spec
+*/
+int fcap_shm_get_bytes(void *priv, uint8_t *bytes, size_t length);
+
+/**
+ * @brief get fd function as per fcap.h spec
+ * @returns the eventfd of this end or -1 if wakeups aren't used
+*/
+int fcap_shm_get_fd(void *priv);
+
+#define FCAP_CREATE_SHM_TRANSPORT(name)                                        \
+	struct fcap_shm name##_priv;                                           \
+	struct fcap_transport name = {                                         \
+		.priv = &name##_priv,                                          \
+		.get_bytes = fcap_shm_get_bytes,                               \
+		.send_bytes = fcap_shm_send_bytes,                             \
+		.get_fd = fcap_shm_get_fd,                                     \
+	};
+
+/**
+ * @brief maps a named shared memory object in /dev/shm, for processes which
+ * find each other by name. One end creates the object and the other opens it
+ * @param priv the shm transport struct
+ * @param name the name of the object, starting with a '/'
+ * @param create whether to create the object, which fails with -EEXIST if it
+ * already exists
+ * @returns 0 on success or -errno on failure
+ * @note named channels have no wakeups, so fcap_poll_wait retries them every
+ * FCAP_WAIT_RETRY_MS
+*/
+int fcap_shm_setup_transport(void *priv, const char *name, int create);
+
+/**
+ * @brief creates an anonymous channel backed by a memfd and sets up both of
+ * its ends, for a process which then forks or hands one end to a thread. Each
+ * end holds its own mapping and descriptors, so each is cleaned up on its own
+ * @param priv_a the shm transport struct of one end
+ * @param priv_b the shm transport struct of the other end
+ * @param wakeups whether to create an eventfd per end, so fcap_poll_wait can
+ * sleep until the other end sends something
+ * @returns 0 on success or -errno on failure
+*/
+int fcap_shm_setup_pair(void *priv_a, void *priv_b, int wakeups);
+
+/**
+ * @brief unmaps the shared memory and closes the eventfds, removing the named
+ * object if this end created it. Should be called on shutdown
+ * @param priv the shm transport struct
+*/
+void fcap_shm_cleanup(void *priv);
+
+#endif /* FCAP_SHM_H */
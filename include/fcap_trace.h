@@ -0,0 +1,93 @@
+#ifndef FCAP_TRACE_H
+#define FCAP_TRACE_H
+
+#include <stdint.h>
+
+/* The number of events each thread can record before they are drained */
+#ifndef FCAP_TRACE_RING_SIZE
+#define FCAP_TRACE_RING_SIZE 4096
+#endif
+
+/**
+ * @brief the stages of fcap_poll and the send functions which are traced.
+ * Receives are only traced when there was a packet, so idle polling doesn't
+ * fill the rings
+*/
+enum fcap_trace_stage {
+	FCAP_TRACE_RECV = 0,
+	FCAP_TRACE_MW_REQUEST = 1,
+	FCAP_TRACE_MW_RESPONSE = 2,
+	FCAP_TRACE_USER = 3,
+	FCAP_TRACE_SEND = 4,
+};
+
+/**
+ * @brief a single traced stage
+ * @param start_ns when the stage started, from the monotonic clock
+ * @param duration_ns how long the stage took
+ * @param thread the id of the thread which ran the stage
+ * @param stage the enum fcap_trace_stage
+ * @param index the middleware's index for middleware stages, otherwise the
+ * transport's index in the app
+ * @param message_id the message ID of the packet
+ * @param is_outbound whether the packet was being sent (1) or received (0)
+*/
+struct fcap_trace_event {
+	uint64_t start_ns;
+	uint32_t duration_ns;
+	uint32_t thread;
+	uint8_t stage;
+	uint8_t index;
+	uint8_t message_id;
+	uint8_t is_outbound;
+};
+
+#ifdef FCAP_TRACE
+
+/**
+ * @brief takes the recorded events out of every thread's ring, including the
+ * rings of threads which have since exited. Only one thread may drain at once
+ * @param events filled in with the events, oldest first for each thread
+ * @param max_events the size of the @events array
+ * @returns the number of events taken
+*/
+int fcap_trace_drain(struct fcap_trace_event *events, int max_events);
+
+/**
+ * @brief gets the number of events dropped because a ring was full, over
+ * every thread since the program started
+*/
+uint64_t fcap_trace_dropped(void);
+
+/* Used by the trace points in the fcap core */
+uint64_t fcap_trace_now(void);
+void fcap_trace_record(uint64_t start_ns,
+		       uint8_t stage,
+		       uint8_t index,
+		       uint8_t message_id,
+		       uint8_t is_outbound);
+
+#define FCAP_TRACE_START(start) uint64_t start = fcap_trace_now()
+#define FCAP_TRACE_END(start, stage, index, message_id, is_outbound)           \
+	fcap_trace_record(start, stage, index, message_id, is_outbound)
+
+#else
+
+/* Without tracing there is nothing to drain, and the trace points are gone */
+static inline int fcap_trace_drain(struct fcap_trace_event *events,
+				   int max_events)
+{
+	return 0;
+}
+
+static inline uint64_t fcap_trace_dropped(void)
+{
+	return 0;
+}
+
+#define FCAP_TRACE_START(start)
+#define FCAP_TRACE_END(start, stage, index, message_id, is_outbound)
+
+#endif /* FCAP_TRACE */
+
+#endif /* FCAP_TRACE_H */
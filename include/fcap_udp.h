@@ -1,26 +1,48 @@
 #ifndef FCAP_UDP_H
 #define FCAP_UDP_H
 
+#include <fcap_dgram.h>
 #include <netinet/ip.h>
 
+/**
+ * @brief the private context of a udp transport
+ * @param dgram the socket and its send and receive rings
+ * @param server_addr the address the socket is bound to
+*/
 typedef struct fcap_udp {
-	int sockfd;
+	struct fcap_dgram dgram;
 	struct sockaddr_in server_addr;
-	struct sockaddr_in dest_addr;
 } fcap_udp_t;
 
 /**
  * @brief send bytes function as per fcap.h spec
+ * @note the bytes are queued until the transport is flushed, as per
+ * fcap_dgram_send_bytes
 */
 int fcap_udp_send_bytes(void *priv, uint8_t *bytes, size_t length);
 
+/**
+ * @brief get fd function as per fcap.h spec
+*/
+int fcap_udp_get_fd(void *priv);
+
+/**
+ * @brief flush function as per fcap.h spec, see fcap_dgram_flush
+*/
+int fcap_udp_flush(void *priv);
+
+/**
+ * @brief take drops function as per fcap.h spec
+*/
+int fcap_udp_take_drops(void *priv);
+
 // /**
 //  * @brief poll function as per fcap.h spec
 // */
 // int fcap_udp_poll(void *priv);
 
 /**
- * @brief get bytes function as per fcap.h spec
+ * @brief get bytes function as per fcap.h spec, see fcap_dgram_get_bytes
 */
 int fcap_udp_get_bytes(void *priv, uint8_t *bytes, size_t length);
 
@@ -30,6 +52,9 @@ int fcap_udp_get_bytes(void *priv, uint8_t *bytes, size_t length);
 		.priv = &name##_priv,                                          \
 		.get_bytes = fcap_udp_get_bytes,                               \
 		.send_bytes = fcap_udp_send_bytes,                             \
+		.flush = fcap_udp_flush,                                       \
+		.take_drops = fcap_udp_take_drops,                             \
+		.get_fd = fcap_udp_get_fd,                                     \
 	};
 
 /**
@@ -37,8 +62,9 @@ int fcap_udp_get_bytes(void *priv, uint8_t *bytes, size_t length);
  * on the specifed server port
  * @param udp the udp transport struct
  * @param server_port the port to listen to
- * @param dest_ip the ip address of the peer
- * @param dest_port the port of the peer
+ * @param dest_ip the ip address of the peer, NULL to reply to whoever sent the
+ * last datagram read, as a server would
+ * @param dest_port the port of the peer, unused when @dest_ip is NULL
  * @returns 0 on success or -errno on failure
 */
 int fcap_udp_setup_transport(void *priv,
@@ -47,7 +73,19 @@ int fcap_udp_setup_transport(void *priv,
 			     int dest_port);
 
 /**
- * @brief closes the socket, should be called on shutdown
+ * @brief Sets up a udp socket as per fcap_udp_setup_transport, except that
+ * other sockets may bind to the same port with SO_REUSEPORT and the kernel
+ * will spread incoming datagrams between them
+ * @returns 0 on success or -errno on failure
+*/
+int fcap_udp_setup_reuseport_transport(void *priv,
+				       int server_port,
+				       char *dest_ip,
+				       int dest_port);
+
+/**
+ * @brief flushes anything still queued and closes the socket, should be called
+ * on shutdown
  * @param priv the udp transport struct
 */
 void fcap_udp_cleanup(void *priv);
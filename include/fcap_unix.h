@@ -0,0 +1,81 @@
+#ifndef FCAP_UNIX_H
+#define FCAP_UNIX_H
+
+#include <fcap_dgram.h>
+#include <sys/un.h>
+
+/**
+ * @brief the private context of a unix datagram socket transport
+ * @param dgram the socket and its send and receive rings
+ * @param server_addr the address the socket is bound to
+ * @param server_len the length of @server_addr
+*/
+typedef struct fcap_unix {
+	struct fcap_dgram dgram;
+	struct sockaddr_un server_addr;
+	socklen_t server_len;
+} fcap_unix_t;
+
+/**
+ * @brief send bytes function as per fcap.h spec
+ * @note the bytes are queued until the transport is flushed, as per
+ * fcap_dgram_send_bytes
+*/
+int fcap_unix_send_bytes(void *priv, uint8_t *bytes, size_t length);
+
+/**
+ * @brief get fd function as per fcap.h spec
+*/
+int fcap_unix_get_fd(void *priv);
+
+/**
+ * @brief flush function as per fcap.h spec, see fcap_dgram_flush
+*/
+int fcap_unix_flush(void *priv);
+
+/**
+ * @brief take drops function as per fcap.h spec
+*/
+int fcap_unix_take_drops(void *priv);
+
+/**
+ * @brief get bytes function as per fcap.h spec, see fcap_dgram_get_bytes
+*/
+int fcap_unix_get_bytes(void *priv, uint8_t *bytes, size_t length);
+
+#define FCAP_CREATE_UNIX_TRANSPORT(name)                                       \
+	struct fcap_unix name##_priv;                                          \
+	struct fcap_transport name = {                                         \
+		.priv = &name##_priv,                                          \
+		.get_bytes = fcap_unix_get_bytes,                              \
+		.send_bytes = fcap_unix_send_bytes,                            \
+		.flush = fcap_unix_flush,                                      \
+		.take_drops = fcap_unix_take_drops,                            \
+		.get_fd = fcap_unix_get_fd,                                    \
+	};
+
+/**
+ * @brief Sets up a unix datagram socket bound to a path. A path starting with
+ * '@' is in the abstract namespace, which needs no file and goes away with
+ * the socket
+ * @param priv the unix transport struct
+ * @param server_path the path to bind to. A socket file left there by a
+ * socket which has since closed is replaced, anything else there makes the
+ * bind fail. NULL to bind to an unused abstract address, which is enough for
+ * the peer to reply to
+ * @param dest_path the path of the peer, NULL to reply to whoever sent the last
+ * datagram read, as a server would
+ * @returns 0 on success or -errno on failure
+*/
+int fcap_unix_setup_transport(void *priv,
+			      const char *server_path,
+			      const char *dest_path);
+
+/**
+ * @brief flushes anything still queued, closes the socket and removes its file,
+ * should be called on shutdown
+ * @param priv the unix transport struct
+*/
+void fcap_unix_cleanup(void *priv);
+
+#endif /* FCAP_UNIX_H */
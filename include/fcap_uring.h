@@ -0,0 +1,146 @@
+#ifndef FCAP_URING_H
+#define FCAP_URING_H
+
+#include <fcap_pkt.h>
+#include <netinet/ip.h>
+#include <sys/socket.h>
+
+/* The number of receive buffers handed to the kernel, must be a power of 2 */
+#ifndef FCAP_URING_NUM_BUFS
+#define FCAP_URING_NUM_BUFS 64
+#endif
+
+/* The most sends which can be in flight at once, at most 64 */
+#ifndef FCAP_URING_QUEUE_SIZE
+#define FCAP_URING_QUEUE_SIZE 32
+#endif
+
+/* The size of the submission queue */
+#define FCAP_URING_ENTRIES (FCAP_URING_QUEUE_SIZE * 2)
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+/**
+ * @brief the private context of an io_uring udp transport
+ * @param sockfd the bound udp socket
+ * @param ring_fd the io_uring instance
+ * @param server_addr the address the socket is bound to
+ * @param dest_addr the address of the peer
+ * @param ring the mapped submission and completion rings
+ * @param ring_size the size of @ring
+ * @param sqes the mapped submission queue entries
+ * @param sqes_size the size of @sqes
+ * @param sq_head, sq_tail, sq_mask the submission ring, shared with the kernel
+ * @param sq_next the tail of the submission ring including entries which have
+ * been prepared but not yet submitted
+ * @param cq_head, cq_tail, cq_mask, cqes the completion ring, shared with the
+ * kernel
+ * @param buf_ring the ring of receive buffers provided to the kernel
+ * @param buf_tail the tail of @buf_ring
+ * @param recv_armed whether the multishot receive is still posted
+ * @param recv_error the error the multishot receive last stopped with, 0 if
+ * none
+ * @param rx_head the oldest received datagram waiting to be read
+ * @param rx_count the number of received datagrams waiting to be read
+ * @param rx_ids the buffer id of each received datagram waiting to be read
+ * @param rx_lens the length of each received datagram waiting to be read
+ * @param rx_bufs the receive buffers, one byte over the MTU so that datagrams
+ * too big to be a packet can be spotted
+ * @param tx_busy a bitmap of the send slots which are in flight
+ * @param tx_iovs, tx_msgs the message for each send slot
+ * @param tx_bufs the bytes for each send slot
+*/
+typedef struct fcap_uring {
+	int sockfd;
+	int ring_fd;
+	struct sockaddr_in server_addr;
+	struct sockaddr_in dest_addr;
+
+	void *ring;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t *sq_mask;
+	uint32_t sq_next;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct io_uring_buf_ring *buf_ring;
+	uint16_t buf_tail;
+	uint8_t recv_armed;
+	int recv_error;
+	uint16_t rx_head;
+	uint16_t rx_count;
+	uint16_t rx_ids[FCAP_URING_NUM_BUFS];
+	uint16_t rx_lens[FCAP_URING_NUM_BUFS];
+	uint8_t rx_bufs[FCAP_URING_NUM_BUFS][MTU + 1];
+
+	uint64_t tx_busy;
+	struct iovec tx_iovs[FCAP_URING_QUEUE_SIZE];
+	struct msghdr tx_msgs[FCAP_URING_QUEUE_SIZE];
+	uint8_t tx_bufs[FCAP_URING_QUEUE_SIZE][MTU];
+} fcap_uring_t;
+
+/**
+ * @brief send bytes function as per fcap.h spec
+ * @note the send is prepared but only submitted to the kernel when the
+ * transport is flushed, so every send from one poll goes in one syscall
+*/
+int fcap_uring_send_bytes(void *priv, uint8_t *bytes, size_t length);
+
+/**
+ * @brief get bytes function as per fcap.h spec
+ * @note a multishot receive is kept posted, so this only reaps the completion
+ * queue and doesn't need a syscall
+*/
+int fcap_uring_get_bytes(void *priv, uint8_t *bytes, size_t length);
+
+/**
+ * @brief flush function as per fcap.h spec
+*/
+int fcap_uring_flush(void *priv);
+
+/**
+ * @brief get fd function as per fcap.h spec
+*/
+int fcap_uring_get_fd(void *priv);
+
+#define FCAP_CREATE_URING_TRANSPORT(name)                                      \
+	struct fcap_uring name##_priv;                                         \
+	struct fcap_transport name = {                                         \
+		.priv = &name##_priv,                                          \
+		.get_bytes = fcap_uring_get_bytes,                             \
+		.send_bytes = fcap_uring_send_bytes,                           \
+		.flush = fcap_uring_flush,                                     \
+		.get_fd = fcap_uring_get_fd,                                   \
+	};
+
+/**
+ * @brief Sets up a udp socket which binds to any ip address on the host on
+ * the specifed server port, and an io_uring instance to drive it
+ * @param priv the io_uring transport struct
+ * @param server_port the port to listen to
+ * @param dest_ip the ip address of the peer
+ * @param dest_port the port of the peer
+ * @returns 0 on success, -EOPNOTSUPP if the kernel lacks registered buffer
+ * rings or multishot receive, or -errno on failure
+*/
+int fcap_uring_setup_transport(void *priv,
+			       int server_port,
+			       char *dest_ip,
+			       int dest_port);
+
+/**
+ * @brief waits for in flight sends and tears down the ring and the socket,
+ * should be called on shutdown
+ * @param priv the io_uring transport struct
+*/
+void fcap_uring_cleanup(void *priv);
+
+#endif /* FCAP_URING_H */
@@ -1,8 +1,336 @@
 #include <fcap.h>
+#include <fcap_trace.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief gets the time from a monotonic clock
+ * @returns the time in microseconds
+*/
+static uint64_t fcap_now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
 void inline fcap_init_instance(FApp app)
 {
-	fcap_init_packet(&(app->out_pkt));
+	int i;
+
+	fcap_builder_init(&app->out_builder, &app->out_pkt);
+
+	/* Let peer transports find this app to hand packets straight to it */
+	for (i = 0; i < app->num_transports; i++)
+		app->transports[i]->app = app;
+	app->busy = 0;
+
+	/* Forget about any requests which were still waiting */
+	if (app->pending)
+		memset(app->pending,
+		       0,
+		       sizeof(*app->pending) * app->num_transports);
+	app->next_deadline_us = 0;
+
+	if (app->counters)
+		memset(app->counters,
+		       0,
+		       sizeof(*app->counters) * app->num_transports);
+}
+
+void fcap_init_app(FApp app,
+		   const FTransport *transports,
+		   uint8_t num_transports,
+		   const FMiddleware *middleware,
+		   uint8_t num_middleware,
+		   struct fcap_pending *pending)
+{
+	memset(app, 0, sizeof(*app));
+
+	app->num_transports = num_transports;
+	app->num_middleware = num_middleware;
+	app->transports = transports;
+	app->middleware = middleware;
+	app->pending = pending;
+	app->wait_fd = -1;
+
+	fcap_init_instance(app);
+}
+
+void fcap_cleanup_instance(FApp app)
+{
+	if (app->wait_fd >= 0)
+		close(app->wait_fd);
+
+	app->wait_fd = -1;
+
+	if (app->queue)
+		fcap_queue_cleanup(app->queue);
+}
+
+/**
+ * @brief finds where a transport is in an app's transport array, which is
+ * also where its pending table and counters are
+ * @returns the index or -1 if the transport isn't one of the app's
+*/
+static int fcap_transport_index(FApp app, FTransport transport)
+{
+	int i;
+
+	for (i = 0; i < app->num_transports; i++) {
+		if (app->transports[i] == transport)
+			return i;
+	}
+
+	return -1;
+}
+
+/*    Metrics    */
+
+static inline struct fcap_counters *fcap_get_counters(FApp app, int idx)
+{
+	return app->counters && idx >= 0 ? &app->counters[idx] : NULL;
+}
+
+/* Only the polling thread counts, so a relaxed load and store is enough */
+static inline void fcap_count(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter,
+			 __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+#define FCAP_COUNT(counters, field, n)                                         \
+	do {                                                                   \
+		if (counters)                                                  \
+			fcap_count(&(counters)->count.field, (n));             \
+	} while (0)
+
+/**
+ * @brief counts the result of sending a packet
+ * @param ret the number of bytes sent or -errno on failure
+*/
+static inline void fcap_count_send(struct fcap_counters *counters, int ret)
+{
+	if (ret < 0) {
+		FCAP_COUNT(counters, send_failures, 1);
+		return;
+	}
+
+	FCAP_COUNT(counters, pkts_out, 1);
+	FCAP_COUNT(counters, bytes_out, ret);
+}
+
+/* The metrics are a flat run of counters, so they're handled as an array */
+#define FCAP_NUM_METRICS (sizeof(struct fcap_metrics) / sizeof(uint64_t))
+
+/**
+ * @brief adds what a transport has counted since its last reset to a snapshot
+*/
+static void fcap_add_metrics(struct fcap_counters *counters,
+			     struct fcap_metrics *metrics)
+{
+	size_t i;
+	uint64_t *count = (uint64_t *)&counters->count;
+	uint64_t *base = (uint64_t *)&counters->base;
+	uint64_t *sum = (uint64_t *)metrics;
+
+	for (i = 0; i < FCAP_NUM_METRICS; i++)
+		sum[i] += __atomic_load_n(&count[i], __ATOMIC_RELAXED) -
+			  __atomic_load_n(&base[i], __ATOMIC_RELAXED);
+}
+
+int fcap_get_metrics(FApp app, FTransport transport,
+		     struct fcap_metrics *metrics)
+{
+	int i;
+	int idx = -1;
+
+	if (!app->counters || !metrics)
+		return -FCAP_EINVAL;
+
+	if (transport) {
+		idx = fcap_transport_index(app, transport);
+		if (idx < 0)
+			return -FCAP_EINVAL;
+	}
+
+	memset(metrics, 0, sizeof(*metrics));
+	for (i = 0; i < app->num_transports; i++) {
+		if (idx < 0 || idx == i)
+			fcap_add_metrics(&app->counters[i], metrics);
+	}
+
+	return 0;
+}
+
+int fcap_reset_metrics(FApp app, FTransport transport)
+{
+	int i;
+	size_t j;
+	int idx = -1;
+	uint64_t *count;
+	uint64_t *base;
+
+	if (!app->counters)
+		return -FCAP_EINVAL;
+
+	if (transport) {
+		idx = fcap_transport_index(app, transport);
+		if (idx < 0)
+			return -FCAP_EINVAL;
+	}
+
+	for (i = 0; i < app->num_transports; i++) {
+		if (idx >= 0 && idx != i)
+			continue;
+
+		count = (uint64_t *)&app->counters[i].count;
+		base = (uint64_t *)&app->counters[i].base;
+		for (j = 0; j < FCAP_NUM_METRICS; j++)
+			__atomic_store_n(&base[j],
+					 __atomic_load_n(&count[j],
+							 __ATOMIC_RELAXED),
+					 __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+/*    Tracking Requests    */
+
+/**
+ * @brief finds the pending request table of a transport
+ * @returns the table or NULL if the app doesn't track requests or the
+ * transport isn't one of the app's
+*/
+static struct fcap_pending *fcap_get_pending(FApp app, FTransport transport)
+{
+	int idx;
+
+	if (!app->pending)
+		return NULL;
+
+	idx = fcap_transport_index(app, transport);
+
+	return idx >= 0 ? &app->pending[idx] : NULL;
+}
+
+static inline int fcap_pending_is_used(struct fcap_pending *pending, int id)
+{
+	return (pending->used[id / 64] >> (id % 64)) & 1;
+}
+
+/**
+ * @brief hands out the next message ID which isn't in use. IDs are handed out
+ * in turn, so the first one tried is almost always free
+ * @returns the message ID or -FCAP_EAGAIN if every ID is in use
+*/
+static int fcap_next_id(struct fcap_pending *pending)
+{
+	int i;
+	int id;
+
+	for (i = 0; i < FCAP_NUM_MESSAGE_IDS; i++) {
+		id = (pending->next_id + i) % FCAP_NUM_MESSAGE_IDS;
+		if (!fcap_pending_is_used(pending, id)) {
+			pending->next_id = (id + 1) % FCAP_NUM_MESSAGE_IDS;
+			return id;
+		}
+	}
+
+	return -FCAP_EAGAIN;
+}
+
+/**
+ * @brief starts tracking a request under a message ID
+*/
+static void fcap_pending_add(FApp app,
+			     struct fcap_pending *pending,
+			     int id,
+			     uint64_t deadline_us,
+			     FDoneFn on_done,
+			     void *priv)
+{
+	pending->used[id / 64] |= 1ull << (id % 64);
+	pending->num_pending++;
+	pending->reqs[id].on_done = on_done;
+	pending->reqs[id].priv = priv;
+	pending->reqs[id].deadline_us = deadline_us;
+
+	if (deadline_us &&
+	    (!app->next_deadline_us || deadline_us < app->next_deadline_us))
+		app->next_deadline_us = deadline_us;
+}
+
+/**
+ * @brief stops tracking a request
+ * @returns a copy of the request, so its ID can be reused straight away
+*/
+static struct fcap_pending_req fcap_pending_remove(struct fcap_pending *pending,
+						   int id)
+{
+	pending->used[id / 64] &= ~(1ull << (id % 64));
+	pending->num_pending--;
+
+	return pending->reqs[id];
+}
+
+/**
+ * @brief times out every tracked request which is due and works out when the
+ * next one is due
+ * @param app the app to check
+ * @param now_us the current time as per fcap_now_us
+*/
+static void fcap_expire_pending(FApp app, uint64_t now_us)
+{
+	int i;
+	int id;
+	int word;
+	uint64_t bits;
+	uint64_t next_us = 0;
+	uint64_t deadline_us;
+	struct fcap_pending *pending;
+	struct fcap_pending_req req;
+
+	/* Requests sent by the callbacks below update this as they go */
+	app->next_deadline_us = 0;
+
+	for (i = 0; i < app->num_transports; i++) {
+		pending = &app->pending[i];
+
+		for (word = 0; word < FCAP_NUM_MESSAGE_IDS / 64; word++) {
+			bits = pending->used[word];
+			while (bits) {
+				id = word * 64 + __builtin_ctzll(bits);
+				bits &= bits - 1;
+
+				deadline_us = pending->reqs[id].deadline_us;
+				if (!deadline_us)
+					continue;
+
+				if (deadline_us > now_us) {
+					if (!next_us || deadline_us < next_us)
+						next_us = deadline_us;
+					continue;
+				}
+
+				req = fcap_pending_remove(pending, id);
+				req.on_done(
+					app, NULL, FCAP_ETIMEDOUT, req.priv);
+			}
+		}
+	}
+
+	if (next_us &&
+	    (!app->next_deadline_us || next_us < app->next_deadline_us))
+		app->next_deadline_us = next_us;
 }
 
 /*    Sending Functions    */
@@ -12,7 +340,8 @@ void inline fcap_init_instance(FApp app)
  * @param middleware an array of FMiddleware
  * @param num_middleware the size of the @middleware array
  * @param event the event we are processing
- * @param res a pointer to a response packet which a middleware can fill
+ * @param res a pointer to a response packet which a middleware can fill, NULL
+ * for outbound requests
 */
 static enum handler_code fcap_do_req_middleware(const FMiddleware *middleware,
 						int num_middleware,
@@ -25,8 +354,8 @@ static enum handler_code fcap_do_req_middleware(const FMiddleware *middleware,
 	 * If packet is outbound, do the middleware in order, if inbound,
 	 * do them in reverse
 	 */
-	int i = num_middleware;
-	int end = 0;
+	int i = num_middleware - 1;
+	int end = -1;
 	int step = -1;
 
 	if (event->is_outbound) {
@@ -35,18 +364,22 @@ static enum handler_code fcap_do_req_middleware(const FMiddleware *middleware,
 		step = 1;
 	}
 
-	while (i != end) {
+	for (; i != end; i += step) {
 		if (!middleware[i]->on_request)
 			continue;
 
+		FCAP_TRACE_START(start);
 		code = middleware[i]->on_request(
 			middleware[i]->priv, event, res);
+		FCAP_TRACE_END(start,
+			       FCAP_TRACE_MW_REQUEST,
+			       i,
+			       event->pkt->header.message_id,
+			       event->is_outbound);
 
 		/* Early return if error or someone has already responded */
 		if (code != FCAP_CONTINUE)
 			return code;
-
-		i += step;
 	}
 
 	return FCAP_CONTINUE;
@@ -62,8 +395,8 @@ static enum handler_code fcap_do_res_middleware(const FMiddleware *middleware,
 	 * If packet is outbound, do the middleware in order, if inbound,
 	 * do them in reverse
 	 */
-	int i = num_middleware;
-	int end = 0;
+	int i = num_middleware - 1;
+	int end = -1;
 	int step = -1;
 
 	if (event->is_outbound) {
@@ -72,247 +405,898 @@ static enum handler_code fcap_do_res_middleware(const FMiddleware *middleware,
 		step = 1;
 	}
 
-	while (i != end) {
+	for (; i != end; i += step) {
 		if (!middleware[i]->on_response)
 			continue;
 
+		FCAP_TRACE_START(start);
 		code = middleware[i]->on_response(middleware[i]->priv, event);
+		FCAP_TRACE_END(start,
+			       FCAP_TRACE_MW_RESPONSE,
+			       i,
+			       event->pkt->header.message_id,
+			       event->is_outbound);
 
 		/* Early return if error or someone has already responded */
 		if (code != FCAP_CONTINUE)
 			return code;
-
-		i += step;
 	}
 
 	return FCAP_CONTINUE;
 }
 
-FError fcap_send_req(FApp app, FTransport transport)
+static FError fcap_handle_packet(FApp app,
+				 FTransport transport,
+				 int idx,
+				 FPacket pkt,
+				 size_t num_bytes);
+
+/**
+ * @brief sends a packet out on a transport, handing it straight to the app at
+ * the other end if the transport has an in-process peer which isn't busy
+ * @param idx the index of @transport in the sending app, for tracing
+ * @returns the number of bytes sent or -errno on failure
+*/
+static int fcap_transmit(FTransport transport,
+			 int idx,
+			 FPacket pkt,
+			 size_t num_bytes)
 {
 	int ret;
-	enum handler_code code;
+	FApp peer_app;
+	FPacket peer_pkt;
+	FTransport peer = transport->peer;
 
-	if (transport == NULL)
-		return -FCAP_EINVAL;
+	/*
+	 * A busy app is still using its rx buffers, so it gets the packet
+	 * through the transport like any other and picks it up when it next
+	 * polls
+	 */
+	peer_app = peer ? peer->app : NULL;
+	if (!peer_app || peer_app->busy) {
+		FCAP_TRACE_START(start);
+		ret = transport->send_bytes(
+			transport->priv, (uint8_t *)pkt, num_bytes);
+		FCAP_TRACE_END(start,
+			       FCAP_TRACE_SEND,
+			       idx,
+			       pkt->header.message_id,
+			       1);
+		return ret;
+	}
+
+	/*
+	 * Copy it in as if it had been received, so the peer owns the packet
+	 * and its handlers can hold on to it as usual
+	 */
+	peer_pkt = fcap_pool_acquire(peer_app->pool);
+	if (peer_pkt == NULL)
+		peer_pkt = &peer_app->in_pkt;
+
+	memcpy(peer_pkt, pkt, num_bytes);
+
+	/*
+	 * The peer may answer straight away, so have the tx buffer ready for
+	 * any requests the handlers of the response want to send
+	 */
+	if (transport->app && pkt == &transport->app->out_pkt)
+		fcap_builder_init(&transport->app->out_builder,
+				  &transport->app->out_pkt);
+
+	/* Like a packet on the wire, what the peer makes of it is its business */
+	fcap_handle_packet(peer_app,
+			   peer,
+			   fcap_transport_index(peer_app, peer),
+			   peer_pkt,
+			   num_bytes);
+
+	if (peer_pkt != &peer_app->in_pkt)
+		fcap_pool_release(peer_app->pool, peer_pkt);
+
+	return num_bytes;
+}
+
+/**
+ * @brief runs a built request through the middleware and sends it
+*/
+static FError fcap_send_built(FApp app, FTransport transport, FBuilder builder)
+{
+	int ret;
+	int idx;
+	enum handler_code code;
+	struct fcap_counters *counters;
 
 	struct fcap_event event = {
 		.is_outbound = 1,
-		.pkt = &app->out_pkt,
+		.pkt = builder->pkt,
 		.transport = transport,
 	};
 
+	idx = fcap_transport_index(app, transport);
+	counters = fcap_get_counters(app, idx);
+
+	/*
+	 * There is no response to an outbound request yet, and the packet
+	 * buffers may hold the request being handled, so give it nothing
+	 */
 	code = fcap_do_req_middleware(
-		app->middleware, app->num_middleware, &event, &app->in_pkt);
+		app->middleware, app->num_middleware, &event, NULL);
+
+	if (code < 0) {
+		FCAP_COUNT(counters, aborts, 1);
+		return -FCAP_EINVAL;
+	}
+
+	/* The middleware may have changed the packet behind the builder */
+	fcap_builder_sync(builder);
+
+	ret = fcap_transmit(transport,
+			    idx,
+			    builder->pkt,
+			    fcap_builder_get_num_bytes(builder));
+	fcap_count_send(counters, ret);
+
+	return ret;
+}
+
+FError fcap_send_pkt(FApp app, FTransport transport, FBuilder builder)
+{
+	int id;
+	struct fcap_pending *pending;
 
-	if (code < 0)
+	if (transport == NULL || builder == NULL)
 		return -FCAP_EINVAL;
 
-	// TODO: handle internal loopback / short-circuiting
+	/* Don't reuse an ID a tracked request is waiting on */
+	pending = fcap_get_pending(app, transport);
+	if (pending) {
+		id = fcap_next_id(pending);
+		if (id < 0)
+			return id;
+
+		builder->pkt->header.message_id = id;
+	}
+
+	return fcap_send_built(app, transport, builder);
+}
+
+FError fcap_send_req(FApp app, FTransport transport)
+{
+	int ret;
 
-	ret = transport->send_bytes(transport->priv,
-				    (uint8_t *)&app->out_pkt,
-				    fcap_get_num_bytes(&app->out_pkt));
+	ret = fcap_send_pkt(app, transport, &app->out_builder);
 
 	/* Clean the packet after sending it */
-	fcap_init_packet(&app->out_pkt);
+	fcap_builder_init(&app->out_builder, &app->out_pkt);
 
 	return ret;
 }
 
+/**
+ * @brief sends a built request and tracks it until it is done with
+ * @returns the message ID of the request or -errno on failure
+*/
+static FError fcap_send_tracked(FApp app,
+				FTransport transport,
+				FBuilder builder,
+				uint32_t timeout_ms,
+				FDoneFn on_done,
+				void *priv)
+{
+	int id;
+	int ret;
+	uint64_t deadline_us = 0;
+	struct fcap_pending *pending;
+
+	pending = fcap_get_pending(app, transport);
+	if (!pending || !on_done)
+		return -FCAP_EINVAL;
+
+	if (pending->window && pending->num_pending >= pending->window)
+		return -FCAP_EAGAIN;
+
+	id = fcap_next_id(pending);
+	if (id < 0)
+		return id;
+
+	builder->pkt->header.message_id = id;
+	fcap_set_type(builder->pkt, FCAP_REQUEST);
+
+	if (timeout_ms)
+		deadline_us = fcap_now_us() + (uint64_t)timeout_ms * 1000;
+
+	/* Track it first in case the response is delivered during the send */
+	fcap_pending_add(app, pending, id, deadline_us, on_done, priv);
+
+	ret = fcap_send_built(app, transport, builder);
+	if (ret < 0) {
+		if (fcap_pending_is_used(pending, id))
+			fcap_pending_remove(pending, id);
+		return ret;
+	}
+
+	return id;
+}
+
+FError fcap_send_req_cb(FApp app,
+			FTransport transport,
+			uint32_t timeout_ms,
+			FDoneFn on_done,
+			void *priv)
+{
+	int ret;
+
+	ret = fcap_send_tracked(
+		app, transport, &app->out_builder, timeout_ms, on_done, priv);
+
+	/* Clean the packet after sending it */
+	fcap_builder_init(&app->out_builder, &app->out_pkt);
+
+	return ret;
+}
+
+FError fcap_send_async(FApp app,
+		       FTransport transport,
+		       FBuilder builder,
+		       uint32_t timeout_ms,
+		       FDoneFn on_done,
+		       void *priv)
+{
+	if (transport == NULL || builder == NULL)
+		return -FCAP_EINVAL;
+
+	return fcap_send_tracked(
+		app, transport, builder, timeout_ms, on_done, priv);
+}
+
+int fcap_set_window(FApp app, FTransport transport, uint8_t window)
+{
+	struct fcap_pending *pending = fcap_get_pending(app, transport);
+
+	if (!pending || window > FCAP_NUM_MESSAGE_IDS)
+		return -FCAP_EINVAL;
+
+	pending->window = window;
+
+	return 0;
+}
+
+int fcap_flush(FApp app)
+{
+	int i;
+	int ret;
+	int err = 0;
+	int num_queued = 0;
+	FTransport transport;
+	struct fcap_counters *counters;
+
+	for (i = 0; i < app->num_transports; i++) {
+		transport = app->transports[i];
+		if (!transport->flush)
+			continue;
+
+		counters = fcap_get_counters(app, i);
+		ret = transport->flush(transport->priv);
+
+		if (transport->take_drops)
+			FCAP_COUNT(counters,
+				   send_failures,
+				   transport->take_drops(transport->priv));
+
+		/* One broken transport mustn't hold up the others */
+		if (ret < 0) {
+			FCAP_COUNT(counters, send_failures, 1);
+			if (err == 0)
+				err = ret;
+			continue;
+		}
+
+		num_queued += ret;
+	}
+
+	if (err < 0)
+		return err;
+
+	return num_queued;
+}
+
 /*    Receiving Functions    */
 
-FError fcap_poll(FApp app)
+/**
+ * @brief passes a request on to the apps handler, or the global handler if
+ * the app doesn't have one
+*/
+static enum handler_code fcap_recv_req(FApp app, FEvent event, FPacket res)
+{
+	if (app->on_request)
+		return app->on_request(app, event, res);
+
+	if (fcap_user_recv_req)
+		return fcap_user_recv_req(app, event, res);
+
+	return FCAP_CONTINUE;
+}
+
+/**
+ * @brief passes a response on to the apps handler, or the global handler if
+ * the app doesn't have one
+*/
+static enum handler_code fcap_recv_res(FApp app, FEvent event)
+{
+	if (app->on_response)
+		return app->on_response(app, event);
+
+	if (fcap_user_recv_res)
+		return fcap_user_recv_res(app, event);
+
+	return FCAP_CONTINUE;
+}
+
+/**
+ * @brief handles a single packet which has been received, see
+ * fcap_handle_packet
+*/
+static FError fcap_dispatch_packet(FApp app,
+				   FTransport transport,
+				   int idx,
+				   FPacket pkt,
+				   size_t num_bytes)
 {
 	/*
-	 * Note: the logic of this poll fuction is quite intricate and 
-	 * the order of operations is very specific. Please take extreme
-	 * care if modifying any part of this function.
+	 * Note: the logic of this function is quite intricate and the order
+	 * of operations is very specific. Please take extreme care if
+	 * modifying any part of this function.
 	 */
-	int i;
 	int ret = 0;
+	int id;
 	enum handler_code code;
+	struct fcap_pending_req req;
+	struct fcap_pending *pending = NULL;
+	struct fcap_counters *counters = fcap_get_counters(app, idx);
 
-	for (i = 0; i < app->num_transports; i++) {
-		/* clear the in packet just incase... */
-		fcap_init_packet(&app->in_pkt);
+	if (app->pending && idx >= 0)
+		pending = &app->pending[idx];
 
-		ret = app->transports[i]->get_bytes(app->transports[i]->priv,
-						    (uint8_t *)&app->in_pkt,
-						    sizeof(app->in_pkt));
-		if (ret < 0)
-			return ret;
+	FCAP_COUNT(counters, pkts_in, 1);
+	FCAP_COUNT(counters, bytes_in, num_bytes);
 
-		/* No data :( */
-		if (ret == 0)
-			continue;
+	/* 
+	 * Check the packet is valid and index the keys once so every lookup
+	 * after this is direct. Malformed packets are dropped.
+	 */
+	if (fcap_decode_packet(&app->in_view, pkt, num_bytes) < 0) {
+		FCAP_COUNT(counters, decode_rejects, 1);
+		return 0;
+	}
+
+	struct fcap_event event = {
+		.is_outbound = 0,
+		.pkt = pkt,
+		.view = &app->in_view,
+		.transport = transport,
+	};
 
-		struct fcap_event event = {
-			.is_outbound = 0,
-			.pkt = &app->in_pkt,
-			.transport = app->transports[i],
-		};
-
-		/* we have a request! */
-		switch (fcap_get_type(&app->in_pkt)) {
-		case FCAP_REQUEST:
-			/* run it through the incoming request middleware */
-			code = fcap_do_req_middleware(app->middleware,
-						      app->num_middleware,
-						      &event,
-						      &app->out_pkt);
-
-			/* Ask the user if the want to respond */
-			if (code == FCAP_CONTINUE)
-				code = fcap_user_recv_req(
-					app, &event, &app->out_pkt);
+	/* we have a request! */
+	switch (fcap_get_type(pkt)) {
+	case FCAP_REQUEST:
+		FCAP_COUNT(counters, requests, 1);
+
+		/* 
+		 * The response is built in the tx buffer, so clear it before
+		 * anyone gets a chance to fill it
+		 */
+		fcap_builder_init(&app->out_builder, &app->out_pkt);
+
+		/* run it through the incoming request middleware */
+		code = fcap_do_req_middleware(app->middleware,
+					      app->num_middleware,
+					      &event,
+					      &app->out_pkt);
+		if (code == FCAP_ABORT)
+			FCAP_COUNT(counters, aborts, 1);
+
+		/* So the user can keep building on what the middleware added */
+		fcap_builder_sync(&app->out_builder);
+
+		/* Ask the user if the want to respond */
+		if (code == FCAP_CONTINUE) {
+			FCAP_TRACE_START(start);
+			code = fcap_recv_req(app, &event, &app->out_pkt);
+			FCAP_TRACE_END(start,
+				       FCAP_TRACE_USER,
+				       idx,
+				       pkt->header.message_id,
+				       0);
+		}
 
+		/* 
+		 * The req middleware or the user has handed the request, so
+		 * apply the middleware and send it out
+		 */
+		if (code == FCAP_RESPOND) {
 			/* 
-			 * The req middleware or the user has handed the
-			 * request, so apply the middleware and send it out
+			 * Modify the event to now refer to the outgoing 
+			 * response
 			 */
-			if (code == FCAP_RESPOND) {
-				/* We're about to use this, so clear it! */
-				fcap_init_packet(&app->out_pkt);
+			event.is_outbound = 1;
+			event.pkt = &app->out_pkt;
+			event.view = NULL;
 
-				/* 
-				 * Modify the event to now refer to the outgoing 
-				 * response
+			/* Copy the message ID into the response */
+			app->out_pkt.header.message_id =
+				pkt->header.message_id;
+
+			/* Set the message as a response */
+			fcap_set_type(&app->out_pkt, FCAP_RESPONSE);
+
+			code = fcap_do_res_middleware(
+				app->middleware, app->num_middleware, &event);
+
+			if (code != FCAP_ABORT) {
+				/*
+				 * The user and the middleware are free to
+				 * change the response without the builder
 				 */
-				event.is_outbound = 1;
-				event.pkt = &app->out_pkt;
-
-				/* Copy the message ID into the response */
-				app->out_pkt.header.message_id =
-					app->in_pkt.header.message_id;
-
-				/* Set the message as a response */
-				fcap_set_type(&app->out_pkt, FCAP_RESPONSE);
-
-				code = fcap_do_res_middleware(
-					app->middleware,
-					app->num_middleware,
-					&event);
-
-				if (code != FCAP_ABORT) {
-					ret = app->transports[i]->send_bytes(
-						&app->transports[i]->priv,
-						(uint8_t *)&app->out_pkt,
-						fcap_get_num_bytes(
-							&app->out_pkt));
-				}
+				fcap_builder_sync(&app->out_builder);
+
+				ret = fcap_transmit(transport,
+						    idx,
+						    &app->out_pkt,
+						    fcap_builder_get_num_bytes(
+							    &app->out_builder));
+				fcap_count_send(counters, ret);
+			} else {
+				FCAP_COUNT(counters, aborts, 1);
 			}
+		}
 
-			if (code == FCAP_ABORT || ret < 0)
-				return -FCAP_EINVAL;
+		if (code == FCAP_ABORT || ret < 0)
+			return -FCAP_EINVAL;
 
-			break;
+		break;
+
+	case FCAP_RESPONSE:
+		FCAP_COUNT(counters, responses, 1);
+
+		/* We have a response to an existing request */
+		code = fcap_do_res_middleware(
+			app->middleware, app->num_middleware, &event);
+		if (code == FCAP_ABORT)
+			FCAP_COUNT(counters, aborts, 1);
+
+		/* 
+		 * Tracked requests get their response directly, anything else
+		 * goes to the user
+		 */
+		id = pkt->header.message_id;
+		FCAP_TRACE_START(start);
+		if (code == FCAP_CONTINUE && pending &&
+		    fcap_pending_is_used(pending, id)) {
+			req = fcap_pending_remove(pending, id);
+			req.on_done(app, &event, FCAP_ENONE, req.priv);
+		} else if (code == FCAP_CONTINUE) {
+			code = fcap_recv_res(app, &event);
+		}
+		FCAP_TRACE_END(start, FCAP_TRACE_USER, idx, id, 0);
 
-		case FCAP_RESPONSE:
-			/* We have a response to an existing request */
-			code = fcap_do_res_middleware(
-				app->middleware, app->num_middleware, &event);
+		/* 
+		 * If either the middleware or user aborted, then propagate
+		 * this error back up 
+		 */
+		if (code == FCAP_ABORT)
+			return -FCAP_EINVAL;
+
+		/* 
+		 * if either middleware or user returned FCAP_RESPONDED, then
+		 * we don't need to do anything because it doesn't make sense
+		 * to response to a response.
+		 */
+		break;
+
+	default:
+		return -FCAP_EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief handles a single packet which has been received
+ * @param app the app which received the packet
+ * @param transport the transport the packet came from
+ * @param idx the index of @transport in the app, -1 if it isn't one of the
+ * app's
+ * @param pkt the packet received, either the rx buffer or one from the pool
+ * @param num_bytes the number of bytes received
+ * @returns 0 on success or -errno on failure
+*/
+static FError fcap_handle_packet(FApp app,
+				 FTransport transport,
+				 int idx,
+				 FPacket pkt,
+				 size_t num_bytes)
+{
+	int ret;
 
-			if (code == FCAP_CONTINUE)
-				code = fcap_user_recv_res(app, &event);
+	/* Peers queue for us until the rx and tx buffers are free again */
+	app->busy++;
+	ret = fcap_dispatch_packet(app, transport, idx, pkt, num_bytes);
+	app->busy--;
 
+	return ret;
+}
+
+/**
+ * @brief sends the packets other threads have put in the app's queue
+*/
+static void fcap_drain_queue(FApp app)
+{
+	int ret;
+	struct fcap_queue_slot *slot;
+
+	if (!app->queue)
+		return;
+
+	while ((slot = fcap_queue_peek(app->queue))) {
+		ret = fcap_send_pkt(app, slot->transport, &slot->builder);
+
+		/* Out of IDs or room to send, try again on the next poll */
+		if (ret == -FCAP_EAGAIN)
+			return;
+
+		/* The sender is long gone, so a packet which fails is dropped */
+		fcap_queue_pop(app->queue);
+	}
+}
+
+int fcap_poll(FApp app)
+{
+	int i;
+	int num_pkts;
+	int num_bytes;
+	int total_pkts = 0;
+	int ret = 0;
+	uint64_t now_us;
+	FPacket pkt;
+	FTransport transport;
+	struct fcap_counters *counters;
+
+	for (i = 0; i < app->num_transports; i++) {
+		transport = app->transports[i];
+		counters = fcap_get_counters(app, i);
+
+		/* 
+		 * Drain everything the transport has ready, up to a budget so
+		 * a busy transport can't starve the others
+		 */
+		for (num_pkts = 0; num_pkts < FCAP_POLL_BUDGET; num_pkts++) {
 			/* 
-			 * If either the middleware or user aborted, then
-			  * propagate this error back up 
-			  */
-			if (code == FCAP_ABORT)
-				return -FCAP_EINVAL;
+			 * Receive into the pool if it has room, so handlers
+			 * can keep the packet
+			 */
+			pkt = fcap_pool_acquire(app->pool);
+			if (pkt == NULL)
+				pkt = &app->in_pkt;
 
 			/* 
-			 * if either middleware or user returned FCAP_RESPONDED,
-			 * then we don't need to do anything because it doesn't
-			 * make sense to response to a response.
+			 * The packet isn't cleared, decoding checks every byte
+			 * received and reads nothing else
 			 */
-			break;
+			FCAP_TRACE_START(start);
+			num_bytes = transport->get_bytes(transport->priv,
+							 (uint8_t *)pkt,
+							 sizeof(*pkt));
+			ret = num_bytes;
+			if (num_bytes > 0) {
+				FCAP_TRACE_END(start,
+					       FCAP_TRACE_RECV,
+					       i,
+					       pkt->header.message_id,
+					       0);
+				ret = fcap_handle_packet(
+					app, transport, i, pkt, num_bytes);
+			}
 
-		default:
-			return -FCAP_EINVAL;
+			/* Handlers which kept the packet hold their own ref */
+			if (pkt != &app->in_pkt)
+				fcap_pool_release(app->pool, pkt);
+
+			if (ret < 0)
+				return ret;
+
+			/* No data :( */
+			if (num_bytes == 0 && num_pkts == 0)
+				FCAP_COUNT(counters, empty_polls, 1);
+			if (num_bytes == 0)
+				break;
+		}
+
+		total_pkts += num_pkts;
+	}
+
+	/* Only look at the clock while a tracked request can time out */
+	if (app->next_deadline_us) {
+		now_us = fcap_now_us();
+		if (now_us >= app->next_deadline_us)
+			fcap_expire_pending(app, now_us);
+	}
+
+	fcap_drain_queue(app);
+
+	/* Send all the responses queued up while handling requests */
+	ret = fcap_flush(app);
+	if (ret < 0)
+		return ret;
+
+	return total_pkts;
+}
+
+/**
+ * @brief how long is left until a deadline, rounded up to whole milliseconds
+ * @param deadline_us the deadline as per fcap_now_us
+*/
+static int fcap_wait_remaining_ms(uint64_t deadline_us)
+{
+	uint64_t now = fcap_now_us();
+
+	if (now >= deadline_us)
+		return 0;
+
+	return (deadline_us - now + 999) / 1000;
+}
+
+/**
+ * @brief creates the epoll instance for an app and adds every transport which
+ * can be waited on to it
+ * @param app the app to set up
+ * @returns 0 on success or -errno on failure
+*/
+static FError fcap_wait_setup(FApp app)
+{
+	int i;
+	int fd;
+	int ret;
+	FTransport transport;
+	struct epoll_event event = {
+		.events = EPOLLIN,
+	};
+
+	app->wait_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (app->wait_fd < 0)
+		return -errno;
+
+	app->wait_all = 1;
+	for (i = 0; i < app->num_transports; i++) {
+		transport = app->transports[i];
+
+		fd = -1;
+		if (transport->get_fd)
+			fd = transport->get_fd(transport->priv);
+
+		if (fd < 0) {
+			app->wait_all = 0;
+			continue;
+		}
+
+		event.data.ptr = transport;
+		if (epoll_ctl(app->wait_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			ret = -errno;
+			close(app->wait_fd);
+			app->wait_fd = -1;
+			return ret;
+		}
+	}
+
+	/* The queue's eventfd only fires when it goes from empty to not */
+	if (app->queue) {
+		fd = fcap_queue_get_fd(app->queue);
+		event.events = EPOLLIN | EPOLLET;
+		event.data.ptr = app->queue;
+		if (fd < 0 ||
+		    epoll_ctl(app->wait_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			ret = fd < 0 ? fd : -errno;
+			close(app->wait_fd);
+			app->wait_fd = -1;
+			return ret;
 		}
 	}
+
 	return 0;
 }
 
+/**
+ * @brief adapts how long to spin for, based on how long the app slept
+ * @param app the app to adapt
+ * @param slept_us how long the app slept before it was woken by data, or
+ * UINT64_MAX if nothing woke it
+*/
+static void fcap_adapt_spin(FApp app, uint64_t slept_us)
+{
+	if (!app->spin_max_us)
+		return;
+
+	/* 
+	 * Data turned up soon enough that spinning for a bit longer would
+	 * have caught it without the cost of sleeping
+	 */
+	if (slept_us < app->spin_max_us) {
+		app->spin_us = app->spin_us ? app->spin_us * 2 : 1;
+		if (app->spin_us > app->spin_max_us)
+			app->spin_us = app->spin_max_us;
+	} else {
+		app->spin_us /= 2;
+	}
+}
+
+int fcap_poll_wait(FApp app, int timeout_ms)
+{
+	int ret;
+	int wait_ms;
+	uint64_t start;
+	uint64_t slept_us;
+	uint64_t now_us;
+	uint64_t expire_us;
+	uint64_t deadline = 0;
+	struct epoll_event event;
+
+	ret = fcap_poll(app);
+	if (ret != 0)
+		return ret;
+
+	/* Spin for a bit first, in case more data is just about to arrive */
+	if (app->spin_us) {
+		start = fcap_now_us();
+		do {
+			ret = fcap_poll(app);
+			if (ret != 0)
+				return ret;
+		} while (fcap_now_us() - start < app->spin_us);
+	}
+
+	if (app->wait_fd < 0) {
+		ret = fcap_wait_setup(app);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (timeout_ms >= 0)
+		deadline = fcap_now_us() + (uint64_t)timeout_ms * 1000;
+
+	/*
+	 * Wakeups which don't end up with a packet, like a dropped datagram,
+	 * don't end the wait early
+	 */
+	for (;;) {
+		/* 
+		 * Don't sleep past retrying queued output, including packets
+		 * left in the queue, or polling the transports which can't
+		 * wake us up
+		 */
+		ret = fcap_flush(app);
+		if (ret < 0)
+			return ret;
+
+		wait_ms = timeout_ms;
+		if (timeout_ms >= 0)
+			wait_ms = fcap_wait_remaining_ms(deadline);
+
+		if ((ret > 0 || !app->wait_all ||
+		     (app->queue && fcap_queue_peek(app->queue))) &&
+		    (wait_ms < 0 || wait_ms > FCAP_WAIT_RETRY_MS))
+			wait_ms = FCAP_WAIT_RETRY_MS;
+
+		/* 
+		 * Wake up in time to time out the next tracked request, which
+		 * ends the wait as its callback may have more to do
+		 */
+		expire_us = app->next_deadline_us;
+		if (expire_us) {
+			ret = fcap_wait_remaining_ms(expire_us);
+			if (wait_ms < 0 || ret < wait_ms)
+				wait_ms = ret;
+		}
+
+		start = fcap_now_us();
+		ret = epoll_wait(app->wait_fd, &event, 1, wait_ms);
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+
+		slept_us = ret > 0 ? fcap_now_us() - start : UINT64_MAX;
+		fcap_adapt_spin(app, slept_us);
+
+		ret = fcap_poll(app);
+		if (ret != 0)
+			return ret;
+
+		now_us = fcap_now_us();
+		if ((timeout_ms >= 0 && now_us >= deadline) ||
+		    (expire_us && now_us >= expire_us))
+			return 0;
+	}
+}
+
+void fcap_set_spin(FApp app, uint32_t max_us)
+{
+	app->spin_max_us = max_us;
+	app->spin_us = max_us;
+}
+
 inline int fcap_app_add_key_bin(FApp app, FKey key, uint8_t *data, size_t len)
 {
-	return fcap_add_key_bin(&app->out_pkt, key, data, len);
+	return fcap_builder_add_key_bin(&app->out_builder, key, data, len);
 }
 
 inline int fcap_app_add_key_u8(FApp app, FKey key, uint8_t value)
 {
-	return fcap_add_key_u8(&app->out_pkt, key, value);
+	return fcap_builder_add_key_u8(&app->out_builder, key, value);
 }
 
 inline int fcap_app_add_key_u16(FApp app, FKey key, uint16_t value)
 {
-	return fcap_add_key_u16(&app->out_pkt, key, value);
+	return fcap_builder_add_key_u16(&app->out_builder, key, value);
 }
 
 inline int fcap_app_add_key_i16(FApp app, FKey key, int16_t value)
 {
-	return fcap_add_key_i32(&app->out_pkt, key, value);
+	return fcap_builder_add_key_i16(&app->out_builder, key, value);
 }
 
 inline int fcap_app_add_key_i32(FApp app, FKey key, int32_t value)
 {
-	return fcap_add_key_i32(&app->out_pkt, key, value);
+	return fcap_builder_add_key_i32(&app->out_builder, key, value);
 }
 
 inline int fcap_app_add_key_i64(FApp app, FKey key, int64_t value)
 {
-	return fcap_add_key_i64(&app->out_pkt, key, value);
+	return fcap_builder_add_key_i64(&app->out_builder, key, value);
 }
 
 inline int fcap_app_add_key_f32(FApp app, FKey key, float value)
 {
-	return fcap_add_key_f32(&app->out_pkt, key, value);
+	return fcap_builder_add_key_f32(&app->out_builder, key, value);
 }
 
 inline int fcap_app_add_key_d64(FApp app, FKey key, double value)
 {
-	return fcap_add_key_d64(&app->out_pkt, key, value);
+	return fcap_builder_add_key_d64(&app->out_builder, key, value);
 }
 
 inline int fcap_app_get_key_bin(FApp app, FKey key, uint8_t *data, size_t len)
 {
-	return fcap_get_key_bin(&app->out_pkt, key, data, len);
+	return fcap_view_get_key_bin(&app->in_view, key, data, len);
 }
 
 inline int fcap_app_get_key_u8(FApp app, FKey key, uint8_t *value)
 {
-	return fcap_get_key_u8(&app->out_pkt, key, value);
+	return fcap_view_get_key_u8(&app->in_view, key, value);
 }
 
 inline int fcap_app_get_key_u16(FApp app, FKey key, uint16_t *value)
 {
-	return fcap_get_key_u16(&app->out_pkt, key, value);
+	return fcap_view_get_key_u16(&app->in_view, key, value);
 }
 
 inline int fcap_app_get_key_i16(FApp app, FKey key, int16_t *value)
 {
-	return fcap_get_key_i16(&app->out_pkt, key, value);
+	return fcap_view_get_key_i16(&app->in_view, key, value);
 }
 
 inline int fcap_app_get_key_i32(FApp app, FKey key, int32_t *value)
 {
-	return fcap_get_key_i32(&app->out_pkt, key, value);
+	return fcap_view_get_key_i32(&app->in_view, key, value);
 }
 
 inline int fcap_app_get_key_i64(FApp app, FKey key, int64_t *value)
 {
-	return fcap_get_key_i64(&app->out_pkt, key, value);
+	return fcap_view_get_key_i64(&app->in_view, key, value);
 }
 
 inline int fcap_app_get_key_f32(FApp app, FKey key, float *value)
 {
-	return fcap_get_key_f32(&app->out_pkt, key, value);
+	return fcap_view_get_key_f32(&app->in_view, key, value);
 }
 
 inline int fcap_app_get_key_d64(FApp app, FKey key, double *value)
 {
-	return fcap_get_key_d64(&app->out_pkt, key, value);
+	return fcap_view_get_key_d64(&app->in_view, key, value);
 }
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+
+#include <fcap_dgram.h>
+
+#include <poll.h>
+#include <string.h>
+#include <errno.h>
+
+void fcap_dgram_init(struct fcap_dgram *dgram,
+		     int sockfd,
+		     const void *dest_addr,
+		     socklen_t dest_len)
+{
+	dgram->sockfd = sockfd;
+	dgram->rx_head = 0;
+	dgram->rx_count = 0;
+	dgram->tx_head = 0;
+	dgram->tx_count = 0;
+	dgram->tx_drops = 0;
+	dgram->last_len = 0;
+	dgram->reply = dest_addr == NULL;
+
+	dgram->dest_len = 0;
+	if (dest_addr) {
+		memcpy(&dgram->dest_addr, dest_addr, dest_len);
+		dgram->dest_len = dest_len;
+	}
+}
+
+/**
+ * @brief whether a send error means the socket itself is broken, rather than
+ * that a single datagram can't be sent, such as to a peer which has gone
+*/
+static int fcap_dgram_send_fatal(int err)
+{
+	return err == EBADF || err == ENOTSOCK || err == EFAULT;
+}
+
+int fcap_dgram_flush(struct fcap_dgram *dgram)
+{
+	int i;
+	int ret;
+	int slot;
+	struct iovec iovs[FCAP_DGRAM_QUEUE_SIZE];
+	struct mmsghdr msgs[FCAP_DGRAM_QUEUE_SIZE];
+
+	while (dgram->tx_count) {
+		memset(msgs, 0, sizeof(struct mmsghdr) * dgram->tx_count);
+		for (i = 0; i < dgram->tx_count; i++) {
+			slot = (dgram->tx_head + i) % FCAP_DGRAM_QUEUE_SIZE;
+
+			iovs[i].iov_base = dgram->tx_bufs[slot];
+			iovs[i].iov_len = dgram->tx_lens[slot];
+			if (dgram->reply) {
+				msgs[i].msg_hdr.msg_name =
+					&dgram->tx_addrs[slot];
+				msgs[i].msg_hdr.msg_namelen =
+					dgram->tx_addr_lens[slot];
+			} else {
+				msgs[i].msg_hdr.msg_name = &dgram->dest_addr;
+				msgs[i].msg_hdr.msg_namelen = dgram->dest_len;
+			}
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		ret = sendmmsg(
+			dgram->sockfd, msgs, dgram->tx_count, MSG_DONTWAIT);
+
+		if (ret < 0) {
+			/* The socket buffer is full, keep the rest for later */
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == ENOBUFS)
+				break;
+
+			if (fcap_dgram_send_fatal(errno))
+				return -errno;
+
+			/*
+			 * The datagram at the front can't be sent, drop it so
+			 * it doesn't block the rest of the queue forever
+			 */
+			dgram->tx_head =
+				(dgram->tx_head + 1) % FCAP_DGRAM_QUEUE_SIZE;
+			dgram->tx_count--;
+			dgram->tx_drops++;
+			continue;
+		}
+
+		dgram->tx_head = (dgram->tx_head + ret) % FCAP_DGRAM_QUEUE_SIZE;
+		dgram->tx_count -= ret;
+	}
+
+	return dgram->tx_count;
+}
+
+int fcap_dgram_take_drops(struct fcap_dgram *dgram)
+{
+	int drops = dgram->tx_drops;
+
+	dgram->tx_drops = 0;
+
+	return drops;
+}
+
+int fcap_dgram_send_bytes(struct fcap_dgram *dgram,
+			  uint8_t *bytes,
+			  size_t length)
+{
+	int ret;
+	int slot;
+	struct pollfd poll_fd = {
+		.fd = dgram->sockfd,
+		.events = POLLOUT,
+	};
+
+	if (length > MTU || (dgram->reply && dgram->last_len == 0))
+		return -FCAP_EINVAL;
+
+	/* Make room by flushing, waiting for the socket if it's full */
+	if (dgram->tx_count == FCAP_DGRAM_QUEUE_SIZE) {
+		ret = fcap_dgram_flush(dgram);
+		if (ret == FCAP_DGRAM_QUEUE_SIZE) {
+			poll(&poll_fd, 1, FCAP_DGRAM_SEND_TIMEOUT_MS);
+			ret = fcap_dgram_flush(dgram);
+		}
+
+		if (ret < 0)
+			return ret;
+
+		if (ret == FCAP_DGRAM_QUEUE_SIZE)
+			return -FCAP_EAGAIN;
+	}
+
+	slot = (dgram->tx_head + dgram->tx_count) % FCAP_DGRAM_QUEUE_SIZE;
+	memcpy(dgram->tx_bufs[slot], bytes, length);
+	dgram->tx_lens[slot] = length;
+	if (dgram->reply) {
+		memcpy(&dgram->tx_addrs[slot],
+		       &dgram->last_addr,
+		       dgram->last_len);
+		dgram->tx_addr_lens[slot] = dgram->last_len;
+	}
+	dgram->tx_count++;
+
+	return length;
+}
+
+/**
+ * @brief receives as many datagrams as are ready, up to a full batch, with a
+ * single syscall
+ * @param dgram the datagram socket
+ * @returns the number of datagrams received or -errno on failure
+*/
+static int fcap_dgram_recv_batch(struct fcap_dgram *dgram)
+{
+	int i;
+	int ret;
+	struct iovec iovs[FCAP_DGRAM_BATCH_SIZE];
+	struct mmsghdr msgs[FCAP_DGRAM_BATCH_SIZE];
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < FCAP_DGRAM_BATCH_SIZE; i++) {
+		iovs[i].iov_base = dgram->rx_bufs[i];
+		iovs[i].iov_len = MTU;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+
+		/* Only servers need to know who to reply to */
+		if (dgram->reply) {
+			msgs[i].msg_hdr.msg_name = &dgram->rx_addrs[i];
+			msgs[i].msg_hdr.msg_namelen =
+				sizeof(dgram->rx_addrs[i]);
+		}
+	}
+
+	ret = recvmmsg(dgram->sockfd, msgs, FCAP_DGRAM_BATCH_SIZE, MSG_DONTWAIT,
+		       NULL);
+
+	/* Normalize errors */
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		else
+			return -EINVAL;
+	}
+
+	for (i = 0; i < ret; i++) {
+		/* Datagrams bigger than a packet are dropped */
+		if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			dgram->rx_lens[i] = 0;
+		else
+			dgram->rx_lens[i] = msgs[i].msg_len;
+
+		dgram->rx_addr_lens[i] = msgs[i].msg_hdr.msg_namelen;
+	}
+
+	dgram->rx_head = 0;
+	dgram->rx_count = ret;
+
+	return ret;
+}
+
+int fcap_dgram_get_bytes(struct fcap_dgram *dgram,
+			 uint8_t *bytes,
+			 size_t length)
+{
+	int ret;
+	int idx;
+	size_t len;
+
+	do {
+		/* Only go to the socket once the last batch is used up */
+		if (dgram->rx_head == dgram->rx_count) {
+			ret = fcap_dgram_recv_batch(dgram);
+			if (ret <= 0)
+				return ret;
+		}
+
+		idx = dgram->rx_head++;
+		len = dgram->rx_lens[idx];
+		if (len > length)
+			len = length;
+
+		memcpy(bytes, dgram->rx_bufs[idx], len);
+	} while (len == 0);
+
+	/*
+	 * Replies to this datagram are sent while it is handled, so remember
+	 * who it came from. Unbound senders, which have nothing but an address
+	 * family, can't be replied to
+	 */
+	if (dgram->reply) {
+		dgram->last_len = dgram->rx_addr_lens[idx];
+		if (dgram->last_len <= sizeof(sa_family_t))
+			dgram->last_len = 0;
+		else
+			memcpy(&dgram->last_addr,
+			       &dgram->rx_addrs[idx],
+			       dgram->last_len);
+	}
+
+	return len;
+}
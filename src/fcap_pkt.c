@@ -15,13 +15,16 @@
 #define FCAP_KTV_HEADER_SIZE 1
 #define FCAP_KTV_BINARY_HEADER_SIZE (FCAP_KTV_HEADER_SIZE + 1)
 
+/* The most keys the 5 bit key count of the header can hold */
+#define FCAP_MAX_KEYS ((1 << 5) - 1)
+
 static_assert(sizeof(struct fcap_header) == FCAP_HEADER_SIZE,
 	      "Header Size Mismatch!");
 
 static_assert(sizeof(struct fcap_packet) == MTU,
 	      "FCAP Packet doesn't match expected MTU");
 
-static size_t fcap_type_sizes[] = {
+const size_t fcap_type_sizes[FCAP_DOUBLE + 1] = {
 	[FCAP_BINARY] = 0,
 	[FCAP_UINT8] = sizeof(uint8_t),
 	[FCAP_UINT16] = sizeof(uint16_t),
@@ -70,7 +73,11 @@ void fcap_init_packet(FPacket pkt)
 	pkt->header.type = 0;
 	pkt->header.version = FCAP_VERSION;
 
-	memset(pkt->ktv_bytes, 0, sizeof(ktv_bytes_t));
+	/* 
+	 * The KTV bytes are left as they are. Nothing reads past the KTVs the
+	 * header counts, and every KTV is written in full when it's added, so
+	 * stale bytes are never seen
+	 */
 }
 
 int fcap_get_num_bytes(FPacket pkt)
@@ -87,23 +94,59 @@ int fcap_get_num_bytes(FPacket pkt)
 	return size;
 }
 
-/**
- * @brief Consumes raw bytes for consumption as an FCAP packet
- * @param dest the packet to store the incoming bytes into
- * @param src the raw incoming bytes
- * @param src_len the number of bytes to consume, this cannot be greater than
- * the defined MTU
- * @returns 0 on success and all bytes were consumed or -FCAP_ERROR on failure
-*/
-int fcap_decode_packet(FPacket dest, uint8_t *src, int src_len)
+int fcap_decode_packet(FView view, FPacket pkt, size_t num_bytes)
 {
-	if (src_len > MTU)
+	int key_i;
+	size_t idx;
+	size_t end;
+	size_t ktv_size;
+	struct fcap_ktv *ktv;
+
+	if (!view || !pkt)
 		return -FCAP_EINVAL;
 
-	/* Copy all values */
-	memcpy(&dest, src, src_len);
+	if (num_bytes < FCAP_HEADER_SIZE || num_bytes > MTU)
+		return -FCAP_EINVAL;
+
+	if (pkt->header.version != FCAP_VERSION)
+		return -FCAP_EINVAL;
+
+	view->pkt = pkt;
+	view->keys = 0;
+
+	/* Validate and index each KTV in a single walk of the packet */
+	idx = 0;
+	end = num_bytes - FCAP_HEADER_SIZE;
+	for (key_i = 0; key_i < pkt->header.num_keys; key_i++) {
+		if (idx + FCAP_KTV_HEADER_SIZE > end)
+			return -FCAP_EINVAL;
+
+		/* The type is 3 bits and every encoding of it is a valid type */
+		ktv = (struct fcap_ktv *)&pkt->ktv_bytes[idx];
+
+		/* Keys can only appear once */
+		if (view->keys & (1U << ktv->key))
+			return -FCAP_EINVAL;
+
+		/* Need the length byte before the size of a binary is known */
+		if (ktv->type == FCAP_BINARY &&
+		    idx + FCAP_KTV_BINARY_HEADER_SIZE > end)
+			return -FCAP_EINVAL;
+
+		ktv_size = fcap_get_ktv_size(ktv);
+		if (idx + ktv_size > end)
+			return -FCAP_EINVAL;
+
+		view->keys |= 1U << ktv->key;
+		view->offsets[ktv->key] = idx;
+		view->types[ktv->key] = ktv->type;
 
-	/* TODO: Validate packet */
+		idx += ktv_size;
+	}
+
+	/* Every byte received must belong to a KTV */
+	if (idx != end)
+		return -FCAP_EINVAL;
 
 	return 0;
 }
@@ -131,16 +174,144 @@ int fcap_encode_packet(FPacket src, uint8_t *dest, size_t dest_len)
 	return size;
 }
 
+/**
+ * @brief writes a single ktv into a packet at a given offset
+ * @param pkt the packet to write into
+ * @param idx the offset into the ktv bytes to write the ktv at
+ * @param key the key of the value
+ * @param type the type of the value
+ * @param value a pointer to the bytes of the value
+ * @param size the length of the value, this must match the type
+ * @returns the number of bytes written or -FCAP_ERROR on failure
+ * @note this does not update the header, the caller must do so
+*/
+static int fcap_write_ktv(FPacket pkt, size_t idx, FKey key, FType type,
+			  void *value, size_t size)
+{
+	size_t ktv_size;
+	struct fcap_ktv *view;
+
+	if (key >= NUM_KEYS || type > FCAP_DOUBLE)
+		return -FCAP_EINVAL;
+
+	if (type == FCAP_BINARY) {
+		/* The length has to fit into a single byte */
+		if (size > UINT8_MAX)
+			return -FCAP_EINVAL;
+
+		ktv_size = size + FCAP_KTV_BINARY_HEADER_SIZE;
+	} else {
+		/* 
+		 * Check they are passing in the correct length 
+		 * for the type they asked for 
+		 */
+		if (size != fcap_type_sizes[type])
+			return -FCAP_EINVAL;
+
+		ktv_size = size + FCAP_KTV_HEADER_SIZE;
+	}
+
+	/* Check there is enough bytes remaining in the packet */
+	if (idx + ktv_size > sizeof(ktv_bytes_t))
+		return -FCAP_ENOMEM;
+
+	/* Check the header can count another key */
+	if (pkt->header.num_keys == FCAP_MAX_KEYS)
+		return -FCAP_ENOMEM;
+
+	view = (struct fcap_ktv *)&pkt->ktv_bytes[idx];
+	view->key = key;
+	view->type = type;
+
+	if (type == FCAP_BINARY) {
+		view->value.binary.length = size;
+		memcpy(view->value.binary.value, value, size);
+	} else {
+		memcpy(view->value.value, value, size);
+	}
+
+	return ktv_size;
+}
+
+/**
+ * @brief writes a batch of ktvs into a packet at a given offset, checking the
+ * whole batch before writing any of it
+ * @param pkt the packet to write into
+ * @param idx the offset into the ktv bytes to write the first ktv at
+ * @param keys a bitmap of the keys already in the packet
+ * @param descs the keys to write, in the order they are written
+ * @param n the number of keys in @descs
+ * @returns the number of bytes written or -FCAP_ERROR on failure, in which
+ * case the packet is untouched
+ * @note this does not update the header, the caller must do so
+*/
+static int fcap_write_ktvs(FPacket pkt, size_t idx, uint32_t keys,
+			   const struct fcap_key_desc *descs, size_t n)
+{
+	size_t i;
+	size_t end;
+	struct fcap_ktv *view;
+	const struct fcap_key_desc *desc;
+
+	if (n > FCAP_MAX_KEYS - pkt->header.num_keys)
+		return -FCAP_ENOMEM;
+
+	/* Validate every key and total up the space needed in one go */
+	end = idx;
+	for (i = 0; i < n; i++) {
+		desc = &descs[i];
+
+		if (desc->key >= NUM_KEYS || desc->type > FCAP_DOUBLE)
+			return -FCAP_EINVAL;
+
+		if (keys & (1U << desc->key))
+			return -FCAP_EINVAL;
+		keys |= 1U << desc->key;
+
+		if (desc->type == FCAP_BINARY) {
+			if (desc->size > UINT8_MAX)
+				return -FCAP_EINVAL;
+			end += desc->size + FCAP_KTV_BINARY_HEADER_SIZE;
+		} else {
+			if (desc->size != fcap_type_sizes[desc->type])
+				return -FCAP_EINVAL;
+			end += desc->size + FCAP_KTV_HEADER_SIZE;
+		}
+	}
+
+	if (end > sizeof(ktv_bytes_t))
+		return -FCAP_ENOMEM;
+
+	/* Everything fits, so write each ktv straight after the last */
+	end = idx;
+	for (i = 0; i < n; i++) {
+		desc = &descs[i];
+		view = (struct fcap_ktv *)&pkt->ktv_bytes[end];
+		view->key = desc->key;
+		view->type = desc->type;
+
+		if (desc->type == FCAP_BINARY) {
+			view->value.binary.length = desc->size;
+			memcpy(view->value.binary.value,
+			       desc->value,
+			       desc->size);
+			end += desc->size + FCAP_KTV_BINARY_HEADER_SIZE;
+		} else {
+			memcpy(view->value.value, desc->value, desc->size);
+			end += desc->size + FCAP_KTV_HEADER_SIZE;
+		}
+	}
+
+	return end - idx;
+}
+
 int fcap_add_key(FPacket pkt, FKey key, FType type, void *value, size_t size)
 {
+	int ret;
 	int key_i;
 	size_t idx;
-	size_t value_size;
 	struct fcap_ktv *view;
 
-	/* TODO: Check there is enough bytes remaining in the packet 
-	to add this value safely */
-
 	view = (struct fcap_ktv *)pkt->ktv_bytes;
 
 	/* Find the end of the packets or if key exists */
@@ -154,41 +325,74 @@ int fcap_add_key(FPacket pkt, FKey key, FType type, void *value, size_t size)
 		view = (struct fcap_ktv *)&pkt->ktv_bytes[idx];
 	}
 
-	/* Copy the type */
-	view->key = key;
-	view->type = type;
+	ret = fcap_write_ktv(pkt, idx, key, type, value, size);
+	if (ret < 0)
+		return ret;
 
-	if (type == FCAP_BINARY) {
-		value_size = size;
-		view->value.binary.length = size;
-		if (!memcpy(view->value.binary.value, value, value_size))
-			return -FCAP_ENOMEM;
+	pkt->header.num_keys++;
 
-	} else {
-		value_size = fcap_type_sizes[type];
+	return 0;
+}
 
-		/* 
-		 * Check they are passing in the correct length 
-		 * for the type they asked for 
-		 */
-		if (size != value_size)
-			return -FCAP_EINVAL;
+int fcap_add_keys(FPacket pkt, const struct fcap_key_desc *descs, size_t n)
+{
+	int ret;
+	int key_i;
+	size_t idx;
+	uint32_t keys;
+	struct fcap_ktv *view;
 
-		if (!memcpy(view->value.value, value, value_size))
-			return -FCAP_ENOMEM;
+	if (!pkt || (!descs && n))
+		return -FCAP_EINVAL;
+
+	/* Find the end of the packet and the keys already in it */
+	idx = 0;
+	keys = 0;
+	for (key_i = 0; key_i < pkt->header.num_keys; key_i++) {
+		view = (struct fcap_ktv *)&pkt->ktv_bytes[idx];
+		keys |= 1U << view->key;
+		idx += fcap_get_ktv_size(view);
 	}
 
-	pkt->header.num_keys++;
+	ret = fcap_write_ktvs(pkt, idx, keys, descs, n);
+	if (ret < 0)
+		return ret;
+
+	pkt->header.num_keys += n;
 
 	return 0;
 }
 
+/**
+ * @brief copies the value of a ktv out into a buffer
+ * @param view a pointer to the first byte of the ktv
+ * @param data an output buffer for the value to be placed in
+ * @param size the size of the output buffer
+ * @returns the FType of the ktv on success or -FCAP_ERROR on failure
+ * @note binary values are prefixed with their length byte
+*/
+static int fcap_copy_value(struct fcap_ktv *view, void *data, size_t size)
+{
+	size_t value_size;
+
+	value_size = fcap_get_value_size(view);
+	if (view->type == FCAP_BINARY)
+		value_size++;
+
+	if (size < value_size)
+		return -FCAP_ENOMEM;
+
+	if (!memcpy(data, view->value.value, value_size))
+		return -FCAP_ENOMEM;
+
+	return view->type;
+}
+
 int fcap_get_key(FPacket pkt, FKey key, void *data, size_t size)
 {
 	int key_i;
 	size_t idx;
 	bool found;
-	size_t value_size;
 	struct fcap_ktv *view;
 
 	view = (struct fcap_ktv *)pkt->ktv_bytes;
@@ -209,17 +413,7 @@ int fcap_get_key(FPacket pkt, FKey key, void *data, size_t size)
 	if (!found)
 		return -FCAP_ENOKEY;
 
-	value_size = fcap_get_value_size(view);
-	if (view->type == FCAP_BINARY)
-		value_size++;
-
-	if (size < value_size)
-		return -FCAP_ENOMEM;
-
-	if (!memcpy(data, view->value.value, value_size))
-		return -FCAP_ENOMEM;
-
-	return view->type;
+	return fcap_copy_value(view, data, size);
 }
 
 int fcap_has_key(FPacket pkt, FKey key)
@@ -250,6 +444,155 @@ int fcap_has_key(FPacket pkt, FKey key)
 	return found;
 }
 
+void fcap_builder_sync(FBuilder builder)
+{
+	int key_i;
+	struct fcap_ktv *view;
+	FPacket pkt;
+
+	if (!builder || !builder->pkt)
+		return;
+
+	pkt = builder->pkt;
+	builder->keys = 0;
+	builder->num_bytes = 0;
+
+	for (key_i = 0; key_i < pkt->header.num_keys; key_i++) {
+		view = (struct fcap_ktv *)&pkt->ktv_bytes[builder->num_bytes];
+
+		builder->keys |= 1U << view->key;
+		builder->num_bytes += fcap_get_ktv_size(view);
+	}
+}
+
+void fcap_builder_init(FBuilder builder, FPacket pkt)
+{
+	if (!builder || !pkt)
+		return;
+
+	fcap_init_packet(pkt);
+
+	builder->pkt = pkt;
+	builder->keys = 0;
+	builder->num_bytes = 0;
+}
+
+int fcap_builder_add_key(FBuilder builder, FKey key, FType type, void *value,
+			 size_t size)
+{
+	int ret;
+
+	if (!builder || key >= NUM_KEYS)
+		return -FCAP_EINVAL;
+
+	/* Check if the key already exists */
+	if (builder->keys & (1U << key))
+		return -FCAP_EINVAL;
+
+	ret = fcap_write_ktv(
+		builder->pkt, builder->num_bytes, key, type, value, size);
+	if (ret < 0)
+		return ret;
+
+	builder->pkt->header.num_keys++;
+	builder->keys |= 1U << key;
+	builder->num_bytes += ret;
+
+	return 0;
+}
+
+int fcap_builder_add_keys(FBuilder builder, const struct fcap_key_desc *descs,
+			  size_t n)
+{
+	int ret;
+	size_t i;
+
+	if (!builder || (!descs && n))
+		return -FCAP_EINVAL;
+
+	ret = fcap_write_ktvs(
+		builder->pkt, builder->num_bytes, builder->keys, descs, n);
+	if (ret < 0)
+		return ret;
+
+	builder->pkt->header.num_keys += n;
+	for (i = 0; i < n; i++)
+		builder->keys |= 1U << descs[i].key;
+	builder->num_bytes += ret;
+
+	return 0;
+}
+
+int fcap_builder_get_num_bytes(FBuilder builder)
+{
+	return builder->num_bytes + sizeof(struct fcap_header);
+}
+
+int fcap_view_init(FView view, FPacket pkt)
+{
+	int key_i;
+	size_t idx;
+	struct fcap_ktv *ktv;
+
+	if (!view || !pkt)
+		return -FCAP_EINVAL;
+
+	view->pkt = pkt;
+	view->keys = 0;
+
+	/* Record where each key lives in a single walk of the packet */
+	idx = 0;
+	for (key_i = 0; key_i < pkt->header.num_keys; key_i++) {
+		ktv = (struct fcap_ktv *)&pkt->ktv_bytes[idx];
+
+		view->keys |= 1U << ktv->key;
+		view->offsets[ktv->key] = idx;
+		view->types[ktv->key] = ktv->type;
+
+		idx += fcap_get_ktv_size(ktv);
+	}
+
+	return 0;
+}
+
+inline int fcap_view_has_key(FView view, FKey key)
+{
+	if (!view || key >= NUM_KEYS)
+		return -FCAP_EINVAL;
+
+	return (view->keys >> key) & 1;
+}
+
+int fcap_view_get_key(FView view, FKey key, void *data, size_t size)
+{
+	if (fcap_view_has_key(view, key) != 1)
+		return -FCAP_ENOKEY;
+
+	return fcap_copy_value(
+		(struct fcap_ktv *)&view->pkt->ktv_bytes[view->offsets[key]],
+		data,
+		size);
+}
+
+/**
+ * @brief gets a key from a view only if it is of the expected type
+ * @returns FCAP_ENONE on success or -FCAP_ERROR on failure
+*/
+static inline int fcap_view_get_typed(FView view, FKey key, FType type,
+				      void *data, size_t size)
+{
+	if (fcap_view_has_key(view, key) != 1)
+		return -FCAP_ENOKEY;
+
+	if (view->types[key] != type)
+		return -FCAP_ETYPE;
+
+	if (fcap_view_get_key(view, key, data, size) < 0)
+		return -FCAP_ENOMEM;
+
+	return FCAP_ENONE;
+}
+
 inline enum fcap_pkt_type fcap_get_type(FPacket pkt)
 {
 	return pkt->header.type ? FCAP_RESPONSE : FCAP_REQUEST;
@@ -300,6 +643,54 @@ inline int fcap_add_key_d64(FPacket pkt, FKey key, double value)
 	return fcap_add_key(pkt, key, FCAP_DOUBLE, &value, sizeof(value));
 }
 
+inline int fcap_builder_add_key_bin(FBuilder builder, FKey key, uint8_t *data,
+				    size_t len)
+{
+	return fcap_builder_add_key(builder, key, FCAP_BINARY, data, len);
+}
+
+inline int fcap_builder_add_key_u8(FBuilder builder, FKey key, uint8_t value)
+{
+	return fcap_builder_add_key(
+		builder, key, FCAP_UINT8, &value, sizeof(value));
+}
+
+inline int fcap_builder_add_key_u16(FBuilder builder, FKey key, uint16_t value)
+{
+	return fcap_builder_add_key(
+		builder, key, FCAP_UINT16, &value, sizeof(value));
+}
+
+inline int fcap_builder_add_key_i16(FBuilder builder, FKey key, int16_t value)
+{
+	return fcap_builder_add_key(
+		builder, key, FCAP_INT16, &value, sizeof(value));
+}
+
+inline int fcap_builder_add_key_i32(FBuilder builder, FKey key, int32_t value)
+{
+	return fcap_builder_add_key(
+		builder, key, FCAP_INT32, &value, sizeof(value));
+}
+
+inline int fcap_builder_add_key_i64(FBuilder builder, FKey key, int64_t value)
+{
+	return fcap_builder_add_key(
+		builder, key, FCAP_INT64, &value, sizeof(value));
+}
+
+inline int fcap_builder_add_key_f32(FBuilder builder, FKey key, float value)
+{
+	return fcap_builder_add_key(
+		builder, key, FCAP_FLOAT, &value, sizeof(value));
+}
+
+inline int fcap_builder_add_key_d64(FBuilder builder, FKey key, double value)
+{
+	return fcap_builder_add_key(
+		builder, key, FCAP_DOUBLE, &value, sizeof(value));
+}
+
 inline int fcap_get_key_bin(FPacket pkt, FKey key, uint8_t *data, size_t len)
 {
 	if (fcap_get_key(pkt, key, data, len) != FCAP_BINARY)
@@ -364,6 +755,236 @@ inline int fcap_get_key_d64(FPacket pkt, FKey key, double *value)
 		return FCAP_ENONE;
 }
 
+inline int fcap_view_get_key_bin(FView view, FKey key, uint8_t *data,
+				 size_t len)
+{
+	return fcap_view_get_typed(view, key, FCAP_BINARY, data, len);
+}
+
+inline int fcap_view_get_key_u8(FView view, FKey key, uint8_t *value)
+{
+	return fcap_view_get_typed(
+		view, key, FCAP_UINT8, value, sizeof(*value));
+}
+
+inline int fcap_view_get_key_u16(FView view, FKey key, uint16_t *value)
+{
+	return fcap_view_get_typed(
+		view, key, FCAP_UINT16, value, sizeof(*value));
+}
+
+inline int fcap_view_get_key_i16(FView view, FKey key, int16_t *value)
+{
+	return fcap_view_get_typed(
+		view, key, FCAP_INT16, value, sizeof(*value));
+}
+
+inline int fcap_view_get_key_i32(FView view, FKey key, int32_t *value)
+{
+	return fcap_view_get_typed(
+		view, key, FCAP_INT32, value, sizeof(*value));
+}
+
+inline int fcap_view_get_key_i64(FView view, FKey key, int64_t *value)
+{
+	return fcap_view_get_typed(
+		view, key, FCAP_INT64, value, sizeof(*value));
+}
+
+inline int fcap_view_get_key_f32(FView view, FKey key, float *value)
+{
+	return fcap_view_get_typed(
+		view, key, FCAP_FLOAT, value, sizeof(*value));
+}
+
+inline int fcap_view_get_key_d64(FView view, FKey key, double *value)
+{
+	return fcap_view_get_typed(
+		view, key, FCAP_DOUBLE, value, sizeof(*value));
+}
+
+int fcap_iter_begin(struct fcap_iter *iter, FPacket pkt, size_t num_bytes)
+{
+	if (!iter || !pkt)
+		return -FCAP_EINVAL;
+
+	if (num_bytes < FCAP_HEADER_SIZE || num_bytes > MTU)
+		return -FCAP_EINVAL;
+
+	iter->pkt = pkt;
+	iter->idx = 0;
+	iter->end = num_bytes - FCAP_HEADER_SIZE;
+	iter->remaining = pkt->header.num_keys;
+
+	return 0;
+}
+
+int fcap_iter_next(struct fcap_iter *iter, struct fcap_entry *entry)
+{
+	size_t header_size;
+	struct fcap_ktv *ktv;
+
+	if (!iter->remaining)
+		return 0;
+
+	if (iter->idx + FCAP_KTV_HEADER_SIZE > iter->end)
+		return -FCAP_EINVAL;
+
+	ktv = (struct fcap_ktv *)&iter->pkt->ktv_bytes[iter->idx];
+
+	/* Need the length byte before the size of a binary is known */
+	if (ktv->type == FCAP_BINARY) {
+		header_size = FCAP_KTV_BINARY_HEADER_SIZE;
+		if (iter->idx + header_size > iter->end)
+			return -FCAP_EINVAL;
+	} else {
+		header_size = FCAP_KTV_HEADER_SIZE;
+	}
+
+	entry->key = ktv->key;
+	entry->type = ktv->type;
+	entry->value = &iter->pkt->ktv_bytes[iter->idx + header_size];
+	entry->len = fcap_get_value_size(ktv);
+
+	if (iter->idx + header_size + entry->len > iter->end)
+		return -FCAP_EINVAL;
+
+	iter->idx += header_size + entry->len;
+	iter->remaining--;
+
+	return 1;
+}
+
+int fcap_visit_packet(FPacket pkt, size_t num_bytes, FVisitFn fn, void *priv)
+{
+	int ret;
+	struct fcap_iter iter;
+	struct fcap_entry entry;
+
+	if (!fn)
+		return -FCAP_EINVAL;
+
+	ret = fcap_iter_begin(&iter, pkt, num_bytes);
+	if (ret < 0)
+		return ret;
+
+	while ((ret = fcap_iter_next(&iter, &entry)) > 0) {
+		ret = fn(priv, &entry);
+		if (ret != 0)
+			return ret;
+	}
+
+	return ret;
+}
+
+int fcap_struct_desc_init(struct fcap_struct_desc *desc,
+			  const struct fcap_field *fields, size_t num_fields)
+{
+	size_t i;
+	const struct fcap_field *field;
+
+	if (!desc || (!fields && num_fields) || num_fields > FCAP_MAX_KEYS)
+		return -FCAP_EINVAL;
+
+	desc->fields = fields;
+	desc->num_fields = num_fields;
+	desc->keys = 0;
+
+	for (i = 0; i < num_fields; i++) {
+		field = &fields[i];
+
+		if (field->key >= NUM_KEYS || field->type > FCAP_DOUBLE)
+			return -FCAP_EINVAL;
+
+		if (desc->keys & (1U << field->key))
+			return -FCAP_EINVAL;
+
+		/* Binary members hold the length byte and at least one byte */
+		if (field->type == FCAP_BINARY) {
+			if (field->size < 2 || field->size > UINT8_MAX + 1)
+				return -FCAP_EINVAL;
+		} else if (field->size != fcap_type_sizes[field->type]) {
+			return -FCAP_EINVAL;
+		}
+
+		desc->keys |= 1U << field->key;
+		desc->index[field->key] = i;
+	}
+
+	return 0;
+}
+
+int fcap_pack_struct(FPacket pkt, const struct fcap_struct_desc *desc,
+		     const void *src)
+{
+	int i;
+	const uint8_t *member;
+	const struct fcap_field *field;
+	struct fcap_key_desc descs[FCAP_MAX_KEYS];
+
+	if (!pkt || !desc || !src)
+		return -FCAP_EINVAL;
+
+	for (i = 0; i < desc->num_fields; i++) {
+		field = &desc->fields[i];
+		member = (const uint8_t *)src + field->offset;
+
+		descs[i].key = field->key;
+		descs[i].type = field->type;
+
+		if (field->type == FCAP_BINARY) {
+			if (member[0] > field->size - 1)
+				return -FCAP_EINVAL;
+
+			descs[i].value = &member[1];
+			descs[i].size = member[0];
+		} else {
+			descs[i].value = member;
+			descs[i].size = field->size;
+		}
+	}
+
+	return fcap_add_keys(pkt, descs, desc->num_fields);
+}
+
+int fcap_unpack_struct(FPacket pkt, const struct fcap_struct_desc *desc,
+		       void *dst)
+{
+	int ret;
+	int key_i;
+	int filled;
+	size_t idx;
+	struct fcap_ktv *view;
+	const struct fcap_field *field;
+
+	if (!pkt || !desc || !dst)
+		return -FCAP_EINVAL;
+
+	/* Copy out each value the table wants as the packet is walked */
+	idx = 0;
+	filled = 0;
+	for (key_i = 0; key_i < pkt->header.num_keys; key_i++) {
+		view = (struct fcap_ktv *)&pkt->ktv_bytes[idx];
+		idx += fcap_get_ktv_size(view);
+
+		if (!(desc->keys & (1U << view->key)))
+			continue;
+
+		field = &desc->fields[desc->index[view->key]];
+		if (view->type != field->type)
+			return -FCAP_ETYPE;
+
+		ret = fcap_copy_value(
+			view, (uint8_t *)dst + field->offset, field->size);
+		if (ret < 0)
+			return ret;
+
+		filled++;
+	}
+
+	return filled;
+}
+
 #ifdef FCAP_DEBUG
 
 /**
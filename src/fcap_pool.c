@@ -0,0 +1,81 @@
+#include <fcap_pool.h>
+
+/**
+ * @brief finds the entry a packet belongs to
+ * @returns the entry or NULL if the packet isn't an acquired packet of @pool
+*/
+static struct fcap_pool_entry *fcap_pool_get_entry(FPool pool, FPacket pkt)
+{
+	size_t offset;
+	struct fcap_pool_entry *entry = (struct fcap_pool_entry *)pkt;
+
+	if (!pool || entry < pool->entries || entry >= pool->entries + pool->size)
+		return NULL;
+
+	/* Packets can only come from the start of an entry */
+	offset = (uint8_t *)entry - (uint8_t *)pool->entries;
+	if (offset % sizeof(struct fcap_pool_entry) != 0)
+		return NULL;
+
+	if (entry->refs == 0)
+		return NULL;
+
+	return entry;
+}
+
+FPacket fcap_pool_acquire(FPool pool)
+{
+	int i;
+	int idx;
+	uint32_t free_bits;
+
+	if (!pool || pool->num_free == 0)
+		return NULL;
+
+	/* Find a word with a free entry, then the free entry in that word */
+	for (i = 0; i * 32 < pool->size; i++) {
+		free_bits = ~pool->used[i];
+		if (free_bits == 0)
+			continue;
+
+		idx = i * 32 + __builtin_ctz(free_bits);
+		if (idx >= pool->size)
+			break;
+
+		pool->used[i] |= 1u << (idx % 32);
+		pool->num_free--;
+		pool->entries[idx].refs = 1;
+
+		return &pool->entries[idx].pkt;
+	}
+
+	return NULL;
+}
+
+int fcap_pool_hold(FPool pool, FPacket pkt)
+{
+	struct fcap_pool_entry *entry = fcap_pool_get_entry(pool, pkt);
+
+	if (!entry || entry->refs == UINT8_MAX)
+		return -FCAP_EINVAL;
+
+	return ++entry->refs;
+}
+
+int fcap_pool_release(FPool pool, FPacket pkt)
+{
+	int idx;
+	struct fcap_pool_entry *entry = fcap_pool_get_entry(pool, pkt);
+
+	if (!entry)
+		return -FCAP_EINVAL;
+
+	if (--entry->refs > 0)
+		return entry->refs;
+
+	idx = entry - pool->entries;
+	pool->used[idx / 32] &= ~(1u << (idx % 32));
+	pool->num_free++;
+
+	return 0;
+}
@@ -0,0 +1,161 @@
+#include <fcap_queue.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * Each slot's sequence number says which position it is ready for. Senders
+ * claim a position whose slot is free, and publish the packet by moving the
+ * slot on by one. The drainer frees the slot by moving it on a whole lap.
+ * Numbers are stored less the slot's index, so they start at 0
+ *
+ * Once the drainer has an eventfd, the first sender after the queue was
+ * emptied writes it. The drainer clears the flag before it looks at the queue
+ * a last time, and the fences pair up so that either the sender sees the flag
+ * cleared or the drainer sees its packet
+ */
+
+/**
+ * @brief wakes the drainer unless another sender already has
+*/
+static void fcap_queue_signal(FQueue queue)
+{
+	int efd;
+	uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	efd = __atomic_load_n(&queue->efd, __ATOMIC_RELAXED);
+	if (efd < 0)
+		return;
+
+	/* Only read the flag first, so a busy queue's senders don't write it */
+	if (__atomic_load_n(&queue->signalled, __ATOMIC_RELAXED) ||
+	    __atomic_exchange_n(&queue->signalled, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	/* Full just means the drainer already has plenty of wakeups */
+	if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		__atomic_store_n(&queue->signalled, 0, __ATOMIC_RELAXED);
+}
+
+int fcap_queue_send(FQueue queue,
+		    struct fcap_transport *transport,
+		    FBuilder builder)
+{
+	int32_t diff;
+	uint32_t pos;
+	uint32_t idx;
+	struct fcap_queue_slot *slot;
+
+	if (!queue || !transport || !builder)
+		return -FCAP_EINVAL;
+
+	pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		idx = pos & (queue->size - 1);
+		slot = &queue->slots[idx];
+		diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) +
+				 idx - pos);
+
+		/* Free, so try to claim it, else someone beat us to it */
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->tail,
+							&pos,
+							pos + 1,
+							1,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Still holding a packet from the last lap */
+			return -FCAP_EAGAIN;
+		} else {
+			pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->transport = transport;
+	slot->builder = *builder;
+	slot->builder.pkt = &slot->pkt;
+	memcpy(&slot->pkt, builder->pkt, fcap_builder_get_num_bytes(builder));
+
+	__atomic_store_n(&slot->seq, pos + 1 - idx, __ATOMIC_RELEASE);
+
+	fcap_queue_signal(queue);
+
+	return 0;
+}
+
+struct fcap_queue_slot *fcap_queue_peek(FQueue queue)
+{
+	uint64_t count;
+	uint32_t pos = queue->head;
+	uint32_t idx = pos & (queue->size - 1);
+	struct fcap_queue_slot *slot = &queue->slots[idx];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == pos + 1 - idx)
+		return slot;
+
+	if (queue->efd < 0 ||
+	    !__atomic_exchange_n(&queue->signalled, 0, __ATOMIC_ACQ_REL))
+		return NULL;
+
+	/* Empty, so clear the wakeup then look once more in case of a race */
+	if (read(queue->efd, &count, sizeof(count)) < 0)
+		count = 0;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == pos + 1 - idx)
+		return slot;
+
+	return NULL;
+}
+
+void fcap_queue_pop(FQueue queue)
+{
+	uint32_t pos = queue->head;
+	uint32_t idx = pos & (queue->size - 1);
+
+	__atomic_store_n(&queue->slots[idx].seq,
+			 pos + queue->size - idx,
+			 __ATOMIC_RELEASE);
+	queue->head = pos + 1;
+}
+
+int fcap_queue_get_fd(FQueue queue)
+{
+	int efd;
+	uint64_t one = 1;
+
+	if (queue->efd >= 0)
+		return queue->efd;
+
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0)
+		return -errno;
+
+	/*
+	 * Senders which ran before this saw no eventfd, so start signalled and
+	 * the drainer looks at the queue before it first sleeps
+	 */
+	queue->signalled = 1;
+	if (write(efd, &one, sizeof(one)) < 0) {
+		close(efd);
+		return -errno;
+	}
+	__atomic_store_n(&queue->efd, efd, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return efd;
+}
+
+void fcap_queue_cleanup(FQueue queue)
+{
+	if (queue->efd >= 0)
+		close(queue->efd);
+	queue->efd = -1;
+}
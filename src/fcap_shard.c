@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+
+#include <fcap_shard.h>
+
+#include <sched.h>
+#include <errno.h>
+#include <string.h>
+
+/**
+ * @brief the body of each worker thread, polls the worker's app until stopped
+ * @param arg the worker
+*/
+static void *fcap_shard_run(void *arg)
+{
+	int ret;
+	struct fcap_worker *worker = arg;
+
+	/*
+	 * Peers hashed to this worker have nowhere else to go, so it keeps
+	 * serving them whatever goes wrong with a single packet, and only
+	 * remembers the first error for fcap_shard_stop
+	 */
+	while (__atomic_load_n(&worker->running, __ATOMIC_ACQUIRE)) {
+		ret = fcap_poll_wait(&worker->app, FCAP_SHARD_WAIT_MS);
+		if (ret < 0 && worker->error == 0)
+			worker->error = ret;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief sets up a worker's socket and app and starts its thread
+ * @returns 0 on success or -errno on failure
+*/
+static int fcap_shard_start_worker(struct fcap_worker *worker,
+				   int index,
+				   const struct fcap_shard_config *config)
+{
+	int ret;
+	cpu_set_t cpus;
+	pthread_attr_t attr;
+
+	worker->udp = (struct fcap_transport) {
+		.priv = &worker->udp_priv,
+		.get_bytes = fcap_udp_get_bytes,
+		.send_bytes = fcap_udp_send_bytes,
+		.flush = fcap_udp_flush,
+		.take_drops = fcap_udp_take_drops,
+		.get_fd = fcap_udp_get_fd,
+	};
+	worker->transports[0] = &worker->udp;
+
+	/* Peers are spread between workers, so reply to whoever sent */
+	ret = fcap_udp_setup_reuseport_transport(&worker->udp_priv,
+						 config->server_port,
+						 NULL,
+						 0);
+	if (ret < 0)
+		return ret;
+
+	fcap_init_app(&worker->app,
+		      worker->transports,
+		      1,
+		      config->middleware,
+		      config->num_middleware,
+		      worker->pending);
+	worker->app.counters = worker->counters;
+	memset(worker->counters, 0, sizeof(worker->counters));
+	worker->app.priv = config->priv ? config->priv[index] : NULL;
+	worker->app.on_request = config->on_request;
+	worker->app.on_response = config->on_response;
+
+	worker->cpu = config->first_cpu < 0 ? -1 : config->first_cpu + index;
+	worker->error = 0;
+	worker->running = 1;
+
+	pthread_attr_init(&attr);
+	if (worker->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+
+	ret = pthread_create(&worker->thread, &attr, fcap_shard_run, worker);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		fcap_cleanup_instance(&worker->app);
+		fcap_udp_cleanup(&worker->udp_priv);
+		return -ret;
+	}
+
+	return 0;
+}
+
+int fcap_shard_start(struct fcap_worker *workers,
+		     int num_workers,
+		     const struct fcap_shard_config *config)
+{
+	int i;
+	int ret;
+
+	for (i = 0; i < num_workers; i++) {
+		ret = fcap_shard_start_worker(&workers[i], i, config);
+		if (ret < 0) {
+			fcap_shard_stop(workers, i);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int fcap_shard_stop(struct fcap_worker *workers, int num_workers)
+{
+	int i;
+	int err = 0;
+
+	/* Tell every worker to stop first so they all wind down together */
+	for (i = 0; i < num_workers; i++)
+		__atomic_store_n(&workers[i].running, 0, __ATOMIC_RELEASE);
+
+	for (i = 0; i < num_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		fcap_cleanup_instance(&workers[i].app);
+		fcap_udp_cleanup(&workers[i].udp_priv);
+
+		if (err == 0)
+			err = workers[i].error;
+	}
+
+	return err;
+}
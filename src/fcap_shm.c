@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+
+#include <fcap.h>
+#include <fcap_shm.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int fcap_shm_send_bytes(void *priv, uint8_t *bytes, size_t length)
+{
+	int slot;
+	uint32_t tail;
+	uint64_t one = 1;
+	fcap_shm_t *shm = priv;
+	struct fcap_shm_ring *ring = shm->tx;
+
+	if (length > MTU)
+		return -FCAP_EINVAL;
+
+	/* Only look at the consumer's cache line when the ring looks full */
+	tail = ring->tail;
+	if (tail - shm->tx_head == FCAP_SHM_RING_SIZE) {
+		shm->tx_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (tail - shm->tx_head == FCAP_SHM_RING_SIZE)
+			return -FCAP_EAGAIN;
+	}
+
+	slot = tail % FCAP_SHM_RING_SIZE;
+	memcpy(ring->bufs[slot], bytes, length);
+	ring->lens[slot] = length;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (shm->tx_efd < 0)
+		return length;
+
+	/*
+	 * Only wake the consumer if it had read everything, otherwise it will
+	 * see this packet before it next sleeps. Pairs with the fence in
+	 * fcap_shm_rx_ready, so one of us always sees the other's index
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) != tail)
+		return length;
+
+	/*
+	 * Flag it after writing, so a wakeup is never left uncleared. The
+	 * packet is already in the ring, so a failed wakeup can't fail the
+	 * send, or a retry would send it twice. The consumer still finds it
+	 * the next time it polls
+	 */
+	if (write(shm->tx_efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		shm->missed_wakeups++;
+	__atomic_store_n(&ring->signalled, 1, __ATOMIC_RELEASE);
+
+	return length;
+}
+
+/**
+ * @brief reloads the tail of the rx ring once every packet up to the last tail
+ * seen has been read, clearing the eventfd if the ring is empty
+ * @returns whether there is a packet to read
+*/
+static int fcap_shm_rx_ready(fcap_shm_t *shm)
+{
+	uint64_t count;
+	struct fcap_shm_ring *ring = shm->rx;
+
+	if (ring->head != shm->rx_tail)
+		return 1;
+
+	if (shm->rx_efd >= 0)
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	shm->rx_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (ring->head != shm->rx_tail || shm->rx_efd < 0)
+		return ring->head != shm->rx_tail;
+
+	/*
+	 * Empty, so clear any wakeup before we sleep. The producer may have
+	 * sent something since we looked, so look once more afterwards
+	 */
+	if (!__atomic_exchange_n(&ring->signalled, 0, __ATOMIC_ACQ_REL))
+		return 0;
+
+	if (read(shm->rx_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return -errno;
+
+	shm->rx_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	return ring->head != shm->rx_tail;
+}
+
+int fcap_shm_get_bytes(void *priv, uint8_t *bytes, size_t length)
+{
+	int ret;
+	int slot;
+	size_t len;
+	fcap_shm_t *shm = priv;
+	struct fcap_shm_ring *ring = shm->rx;
+
+	ret = fcap_shm_rx_ready(shm);
+	if (ret <= 0)
+		return ret;
+
+	slot = ring->head % FCAP_SHM_RING_SIZE;
+	len = ring->lens[slot];
+	if (len > length)
+		len = length;
+
+	memcpy(bytes, ring->bufs[slot], len);
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+	return len;
+}
+
+int fcap_shm_get_fd(void *priv)
+{
+	fcap_shm_t *shm = priv;
+	return shm->rx_efd;
+}
+
+/**
+ * @brief maps a shared memory object and picks the rings of one end
+ * @param side 0 for the end which sends on the first ring, 1 for the other
+ * @returns 0 on success or -errno on failure
+*/
+static int fcap_shm_map(fcap_shm_t *shm, int fd, int side)
+{
+	shm->region = mmap(NULL,
+			   sizeof(*shm->region),
+			   PROT_READ | PROT_WRITE,
+			   MAP_SHARED,
+			   fd,
+			   0);
+	if (shm->region == MAP_FAILED) {
+		shm->region = NULL;
+		return -errno;
+	}
+
+	shm->tx = &shm->region->rings[side];
+	shm->rx = &shm->region->rings[!side];
+	shm->tx_head = __atomic_load_n(&shm->tx->head, __ATOMIC_ACQUIRE);
+	shm->rx_tail = __atomic_load_n(&shm->rx->tail, __ATOMIC_ACQUIRE);
+
+	return 0;
+}
+
+int fcap_shm_setup_transport(void *priv, const char *name, int create)
+{
+	int fd;
+	int ret;
+	struct stat st;
+	fcap_shm_t *shm = priv;
+
+	memset(shm, 0, sizeof(*shm));
+	shm->rx_efd = -1;
+	shm->tx_efd = -1;
+
+	if (strlen(name) >= sizeof(shm->name))
+		return -ENAMETOOLONG;
+
+	if (create)
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	else
+		fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return -errno;
+
+	/* New objects are zero filled, which is an empty pair of rings */
+	if (create)
+		ret = ftruncate(fd, sizeof(*shm->region));
+	else
+		ret = fstat(fd, &st);
+	if (ret < 0)
+		goto err;
+
+	if (!create && (size_t)st.st_size < sizeof(*shm->region)) {
+		errno = EINVAL;
+		goto err;
+	}
+
+	ret = fcap_shm_map(shm, fd, !create);
+	if (ret < 0) {
+		errno = -ret;
+		goto err;
+	}
+
+	/* The mapping keeps the object alive */
+	close(fd);
+
+	strcpy(shm->name, name);
+	shm->owner = create;
+
+	return 0;
+
+err:
+	ret = -errno;
+	close(fd);
+	if (create)
+		shm_unlink(name);
+	return ret;
+}
+
+int fcap_shm_setup_pair(void *priv_a, void *priv_b, int wakeups)
+{
+	int fd;
+	int ret;
+	fcap_shm_t *a = priv_a;
+	fcap_shm_t *b = priv_b;
+
+	memset(a, 0, sizeof(*a));
+	memset(b, 0, sizeof(*b));
+	a->rx_efd = a->tx_efd = -1;
+	b->rx_efd = b->tx_efd = -1;
+
+	fd = memfd_create("fcap_shm", MFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, sizeof(*a->region)) < 0)
+		goto err;
+
+	ret = fcap_shm_map(a, fd, 0);
+	if (ret == 0) {
+		ret = fcap_shm_map(b, fd, 1);
+		if (ret < 0)
+			munmap(a->region, sizeof(*a->region));
+	}
+	if (ret < 0) {
+		errno = -ret;
+		goto err;
+	}
+
+	close(fd);
+
+	if (!wakeups)
+		return 0;
+
+	/* Each end reads its own eventfd and writes to the other's */
+	a->rx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	b->rx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (a->rx_efd >= 0 && b->rx_efd >= 0) {
+		a->tx_efd = dup(b->rx_efd);
+		b->tx_efd = dup(a->rx_efd);
+	}
+
+	if (a->rx_efd < 0 || b->rx_efd < 0 || a->tx_efd < 0 ||
+	    b->tx_efd < 0) {
+		ret = -errno;
+		fcap_shm_cleanup(a);
+		fcap_shm_cleanup(b);
+		return ret;
+	}
+
+	return 0;
+
+err:
+	ret = -errno;
+	close(fd);
+	return ret;
+}
+
+void fcap_shm_cleanup(void *priv)
+{
+	fcap_shm_t *shm = priv;
+
+	if (shm->rx_efd >= 0)
+		close(shm->rx_efd);
+	if (shm->tx_efd >= 0)
+		close(shm->tx_efd);
+	shm->rx_efd = -1;
+	shm->tx_efd = -1;
+
+	if (shm->region)
+		munmap(shm->region, sizeof(*shm->region));
+	shm->region = NULL;
+
+	if (shm->owner)
+		shm_unlink(shm->name);
+	shm->owner = 0;
+}
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+
+#include <fcap_trace.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Keeps the indices written by the tracing and draining threads apart */
+#ifndef FCAP_CACHE_LINE_SIZE
+#define FCAP_CACHE_LINE_SIZE 64
+#endif
+
+/**
+ * @brief the events recorded by one thread, which it writes to and a
+ * draining thread reads from
+ * @param tail the total number of events written
+ * @param head the total number of events drained
+ * @param in_use whether a live thread owns the ring, a ring is handed on to a
+ * new thread once its owner exits
+ * @param thread the id of the thread owning the ring
+ * @param next the next ring in the list of every ring
+ * @param events the events
+*/
+struct fcap_trace_ring {
+	uint32_t tail __attribute__((aligned(FCAP_CACHE_LINE_SIZE)));
+	uint32_t head __attribute__((aligned(FCAP_CACHE_LINE_SIZE)));
+	uint32_t in_use;
+	uint32_t thread;
+	struct fcap_trace_ring *next;
+	struct fcap_trace_event events[FCAP_TRACE_RING_SIZE];
+};
+
+/* Rings are never freed, so the list only ever grows at the front */
+static struct fcap_trace_ring *fcap_trace_rings;
+static uint64_t fcap_trace_num_dropped;
+static __thread struct fcap_trace_ring *fcap_trace_ring;
+
+static pthread_key_t fcap_trace_key;
+static pthread_once_t fcap_trace_once = PTHREAD_ONCE_INIT;
+
+/* Frees up a thread's ring for the next new thread when the thread exits */
+static void fcap_trace_release(void *ring)
+{
+	__atomic_store_n(&((struct fcap_trace_ring *)ring)->in_use,
+			 0,
+			 __ATOMIC_RELEASE);
+}
+
+static void fcap_trace_key_init(void)
+{
+	pthread_key_create(&fcap_trace_key, fcap_trace_release);
+}
+
+/**
+ * @brief gives the calling thread a ring, reusing one left by an exited thread
+ * if there is one
+ * @returns the ring or NULL if there is no memory for a new one
+*/
+static struct fcap_trace_ring *fcap_trace_claim(void)
+{
+	uint32_t unused = 0;
+	struct fcap_trace_ring *ring;
+
+	pthread_once(&fcap_trace_once, fcap_trace_key_init);
+
+	ring = __atomic_load_n(&fcap_trace_rings, __ATOMIC_ACQUIRE);
+	for (; ring; ring = ring->next) {
+		if (__atomic_compare_exchange_n(&ring->in_use,
+						&unused,
+						1,
+						0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			break;
+		unused = 0;
+	}
+
+	if (!ring) {
+		ring = calloc(1, sizeof(*ring));
+		if (!ring)
+			return NULL;
+
+		ring->in_use = 1;
+		ring->next = __atomic_load_n(&fcap_trace_rings,
+					     __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&fcap_trace_rings,
+						    &ring->next,
+						    ring,
+						    1,
+						    __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED))
+			;
+	}
+
+	ring->thread = gettid();
+	pthread_setspecific(fcap_trace_key, ring);
+
+	return ring;
+}
+
+uint64_t fcap_trace_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void fcap_trace_record(uint64_t start_ns,
+		       uint8_t stage,
+		       uint8_t index,
+		       uint8_t message_id,
+		       uint8_t is_outbound)
+{
+	uint32_t tail;
+	struct fcap_trace_event *event;
+	struct fcap_trace_ring *ring = fcap_trace_ring;
+
+	if (!ring) {
+		ring = fcap_trace_claim();
+		if (!ring)
+			return;
+		fcap_trace_ring = ring;
+	}
+
+	/* A full ring keeps its oldest events, the drainer is behind */
+	tail = ring->tail;
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+	    FCAP_TRACE_RING_SIZE) {
+		__atomic_fetch_add(&fcap_trace_num_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	event = &ring->events[tail % FCAP_TRACE_RING_SIZE];
+	event->start_ns = start_ns;
+	event->duration_ns = fcap_trace_now() - start_ns;
+	event->thread = ring->thread;
+	event->stage = stage;
+	event->index = index;
+	event->message_id = message_id;
+	event->is_outbound = is_outbound;
+
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+int fcap_trace_drain(struct fcap_trace_event *events, int max_events)
+{
+	int num_events = 0;
+	uint32_t head;
+	uint32_t tail;
+	struct fcap_trace_ring *ring;
+
+	ring = __atomic_load_n(&fcap_trace_rings, __ATOMIC_ACQUIRE);
+	for (; ring && num_events < max_events; ring = ring->next) {
+		head = ring->head;
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail && num_events < max_events; head++)
+			events[num_events++] =
+				ring->events[head % FCAP_TRACE_RING_SIZE];
+
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	}
+
+	return num_events;
+}
+
+uint64_t fcap_trace_dropped(void)
+{
+	return __atomic_load_n(&fcap_trace_num_dropped, __ATOMIC_RELAXED);
+}
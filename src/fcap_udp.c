@@ -1,29 +1,30 @@
+#define _GNU_SOURCE
+
 #include <fcap.h>
 #include <fcap_udp.h>
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
-#include <poll.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 
-int fcap_udp_send_bytes(void *priv, uint8_t *bytes, size_t length)
+int fcap_udp_flush(void *priv)
 {
-	int ret;
 	fcap_udp_t *udp = priv;
+	return fcap_dgram_flush(&udp->dgram);
+}
 
-	ret = sendto(udp->sockfd,
-		     (const char *)bytes,
-		     length,
-		     0,
-		     (const struct sockaddr *)&udp->dest_addr,
-		     sizeof(udp->dest_addr));
-
-	if (ret != length)
-		return -FCAP_EINVAL;
+int fcap_udp_take_drops(void *priv)
+{
+	fcap_udp_t *udp = priv;
+	return fcap_dgram_take_drops(&udp->dgram);
+}
 
-	return ret;
+int fcap_udp_send_bytes(void *priv, uint8_t *bytes, size_t length)
+{
+	fcap_udp_t *udp = priv;
+	return fcap_dgram_send_bytes(&udp->dgram, bytes, length);
 }
 
 // int fcap_udp_poll(void *priv)
@@ -47,31 +48,44 @@ int fcap_udp_send_bytes(void *priv, uint8_t *bytes, size_t length)
 
 int fcap_udp_get_bytes(void *priv, uint8_t *bytes, size_t length)
 {
-	int ret;
 	fcap_udp_t *udp = priv;
-	ret = recv(udp->sockfd, bytes, length, MSG_DONTWAIT);
+	return fcap_dgram_get_bytes(&udp->dgram, bytes, length);
+}
 
-	/* Normalize errors */
-	if (ret < 0)
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
-			return 0;
-		else
-			return -EINVAL;
-	else
-		return ret;
+int fcap_udp_get_fd(void *priv)
+{
+	fcap_udp_t *udp = priv;
+	return udp->dgram.sockfd;
 }
 
-int fcap_udp_setup_transport(void *priv,
-			     int server_port,
-			     char *dest_ip,
-			     int dest_port)
+/**
+ * @brief sets up the udp transport as per fcap_udp_setup_transport
+ * @param reuse_port whether other sockets may bind to the same port, with the
+ * kernel spreading incoming datagrams between them
+*/
+static int fcap_udp_setup(fcap_udp_t *udp,
+			  int server_port,
+			  char *dest_ip,
+			  int dest_port,
+			  int reuse_port)
 {
 	int ret;
-	fcap_udp_t *udp = priv;
+	int sockfd;
+	struct sockaddr_in dest_addr;
 
 	/* Creating socket file descriptor */
-	if ((udp->sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
-		return udp->sockfd;
+	if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		return -errno;
+
+	if (reuse_port) {
+		ret = setsockopt(sockfd,
+				 SOL_SOCKET,
+				 SO_REUSEPORT,
+				 &reuse_port,
+				 sizeof(reuse_port));
+		if (ret < 0)
+			goto err;
+	}
 
 	memset(&udp->server_addr, 0, sizeof(udp->server_addr));
 
@@ -84,26 +98,58 @@ int fcap_udp_setup_transport(void *priv,
 	udp->server_addr.sin_port = htons(server_port);
 
 	/* Bind the socket with the server address */
-	ret = bind(udp->sockfd,
+	ret = bind(sockfd,
 		   (const struct sockaddr *)&udp->server_addr,
 		   sizeof(udp->server_addr));
-	if (ret < 0) {
-		return ret;
+	if (ret < 0)
+		goto err;
+
+	/* Servers have no peer of their own, they reply to whoever sent */
+	if (!dest_ip) {
+		fcap_dgram_init(&udp->dgram, sockfd, NULL, 0);
+		return 0;
 	}
 
 	/*
 	 * Filling in client information
 	 */
-	memset(&udp->dest_addr, 0, sizeof(udp->dest_addr));
-	udp->dest_addr.sin_family = AF_INET;
-	udp->dest_addr.sin_addr.s_addr = inet_addr(dest_ip);
-	udp->dest_addr.sin_port = htons(dest_port);
+	memset(&dest_addr, 0, sizeof(dest_addr));
+	dest_addr.sin_family = AF_INET;
+	dest_addr.sin_addr.s_addr = inet_addr(dest_ip);
+	dest_addr.sin_port = htons(dest_port);
+
+	fcap_dgram_init(&udp->dgram, sockfd, &dest_addr, sizeof(dest_addr));
 
 	return 0;
+
+err:
+	ret = -errno;
+	close(sockfd);
+	return ret;
+}
+
+int fcap_udp_setup_transport(void *priv,
+			     int server_port,
+			     char *dest_ip,
+			     int dest_port)
+{
+	return fcap_udp_setup(priv, server_port, dest_ip, dest_port, 0);
+}
+
+int fcap_udp_setup_reuseport_transport(void *priv,
+				       int server_port,
+				       char *dest_ip,
+				       int dest_port)
+{
+	return fcap_udp_setup(priv, server_port, dest_ip, dest_port, 1);
 }
 
 void fcap_udp_cleanup(void *priv)
 {
 	fcap_udp_t *udp = priv;
-	close(udp->sockfd);
+
+	/* Last chance to send anything still queued */
+	fcap_dgram_flush(&udp->dgram);
+
+	close(udp->dgram.sockfd);
 }
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+
+#include <fcap.h>
+#include <fcap_unix.h>
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+int fcap_unix_flush(void *priv)
+{
+	fcap_unix_t *sock = priv;
+	return fcap_dgram_flush(&sock->dgram);
+}
+
+int fcap_unix_take_drops(void *priv)
+{
+	fcap_unix_t *sock = priv;
+	return fcap_dgram_take_drops(&sock->dgram);
+}
+
+int fcap_unix_send_bytes(void *priv, uint8_t *bytes, size_t length)
+{
+	fcap_unix_t *sock = priv;
+	return fcap_dgram_send_bytes(&sock->dgram, bytes, length);
+}
+
+int fcap_unix_get_bytes(void *priv, uint8_t *bytes, size_t length)
+{
+	fcap_unix_t *sock = priv;
+	return fcap_dgram_get_bytes(&sock->dgram, bytes, length);
+}
+
+int fcap_unix_get_fd(void *priv)
+{
+	fcap_unix_t *sock = priv;
+	return sock->dgram.sockfd;
+}
+
+/**
+ * @brief fills in a unix socket address, a leading '@' meaning the abstract
+ * namespace
+ * @returns the length of the address or -ENAMETOOLONG
+*/
+static int fcap_unix_addr(struct sockaddr_un *addr, const char *path)
+{
+	size_t len = strlen(path);
+
+	if (len >= sizeof(addr->sun_path))
+		return -ENAMETOOLONG;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, len);
+
+	/* Abstract addresses start with a NUL and aren't NUL terminated */
+	if (path[0] == '@') {
+		addr->sun_path[0] = '\0';
+		return offsetof(struct sockaddr_un, sun_path) + len;
+	}
+
+	return offsetof(struct sockaddr_un, sun_path) + len + 1;
+}
+
+/**
+ * @brief checks whether a path is a socket file which nothing is bound to any
+ * more, so it is safe to remove
+ * @param addr the address of the path
+ * @param len the length of @addr
+*/
+static int fcap_unix_is_stale(const struct sockaddr_un *addr, socklen_t len)
+{
+	int fd;
+	int ret;
+	struct stat st;
+
+	if (lstat(addr->sun_path, &st) < 0 || !S_ISSOCK(st.st_mode))
+		return 0;
+
+	/* Only a socket which is still bound accepts a connection */
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return 0;
+
+	ret = connect(fd, (const struct sockaddr *)addr, len);
+	ret = ret < 0 && errno == ECONNREFUSED;
+	close(fd);
+
+	return ret;
+}
+
+int fcap_unix_setup_transport(void *priv,
+			      const char *server_path,
+			      const char *dest_path)
+{
+	int ret;
+	int sockfd;
+	socklen_t dest_len = 0;
+	struct sockaddr_un dest_addr;
+	fcap_unix_t *sock = priv;
+
+	if (dest_path) {
+		ret = fcap_unix_addr(&dest_addr, dest_path);
+		if (ret < 0)
+			return ret;
+		dest_len = ret;
+	}
+
+	if (server_path) {
+		ret = fcap_unix_addr(&sock->server_addr, server_path);
+		if (ret < 0)
+			return ret;
+		sock->server_len = ret;
+	} else {
+		/* Binding just the family has the kernel pick an abstract name */
+		memset(&sock->server_addr, 0, sizeof(sock->server_addr));
+		sock->server_addr.sun_family = AF_UNIX;
+		sock->server_len = sizeof(sa_family_t);
+	}
+
+	if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+		return -errno;
+
+	ret = bind(sockfd,
+		   (const struct sockaddr *)&sock->server_addr,
+		   sock->server_len);
+
+	/* A socket file left behind by an old process blocks the bind */
+	if (ret < 0 && errno == EADDRINUSE && server_path &&
+	    server_path[0] != '@' &&
+	    fcap_unix_is_stale(&sock->server_addr, sock->server_len)) {
+		unlink(server_path);
+		ret = bind(sockfd,
+			   (const struct sockaddr *)&sock->server_addr,
+			   sock->server_len);
+	}
+	if (ret < 0)
+		goto err;
+
+	fcap_dgram_init(&sock->dgram,
+			sockfd,
+			dest_path ? &dest_addr : NULL,
+			dest_len);
+
+	return 0;
+
+err:
+	ret = -errno;
+	close(sockfd);
+	return ret;
+}
+
+void fcap_unix_cleanup(void *priv)
+{
+	fcap_unix_t *sock = priv;
+
+	/* Last chance to send anything still queued */
+	fcap_dgram_flush(&sock->dgram);
+
+	close(sock->dgram.sockfd);
+
+	/* Only named sockets have a file */
+	if (sock->server_len > sizeof(sa_family_t) &&
+	    sock->server_addr.sun_path[0] != '\0')
+		unlink(sock->server_addr.sun_path);
+}
@@ -0,0 +1,517 @@
+#include <fcap.h>
+#include <fcap_uring.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+/* Send completions carry their slot, so receives use a value no slot can be */
+#define FCAP_URING_RECV_TAG UINT64_MAX
+
+/* All receive buffers belong to a single group */
+#define FCAP_URING_BUF_GROUP 0
+
+static_assert(FCAP_URING_QUEUE_SIZE <= 64,
+	      "Send slots are tracked in a 64 bit bitmap");
+
+static_assert((FCAP_URING_NUM_BUFS & (FCAP_URING_NUM_BUFS - 1)) == 0,
+	      "The kernel needs a power of 2 receive buffers");
+
+/**
+ * @brief gets the next free submission queue entry
+ * @param uring the io_uring transport struct
+ * @returns the cleared entry or NULL if the submission queue is full
+*/
+static struct io_uring_sqe *fcap_uring_get_sqe(fcap_uring_t *uring)
+{
+	uint32_t head;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	if (uring->sq_next - head >= FCAP_URING_ENTRIES)
+		return NULL;
+
+	sqe = &uring->sqes[uring->sq_next & *uring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_next++;
+
+	return sqe;
+}
+
+/**
+ * @brief submits every prepared submission queue entry with a single syscall
+ * @param uring the io_uring transport struct
+ * @param wait_for the number of completions to wait for
+ * @returns the number of entries submitted or -errno on failure
+*/
+static int fcap_uring_submit(fcap_uring_t *uring, uint32_t wait_for)
+{
+	int ret;
+	uint32_t to_submit;
+
+	to_submit = uring->sq_next - *uring->sq_tail;
+	if (to_submit == 0 && wait_for == 0)
+		return 0;
+
+	__atomic_store_n(uring->sq_tail, uring->sq_next, __ATOMIC_RELEASE);
+
+	ret = syscall(__NR_io_uring_enter,
+		      uring->ring_fd,
+		      to_submit,
+		      wait_for,
+		      wait_for ? IORING_ENTER_GETEVENTS : 0,
+		      NULL,
+		      0);
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
+/**
+ * @brief hands a receive buffer back to the kernel
+ * @param uring the io_uring transport struct
+ * @param id the id of the buffer
+*/
+static void fcap_uring_recycle(fcap_uring_t *uring, uint16_t id)
+{
+	struct io_uring_buf *buf;
+
+	buf = &uring->buf_ring->bufs[uring->buf_tail &
+				     (FCAP_URING_NUM_BUFS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)uring->rx_bufs[id];
+	buf->len = sizeof(uring->rx_bufs[id]);
+	buf->bid = id;
+
+	uring->buf_tail++;
+	__atomic_store_n(
+		&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief posts a multishot receive, which stays posted and completes once for
+ * every datagram until the kernel runs out of receive buffers
+ * @param uring the io_uring transport struct
+ * @returns 0 on success or -errno on failure
+*/
+static int fcap_uring_arm_recv(fcap_uring_t *uring)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = fcap_uring_get_sqe(uring);
+	if (!sqe)
+		return -FCAP_EAGAIN;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = uring->sockfd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = FCAP_URING_BUF_GROUP;
+	sqe->user_data = FCAP_URING_RECV_TAG;
+
+	uring->recv_armed = 1;
+
+	return fcap_uring_submit(uring, 0);
+}
+
+/**
+ * @brief reaps every completion, queueing received datagrams to be read and
+ * freeing the slots of finished sends
+ * @param uring the io_uring transport struct
+*/
+static void fcap_uring_reap(fcap_uring_t *uring)
+{
+	int slot;
+	uint16_t id;
+	uint32_t head;
+	uint32_t tail;
+	struct io_uring_cqe *cqe;
+
+	head = *uring->cq_head;
+	tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		cqe = &uring->cqes[head & *uring->cq_mask];
+
+		/* Send slots are free once the kernel is done with them */
+		if (cqe->user_data != FCAP_URING_RECV_TAG) {
+			uring->tx_busy &= ~(1ULL << cqe->user_data);
+			continue;
+		}
+
+		/* The receive needs posting again once it stops */
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			uring->recv_armed = 0;
+			uring->recv_error = cqe->res < 0 ? cqe->res : 0;
+		}
+
+		if (!(cqe->flags & IORING_CQE_F_BUFFER))
+			continue;
+
+		id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		/* Nothing worth reading, give the buffer straight back */
+		if (cqe->res <= 0) {
+			fcap_uring_recycle(uring, id);
+			continue;
+		}
+
+		slot = (uring->rx_head + uring->rx_count) % FCAP_URING_NUM_BUFS;
+		uring->rx_ids[slot] = id;
+		uring->rx_lens[slot] = cqe->res;
+		uring->rx_count++;
+	}
+
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+int fcap_uring_get_bytes(void *priv, uint8_t *bytes, size_t length)
+{
+	int ret;
+	uint16_t id;
+	size_t len;
+	fcap_uring_t *uring = priv;
+
+	fcap_uring_reap(uring);
+
+	while (uring->rx_count) {
+		id = uring->rx_ids[uring->rx_head];
+		len = uring->rx_lens[uring->rx_head];
+		uring->rx_head = (uring->rx_head + 1) % FCAP_URING_NUM_BUFS;
+		uring->rx_count--;
+
+		/* Datagrams bigger than a packet are dropped */
+		if (len > MTU) {
+			fcap_uring_recycle(uring, id);
+			continue;
+		}
+
+		if (len > length)
+			len = length;
+
+		memcpy(bytes, uring->rx_bufs[id], len);
+		fcap_uring_recycle(uring, id);
+
+		return len;
+	}
+
+	/* Everything has been read, so the kernel has buffers again */
+	if (!uring->recv_armed) {
+		ret = fcap_uring_arm_recv(uring);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+int fcap_uring_send_bytes(void *priv, uint8_t *bytes, size_t length)
+{
+	int ret;
+	int slot;
+	fcap_uring_t *uring = priv;
+	struct io_uring_sqe *sqe;
+	const uint64_t all_busy = FCAP_URING_QUEUE_SIZE == 64 ?
+					  UINT64_MAX :
+					  (1ULL << FCAP_URING_QUEUE_SIZE) - 1;
+
+	if (length > MTU)
+		return -FCAP_EINVAL;
+
+	/* Make room by submitting what's prepared and seeing what finished */
+	if (uring->tx_busy == all_busy) {
+		ret = fcap_uring_flush(uring);
+		if (ret < 0)
+			return ret;
+
+		if (uring->tx_busy == all_busy)
+			return -FCAP_EAGAIN;
+	}
+
+	sqe = fcap_uring_get_sqe(uring);
+	if (!sqe)
+		return -FCAP_EAGAIN;
+
+	slot = __builtin_ctzll(~uring->tx_busy);
+	uring->tx_busy |= 1ULL << slot;
+
+	memcpy(uring->tx_bufs[slot], bytes, length);
+	uring->tx_iovs[slot].iov_base = uring->tx_bufs[slot];
+	uring->tx_iovs[slot].iov_len = length;
+
+	memset(&uring->tx_msgs[slot], 0, sizeof(struct msghdr));
+	uring->tx_msgs[slot].msg_name = &uring->dest_addr;
+	uring->tx_msgs[slot].msg_namelen = sizeof(uring->dest_addr);
+	uring->tx_msgs[slot].msg_iov = &uring->tx_iovs[slot];
+	uring->tx_msgs[slot].msg_iovlen = 1;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = uring->sockfd;
+	sqe->addr = (uint64_t)(uintptr_t)&uring->tx_msgs[slot];
+	sqe->len = 1;
+	sqe->user_data = slot;
+
+	return length;
+}
+
+int fcap_uring_flush(void *priv)
+{
+	int ret;
+	fcap_uring_t *uring = priv;
+
+	ret = fcap_uring_submit(uring, 0);
+	if (ret < 0)
+		return ret;
+
+	fcap_uring_reap(uring);
+
+	/* Everything is in the hands of the kernel now */
+	return 0;
+}
+
+int fcap_uring_get_fd(void *priv)
+{
+	fcap_uring_t *uring = priv;
+
+	/* The ring becomes readable when there are completions to reap */
+	return uring->ring_fd;
+}
+
+/**
+ * @brief creates the io_uring instance and maps its rings
+ * @param uring the io_uring transport struct
+ * @returns 0 on success or -errno on failure
+*/
+static int fcap_uring_setup_ring(fcap_uring_t *uring)
+{
+	uint32_t i;
+	uint8_t *ring;
+	uint32_t *sq_array;
+	size_t sq_size;
+	size_t cq_size;
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+
+	uring->ring_fd = syscall(
+		__NR_io_uring_setup, FCAP_URING_ENTRIES, &params);
+	if (uring->ring_fd < 0)
+		return -errno;
+
+	/* Both rings live in one mapping on every kernel with multishot */
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+		return -EOPNOTSUPP;
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	cq_size = params.cq_off.cqes +
+		  params.cq_entries * sizeof(struct io_uring_cqe);
+	uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+	uring->ring = mmap(NULL,
+			   uring->ring_size,
+			   PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE,
+			   uring->ring_fd,
+			   IORING_OFF_SQ_RING);
+	if (uring->ring == MAP_FAILED)
+		return -errno;
+
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL,
+			   uring->sqes_size,
+			   PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE,
+			   uring->ring_fd,
+			   IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED)
+		return -errno;
+
+	ring = uring->ring;
+	uring->sq_head = (uint32_t *)(ring + params.sq_off.head);
+	uring->sq_tail = (uint32_t *)(ring + params.sq_off.tail);
+	uring->sq_mask = (uint32_t *)(ring + params.sq_off.ring_mask);
+	uring->sq_next = *uring->sq_tail;
+	uring->cq_head = (uint32_t *)(ring + params.cq_off.head);
+	uring->cq_tail = (uint32_t *)(ring + params.cq_off.tail);
+	uring->cq_mask = (uint32_t *)(ring + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+	/* Entries are always used in ring order */
+	sq_array = (uint32_t *)(ring + params.sq_off.array);
+	for (i = 0; i < params.sq_entries; i++)
+		sq_array[i] = i;
+
+	return 0;
+}
+
+/**
+ * @brief registers the receive buffers with the kernel, so the multishot
+ * receive can pick a buffer for each datagram itself
+ * @param uring the io_uring transport struct
+ * @returns 0 on success or -errno on failure
+*/
+static int fcap_uring_setup_bufs(fcap_uring_t *uring)
+{
+	int ret;
+	uint16_t id;
+	struct io_uring_buf_reg reg;
+
+	uring->buf_ring = mmap(NULL,
+			       FCAP_URING_NUM_BUFS *
+				       sizeof(struct io_uring_buf),
+			       PROT_READ | PROT_WRITE,
+			       MAP_ANONYMOUS | MAP_PRIVATE,
+			       -1,
+			       0);
+	if (uring->buf_ring == MAP_FAILED)
+		return -errno;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)uring->buf_ring;
+	reg.ring_entries = FCAP_URING_NUM_BUFS;
+	reg.bgid = FCAP_URING_BUF_GROUP;
+
+	ret = syscall(__NR_io_uring_register,
+		      uring->ring_fd,
+		      IORING_REGISTER_PBUF_RING,
+		      &reg,
+		      1);
+	if (ret < 0)
+		return -errno;
+
+	uring->buf_tail = 0;
+	for (id = 0; id < FCAP_URING_NUM_BUFS; id++)
+		fcap_uring_recycle(uring, id);
+
+	return 0;
+}
+
+/**
+ * @brief checks the kernel took the multishot receive just posted. A kernel
+ * without it rejects the flag as soon as the receive is submitted
+ * @param uring the io_uring transport struct
+ * @returns 0 if the receive is still posted, -EOPNOTSUPP if the kernel
+ * rejected it or -errno if it failed some other way
+*/
+static int fcap_uring_check_recv(fcap_uring_t *uring)
+{
+	fcap_uring_reap(uring);
+
+	if (uring->recv_armed)
+		return 0;
+
+	if (uring->recv_error == -EINVAL)
+		return -EOPNOTSUPP;
+
+	return uring->recv_error ? uring->recv_error : -EINVAL;
+}
+
+int fcap_uring_setup_transport(void *priv,
+			       int server_port,
+			       char *dest_ip,
+			       int dest_port)
+{
+	int ret;
+	fcap_uring_t *uring = priv;
+
+	memset(uring, 0, sizeof(*uring));
+	uring->sockfd = -1;
+	uring->ring_fd = -1;
+	uring->ring = MAP_FAILED;
+	uring->sqes = MAP_FAILED;
+	uring->buf_ring = MAP_FAILED;
+
+	/* Creating socket file descriptor */
+	if ((uring->sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		return -errno;
+
+	/*
+	 * Filling server information
+	 * Set IPv4, listen on `server_port` and listen on any host ip
+	 */
+	uring->server_addr.sin_family = AF_INET;
+	uring->server_addr.sin_addr.s_addr = INADDR_ANY;
+	uring->server_addr.sin_port = htons(server_port);
+
+	/* Bind the socket with the server address */
+	ret = bind(uring->sockfd,
+		   (const struct sockaddr *)&uring->server_addr,
+		   sizeof(uring->server_addr));
+	if (ret < 0) {
+		ret = -errno;
+		goto err;
+	}
+
+	/*
+	 * Filling in client information
+	 */
+	uring->dest_addr.sin_family = AF_INET;
+	uring->dest_addr.sin_addr.s_addr = inet_addr(dest_ip);
+	uring->dest_addr.sin_port = htons(dest_port);
+
+	ret = fcap_uring_setup_ring(uring);
+	if (ret < 0)
+		goto err;
+
+	/* Kernels before buffer rings don't know the register opcode */
+	ret = fcap_uring_setup_bufs(uring);
+	if (ret == -EINVAL)
+		ret = -EOPNOTSUPP;
+	if (ret < 0)
+		goto err;
+
+	/* Keep a receive posted from here on */
+	ret = fcap_uring_arm_recv(uring);
+	if (ret < 0)
+		goto err;
+
+	ret = fcap_uring_check_recv(uring);
+	if (ret < 0)
+		goto err;
+
+	return 0;
+
+err:
+	fcap_uring_cleanup(uring);
+	return ret;
+}
+
+void fcap_uring_cleanup(void *priv)
+{
+	fcap_uring_t *uring = priv;
+
+	/* Last chance to send anything still prepared or in flight */
+	if (uring->ring != MAP_FAILED && uring->sqes != MAP_FAILED) {
+		fcap_uring_submit(uring, 0);
+		fcap_uring_reap(uring);
+
+		while (uring->tx_busy) {
+			if (fcap_uring_submit(uring, 1) < 0)
+				break;
+			fcap_uring_reap(uring);
+		}
+	}
+
+	if (uring->buf_ring != MAP_FAILED)
+		munmap(uring->buf_ring,
+		       FCAP_URING_NUM_BUFS * sizeof(struct io_uring_buf));
+	if (uring->sqes != MAP_FAILED)
+		munmap(uring->sqes, uring->sqes_size);
+	if (uring->ring != MAP_FAILED)
+		munmap(uring->ring, uring->ring_size);
+	if (uring->ring_fd >= 0)
+		close(uring->ring_fd);
+	if (uring->sockfd >= 0)
+		close(uring->sockfd);
+
+	uring->ring_fd = -1;
+	uring->sockfd = -1;
+	uring->ring = MAP_FAILED;
+	uring->sqes = MAP_FAILED;
+	uring->buf_ring = MAP_FAILED;
+}
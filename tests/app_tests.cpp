@@ -0,0 +1,886 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+
+extern "C" {
+#include <fcap.h>
+#include <fcap_loopback.h>
+#include <fcap_udp.h>
+#include <fcap_shard.h>
+#include <fcap_trace.h>
+}
+
+#define APP_TEST_PORT (FCAP_PORT + 20)
+#define PEER_TEST_PORT (FCAP_PORT + 21)
+#define SHARD_TEST_PORT (FCAP_PORT + 22)
+#define SHARD_PEER_PORT (FCAP_PORT + 23)
+#define FLUSH_TEST_PORT (FCAP_PORT + 32)
+
+static int num_requests;
+static int num_responses;
+
+extern "C" enum handler_code fcap_user_recv_req(FApp app, FEvent event,
+						FPacket res)
+{
+	num_requests++;
+	return FCAP_CONTINUE;
+}
+
+extern "C" enum handler_code fcap_user_recv_res(FApp app, FEvent event)
+{
+	num_responses++;
+	return FCAP_CONTINUE;
+}
+
+FCAP_CREATE_UDP_TRANSPORT(test_udp);
+FCAP_SET_TRANSPORTS(test_transports, &test_udp)
+FCAP_SET_MIDDLEWARE(test_middleware)
+FCAP_CREATE_APP_TRACKED(test_app, test_transports, test_middleware)
+
+/**
+ * @brief sets up the test app and a udp peer to talk to it
+*/
+class FcapAppTest : public ::testing::Test {
+    protected:
+	struct fcap_udp peer;
+
+	void SetUp() override
+	{
+		char localhost[] = "127.0.0.1";
+
+		ASSERT_EQ(fcap_udp_setup_transport(&test_udp_priv,
+						   APP_TEST_PORT,
+						   localhost,
+						   PEER_TEST_PORT),
+			  0);
+		ASSERT_EQ(fcap_udp_setup_transport(
+				  &peer, PEER_TEST_PORT, localhost, APP_TEST_PORT),
+			  0);
+
+		fcap_init_instance(test_app);
+		num_requests = 0;
+		num_responses = 0;
+	}
+
+	void TearDown() override
+	{
+		fcap_udp_cleanup(&test_udp_priv);
+		fcap_udp_cleanup(&peer);
+		fcap_cleanup_instance(test_app);
+	}
+
+	void send_request()
+	{
+		struct fcap_packet pkt;
+		struct fcap_builder builder;
+
+		fcap_builder_init(&builder, &pkt);
+		fcap_builder_add_key_u8(&builder, KEY_A, 1);
+
+		fcap_udp_send_bytes(&peer,
+				    (uint8_t *)&pkt,
+				    fcap_builder_get_num_bytes(&builder));
+		fcap_udp_flush(&peer);
+	}
+};
+
+TEST_F(FcapAppTest, poll_wait_times_out)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	ASSERT_EQ(fcap_poll_wait(test_app, 20), 0);
+
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	ASSERT_GE(elapsed, std::chrono::milliseconds(10));
+	ASSERT_EQ(num_requests, 0);
+}
+
+TEST_F(FcapAppTest, poll_wait_wakes_on_data)
+{
+	send_request();
+	send_request();
+
+	ASSERT_EQ(fcap_poll_wait(test_app, 1000), 2);
+	ASSERT_EQ(num_requests, 2);
+}
+
+TEST_F(FcapAppTest, poll_wait_spins)
+{
+	fcap_set_spin(test_app, 100);
+
+	ASSERT_EQ(fcap_poll_wait(test_app, 0), 0);
+
+	/* Nothing turned up, so spin for less next time */
+	ASSERT_EQ(test_app->spin_us, 50u);
+
+	send_request();
+	ASSERT_EQ(fcap_poll_wait(test_app, 1000), 1);
+	ASSERT_EQ(num_requests, 1);
+
+	fcap_set_spin(test_app, 0);
+}
+
+static FPacket kept_pkt;
+
+static enum handler_code pool_recv_req(FApp app, FEvent event, FPacket res)
+{
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+
+	/* Keep the request for later */
+	fcap_pool_hold(app->pool, event->pkt);
+	kept_pkt = event->pkt;
+
+	/* Sending a request doesn't clobber the response */
+	fcap_builder_init(&builder, &pkt);
+	fcap_builder_add_key_u8(&builder, KEY_C, 3);
+	fcap_send_pkt(app, event->transport, &builder);
+
+	fcap_app_add_key_u8(app, KEY_B, 2);
+	return FCAP_RESPOND;
+}
+
+TEST_F(FcapAppTest, pool_keeps_packets)
+{
+	int ret;
+	uint8_t value;
+	struct fcap_packet pkt;
+	struct fcap_view view;
+	FCAP_CREATE_POOL(pool, 2);
+
+	test_app->pool = pool;
+	test_app->on_request = pool_recv_req;
+
+	send_request();
+	ASSERT_EQ(fcap_poll_wait(test_app, 1000), 1);
+
+	/* The request outlives the poll which handled it */
+	ASSERT_EQ(pool->num_free, 1);
+	ASSERT_EQ(fcap_get_key_u8(kept_pkt, KEY_A, &value), 0);
+	ASSERT_EQ(value, 1);
+	ASSERT_EQ(fcap_pool_release(pool, kept_pkt), 0);
+
+	/* The peer gets the request sent by the handler, then the response */
+	ret = fcap_udp_get_bytes(&peer, (uint8_t *)&pkt, sizeof(pkt));
+	ASSERT_EQ(fcap_decode_packet(&view, &pkt, ret), 0);
+	ASSERT_EQ(fcap_get_type(&pkt), FCAP_REQUEST);
+	ASSERT_EQ(fcap_view_get_key_u8(&view, KEY_C, &value), 0);
+
+	ret = fcap_udp_get_bytes(&peer, (uint8_t *)&pkt, sizeof(pkt));
+	ASSERT_EQ(fcap_decode_packet(&view, &pkt, ret), 0);
+	ASSERT_EQ(fcap_get_type(&pkt), FCAP_RESPONSE);
+	ASSERT_EQ(fcap_view_get_key_u8(&view, KEY_B, &value), 0);
+	ASSERT_EQ(fcap_view_has_key(&view, KEY_C), 0);
+
+	test_app->pool = NULL;
+	test_app->on_request = NULL;
+}
+
+static char mw_order[8];
+static int mw_calls;
+static int mw_responses;
+
+static enum handler_code mw_on_request(void *priv, FEvent event, FPacket res)
+{
+	mw_order[mw_calls++] = *(char *)priv;
+	mw_responses += res != NULL;
+	return FCAP_CONTINUE;
+}
+
+TEST_F(FcapAppTest, middleware_order)
+{
+	char names[] = "ab";
+	struct fcap_middleware mw_a = { &names[0], mw_on_request, NULL };
+	struct fcap_middleware mw_b = { &names[1], mw_on_request, NULL };
+	struct fcap_middleware mw_none = { NULL, NULL, NULL };
+	const FMiddleware middleware[] = { &mw_a, &mw_none, &mw_b };
+	struct fcap app;
+
+	fcap_init_app(&app, test_transports, 1, middleware, 3, NULL);
+	mw_calls = 0;
+	mw_responses = 0;
+
+	/* Outbound requests go through the middleware in order */
+	fcap_app_add_key_u8(&app, KEY_A, 1);
+	ASSERT_GT(fcap_send_req(&app, &test_udp), 0);
+
+	/* With no response to fill, rather than whatever the app is handling */
+	ASSERT_EQ(mw_responses, 0);
+
+	/* Inbound requests go through in reverse, skipping empty handlers */
+	send_request();
+	ASSERT_EQ(fcap_poll_wait(&app, 1000), 1);
+	ASSERT_EQ(num_requests, 1);
+
+	ASSERT_EQ(mw_calls, 4);
+	ASSERT_EQ(std::string(mw_order, 4), "abba");
+	ASSERT_EQ(mw_responses, 2);
+
+	fcap_cleanup_instance(&app);
+}
+
+static enum handler_code resize_on_response(void *priv, FEvent event)
+{
+	/* Swap the response's key for a bigger one behind the builders back */
+	if (event->is_outbound) {
+		fcap_init_packet(event->pkt);
+		fcap_set_type(event->pkt, FCAP_RESPONSE);
+		fcap_add_key_d64(event->pkt, KEY_B, 2.5);
+	}
+
+	return FCAP_CONTINUE;
+}
+
+static enum handler_code resize_recv_req(FApp app, FEvent event, FPacket res)
+{
+	fcap_app_add_key_u8(app, KEY_B, 2);
+	return FCAP_RESPOND;
+}
+
+TEST_F(FcapAppTest, middleware_resizes_response)
+{
+	int ret;
+	double value;
+	struct fcap_packet pkt;
+	struct fcap_view view;
+	struct fcap_middleware mw = { NULL, NULL, resize_on_response };
+	const FMiddleware middleware[] = { &mw };
+	struct fcap app;
+
+	fcap_init_app(&app, test_transports, 1, middleware, 1, NULL);
+	app.on_request = resize_recv_req;
+
+	send_request();
+	ASSERT_EQ(fcap_poll_wait(&app, 1000), 1);
+
+	/* The whole of the new key is sent, not just the length of the old */
+	ret = fcap_udp_get_bytes(&peer, (uint8_t *)&pkt, sizeof(pkt));
+	ASSERT_EQ(ret, fcap_get_num_bytes(&pkt));
+	ASSERT_EQ(fcap_decode_packet(&view, &pkt, ret), 0);
+	ASSERT_EQ(fcap_view_get_key_d64(&view, KEY_B, &value), 0);
+	ASSERT_EQ(value, 2.5);
+
+	fcap_cleanup_instance(&app);
+}
+
+static enum handler_code trace_on_response(void *priv, FEvent event)
+{
+	return FCAP_CONTINUE;
+}
+
+static enum handler_code trace_recv_req(FApp app, FEvent event, FPacket res)
+{
+	fcap_app_add_key_u8(app, KEY_B, 2);
+	return FCAP_RESPOND;
+}
+
+TEST_F(FcapAppTest, trace_stages)
+{
+#ifndef FCAP_TRACE
+	GTEST_SKIP() << "built without FCAP_TRACE";
+#endif
+	int i;
+	char names[] = "ab";
+	struct fcap_trace_event events[16];
+	struct fcap_middleware mw_a = { &names[0], mw_on_request,
+					trace_on_response };
+	struct fcap_middleware mw_b = { &names[1], mw_on_request,
+					trace_on_response };
+	const FMiddleware middleware[] = { &mw_a, &mw_b };
+	struct fcap app;
+	const struct {
+		uint8_t stage;
+		uint8_t index;
+		uint8_t is_outbound;
+	} expected[] = {
+		{ FCAP_TRACE_RECV, 0, 0 },
+		{ FCAP_TRACE_MW_REQUEST, 1, 0 },
+		{ FCAP_TRACE_MW_REQUEST, 0, 0 },
+		{ FCAP_TRACE_USER, 0, 0 },
+		{ FCAP_TRACE_MW_RESPONSE, 0, 1 },
+		{ FCAP_TRACE_MW_RESPONSE, 1, 1 },
+		{ FCAP_TRACE_SEND, 0, 1 },
+	};
+
+	fcap_init_app(&app, test_transports, 1, middleware, 2, NULL);
+	app.on_request = trace_recv_req;
+	mw_calls = 0;
+
+	/* Throw away what earlier tests traced */
+	while (fcap_trace_drain(events, 16) > 0)
+		;
+
+	send_request();
+	ASSERT_EQ(fcap_poll_wait(&app, 1000), 1);
+
+	/* Every stage of handling the request, in the order they ran */
+	ASSERT_EQ(fcap_trace_drain(events, 16), 7);
+	for (i = 0; i < 7; i++) {
+		ASSERT_EQ(events[i].stage, expected[i].stage);
+		ASSERT_EQ(events[i].index, expected[i].index);
+		ASSERT_EQ(events[i].is_outbound, expected[i].is_outbound);
+		ASSERT_EQ(events[i].thread, (uint32_t)gettid());
+		ASSERT_GE(events[i].start_ns,
+			  i > 0 ? events[i - 1].start_ns : 0);
+	}
+	ASSERT_EQ(fcap_trace_drain(events, 16), 0);
+
+	fcap_cleanup_instance(&app);
+}
+
+struct done_ctx {
+	int calls;
+	FError status;
+	uint8_t value;
+};
+
+static void on_done(FApp app, FEvent event, FError status, void *priv)
+{
+	struct done_ctx *ctx = (struct done_ctx *)priv;
+
+	ctx->calls++;
+	ctx->status = status;
+	if (event)
+		fcap_view_get_key_u8(event->view, KEY_B, &ctx->value);
+}
+
+/**
+ * @brief has the peer respond to the next request it has received
+ * @returns the message ID of the request
+*/
+static int peer_respond(struct fcap_udp *peer, uint8_t value)
+{
+	int id;
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+
+	EXPECT_GT(fcap_udp_get_bytes(peer, (uint8_t *)&pkt, sizeof(pkt)), 0);
+	EXPECT_EQ(fcap_get_type(&pkt), FCAP_REQUEST);
+	id = pkt.header.message_id;
+
+	fcap_builder_init(&builder, &pkt);
+	pkt.header.message_id = id;
+	fcap_set_type(&pkt, FCAP_RESPONSE);
+	fcap_builder_add_key_u8(&builder, KEY_B, value);
+
+	fcap_udp_send_bytes(peer,
+			    (uint8_t *)&pkt,
+			    fcap_builder_get_num_bytes(&builder));
+	fcap_udp_flush(peer);
+
+	return id;
+}
+
+TEST_F(FcapAppTest, tracked_request_completes)
+{
+	struct done_ctx first = {};
+	struct done_ctx second = {};
+
+	fcap_app_add_key_u8(test_app, KEY_A, 1);
+	ASSERT_EQ(fcap_send_req_cb(test_app, &test_udp, 1000, on_done, &first),
+		  0);
+	fcap_app_add_key_u8(test_app, KEY_A, 1);
+	ASSERT_EQ(fcap_send_req_cb(test_app, &test_udp, 1000, on_done, &second),
+		  1);
+	fcap_flush(test_app);
+
+	peer_respond(&peer, 5);
+	peer_respond(&peer, 6);
+
+	ASSERT_EQ(fcap_poll_wait(test_app, 1000), 2);
+	ASSERT_EQ(first.calls, 1);
+	ASSERT_EQ(first.status, FCAP_ENONE);
+	ASSERT_EQ(first.value, 5);
+	ASSERT_EQ(second.calls, 1);
+	ASSERT_EQ(second.value, 6);
+
+	/* Tracked responses don't reach the app's handler */
+	ASSERT_EQ(num_responses, 0);
+	ASSERT_EQ(test_app->pending[0].num_pending, 0);
+}
+
+TEST_F(FcapAppTest, untracked_by_default)
+{
+	struct done_ctx ctx = {};
+	FCAP_CREATE_APP(untracked, test_transports, test_middleware)
+
+	/* Only apps which ask for it pay for a pending table */
+	ASSERT_EQ(untracked->pending, nullptr);
+
+	fcap_app_add_key_u8(untracked, KEY_A, 1);
+	ASSERT_EQ(fcap_send_req_cb(untracked, &test_udp, 1000, on_done, &ctx),
+		  -FCAP_EINVAL);
+}
+
+TEST_F(FcapAppTest, tracked_request_times_out)
+{
+	struct done_ctx ctx = {};
+
+	fcap_app_add_key_u8(test_app, KEY_A, 1);
+	ASSERT_GE(fcap_send_req_cb(test_app, &test_udp, 10, on_done, &ctx), 0);
+	fcap_flush(test_app);
+
+	/* The wait ends once the request is due, with nothing received */
+	ASSERT_EQ(fcap_poll_wait(test_app, 1000), 0);
+	ASSERT_EQ(ctx.calls, 1);
+	ASSERT_EQ(ctx.status, FCAP_ETIMEDOUT);
+	ASSERT_EQ(test_app->next_deadline_us, 0u);
+
+	/* A late response is no longer tracked, so goes to the app */
+	peer_respond(&peer, 5);
+	ASSERT_EQ(fcap_poll_wait(test_app, 1000), 1);
+	ASSERT_EQ(ctx.calls, 1);
+	ASSERT_EQ(num_responses, 1);
+}
+
+TEST_F(FcapAppTest, async_requests_pipeline)
+{
+	int i;
+	int id;
+	struct done_ctx ctxs[3] = {};
+	struct fcap_packet pkts[3];
+	struct fcap_builder builders[3];
+
+	auto send = [&](int i) {
+		return fcap_send_async(
+			test_app, &test_udp, &builders[i], 0, on_done, &ctxs[i]);
+	};
+
+	ASSERT_EQ(fcap_set_window(test_app, &test_udp, 2), 0);
+
+	for (i = 0; i < 3; i++) {
+		fcap_builder_init(&builders[i], &pkts[i]);
+		fcap_builder_add_key_u8(&builders[i], KEY_A, i);
+	}
+
+	/* Two requests go out without waiting, the third is over the window */
+	ASSERT_GE(send(0), 0);
+	ASSERT_GE(send(1), 0);
+	ASSERT_EQ(send(2), -FCAP_EAGAIN);
+	fcap_flush(test_app);
+
+	/* Each response reaches the continuation of its own request */
+	id = peer_respond(&peer, 10);
+	ASSERT_EQ(id, pkts[0].header.message_id);
+	ASSERT_EQ(fcap_poll_wait(test_app, 1000), 1);
+	ASSERT_EQ(ctxs[0].value, 10);
+	ASSERT_EQ(ctxs[1].calls, 0);
+
+	/* A response makes room in the window */
+	ASSERT_GE(send(2), 0);
+	fcap_flush(test_app);
+
+	peer_respond(&peer, 11);
+	peer_respond(&peer, 12);
+	ASSERT_EQ(fcap_poll_wait(test_app, 1000), 2);
+
+	for (i = 0; i < 3; i++) {
+		ASSERT_EQ(ctxs[i].calls, 1);
+		ASSERT_EQ(ctxs[i].status, FCAP_ENONE);
+	}
+	ASSERT_EQ(ctxs[1].value, 11);
+	ASSERT_EQ(ctxs[2].value, 12);
+}
+
+TEST_F(FcapAppTest, queue_many_senders)
+{
+	int i;
+	int ret;
+	int received = 0;
+	uint8_t thread_id;
+	uint8_t seq;
+	uint8_t next_seq[4] = {};
+	uint8_t bytes[MTU];
+	struct fcap_view view;
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+	std::vector<std::thread> senders;
+	FCAP_CREATE_QUEUE(queue, 16);
+
+	/* Nothing drains the queue yet, so it fills up */
+	fcap_builder_init(&builder, &pkt);
+	for (i = 0; i < 16; i++)
+		ASSERT_EQ(fcap_queue_send(queue, &test_udp, &builder), 0);
+	ASSERT_EQ(fcap_queue_send(queue, &test_udp, &builder), -FCAP_EAGAIN);
+	while (fcap_queue_peek(queue))
+		fcap_queue_pop(queue);
+
+	test_app->queue = queue;
+
+	for (i = 0; i < 4; i++) {
+		senders.emplace_back([i, queue]() {
+			int j;
+			struct fcap_packet pkt;
+			struct fcap_builder builder;
+
+			for (j = 0; j < 64; j++) {
+				fcap_builder_init(&builder, &pkt);
+				fcap_builder_add_key_u8(&builder, KEY_A, i);
+				fcap_builder_add_key_u8(&builder, KEY_B, j);
+				while (fcap_queue_send(queue, &test_udp,
+						       &builder) == -FCAP_EAGAIN)
+					std::this_thread::yield();
+			}
+		});
+	}
+
+	/* Each sender's packets arrive in the order it sent them */
+	while (received < 4 * 64) {
+		ASSERT_GE(fcap_poll(test_app), 0);
+
+		while ((ret = fcap_udp_get_bytes(&peer, bytes, MTU)) > 0) {
+			ASSERT_EQ(fcap_decode_packet(&view, (FPacket)bytes, ret),
+				  0);
+			fcap_view_get_key_u8(&view, KEY_A, &thread_id);
+			fcap_view_get_key_u8(&view, KEY_B, &seq);
+			ASSERT_LT(thread_id, 4);
+			ASSERT_EQ(seq, next_seq[thread_id]++);
+			received++;
+		}
+		std::this_thread::yield();
+	}
+
+	for (auto &sender : senders)
+		sender.join();
+
+	test_app->queue = NULL;
+}
+
+TEST_F(FcapAppTest, queue_wakes_waiter)
+{
+	struct fcap_metrics metrics;
+	FCAP_CREATE_QUEUE(queue, 4);
+
+	test_app->queue = queue;
+
+	/* An idle app with a queue sleeps rather than polling every retry */
+	ASSERT_EQ(fcap_poll_wait(test_app, 100), 0);
+	ASSERT_EQ(fcap_get_metrics(test_app, NULL, &metrics), 0);
+	ASSERT_LT(metrics.empty_polls, 10u);
+
+	/* And a packet sent through the queue wakes it to send it at once */
+	std::chrono::steady_clock::duration took;
+	std::thread sender([this, queue, &took]() {
+		int ret;
+		uint8_t bytes[MTU];
+		struct fcap_packet pkt;
+		struct fcap_builder builder;
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		auto start = std::chrono::steady_clock::now();
+		fcap_builder_init(&builder, &pkt);
+		fcap_builder_add_key_u8(&builder, KEY_A, 1);
+		fcap_queue_send(queue, &test_udp, &builder);
+		do {
+			ret = fcap_udp_get_bytes(&peer, bytes, MTU);
+			took = std::chrono::steady_clock::now() - start;
+		} while (ret == 0 && took < std::chrono::seconds(1));
+	});
+
+	ASSERT_GE(fcap_poll_wait(test_app, 300), 0);
+	sender.join();
+	ASSERT_LT(took, std::chrono::milliseconds(150));
+
+	fcap_cleanup_instance(test_app);
+	test_app->queue = NULL;
+}
+
+TEST_F(FcapAppTest, metrics_count)
+{
+	uint8_t junk[3] = { 0xff, 0xff, 0xff };
+	struct fcap_metrics metrics;
+	struct fcap_transport other = {};
+
+	/* Nothing there, then a request and a malformed packet */
+	ASSERT_EQ(fcap_poll(test_app), 0);
+	send_request();
+	fcap_udp_send_bytes(&peer, junk, sizeof(junk));
+	fcap_udp_flush(&peer);
+	do {
+		ASSERT_GT(fcap_poll_wait(test_app, 1000), 0);
+		ASSERT_EQ(fcap_get_metrics(test_app, &test_udp, &metrics), 0);
+	} while (metrics.pkts_in < 2);
+
+	/* And a request of our own */
+	fcap_app_add_key_u8(test_app, KEY_A, 1);
+	ASSERT_EQ(fcap_send_req(test_app, &test_udp), 4);
+
+	ASSERT_EQ(fcap_get_metrics(test_app, &test_udp, &metrics), 0);
+	ASSERT_EQ(metrics.pkts_in, 2);
+	ASSERT_EQ(metrics.bytes_in, 4 + sizeof(junk));
+	ASSERT_EQ(metrics.requests, 1);
+	ASSERT_EQ(metrics.decode_rejects, 1);
+	ASSERT_EQ(metrics.pkts_out, 1);
+	ASSERT_EQ(metrics.bytes_out, 4);
+	ASSERT_EQ(metrics.send_failures, 0);
+	ASSERT_GE(metrics.empty_polls, 1);
+
+	/* Resetting starts every counter again */
+	ASSERT_EQ(fcap_reset_metrics(test_app, NULL), 0);
+	ASSERT_EQ(fcap_get_metrics(test_app, NULL, &metrics), 0);
+	ASSERT_EQ(metrics.pkts_in, 0);
+	ASSERT_EQ(metrics.pkts_out, 0);
+	ASSERT_EQ(metrics.empty_polls, 0);
+
+	ASSERT_EQ(fcap_poll(test_app), 0);
+	ASSERT_EQ(fcap_get_metrics(test_app, NULL, &metrics), 0);
+	ASSERT_EQ(metrics.empty_polls, 1);
+
+	ASSERT_EQ(fcap_get_metrics(test_app, &other, &metrics),
+		  -FCAP_EINVAL);
+}
+
+TEST(FCAP_FLUSH_TESTS, unsendable_is_dropped)
+{
+	int i;
+	int ret;
+	char localhost[] = "127.0.0.1";
+	uint8_t bytes[MTU];
+	static struct fcap app;
+	static struct fcap_udp bad;
+	static struct fcap_udp good;
+	static struct fcap_udp peer;
+	static struct fcap_counters counters[2];
+	struct fcap_metrics metrics;
+	struct fcap_transport bad_transport = {
+		.priv = &bad,
+		.get_bytes = fcap_udp_get_bytes,
+		.send_bytes = fcap_udp_send_bytes,
+		.flush = fcap_udp_flush,
+		.take_drops = fcap_udp_take_drops,
+	};
+	struct fcap_transport good_transport = bad_transport;
+	const FTransport transports[] = { &bad_transport, &good_transport };
+	struct pollfd poll_fd;
+
+	/* Nothing can be sent to port 0, so the kernel refuses the datagram */
+	good_transport.priv = &good;
+	ASSERT_EQ(fcap_udp_setup_transport(&bad, FLUSH_TEST_PORT, localhost, 0),
+		  0);
+	ASSERT_EQ(fcap_udp_setup_transport(&good,
+					   FLUSH_TEST_PORT + 1,
+					   localhost,
+					   FLUSH_TEST_PORT + 2),
+		  0);
+	ASSERT_EQ(fcap_udp_setup_transport(&peer,
+					   FLUSH_TEST_PORT + 2,
+					   localhost,
+					   FLUSH_TEST_PORT + 1),
+		  0);
+	fcap_init_app(&app, transports, 2, NULL, 0, NULL);
+	app.counters = counters;
+
+	for (i = 0; i < 3; i++) {
+		fcap_app_add_key_u8(&app, KEY_A, i);
+		ASSERT_EQ(fcap_send_req(&app, transports[i / 2]), 4);
+	}
+
+	/* The bad transport drops its two, and the good one still sends */
+	ASSERT_EQ(fcap_flush(&app), 0);
+	ASSERT_EQ(fcap_get_metrics(&app, &bad_transport, &metrics), 0);
+	ASSERT_EQ(metrics.send_failures, 2);
+	ASSERT_EQ(fcap_get_metrics(&app, &good_transport, &metrics), 0);
+	ASSERT_EQ(metrics.send_failures, 0);
+
+	poll_fd = { .fd = peer.dgram.sockfd, .events = POLLIN };
+	while ((ret = fcap_udp_get_bytes(&peer, bytes, MTU)) == 0)
+		ASSERT_EQ(poll(&poll_fd, 1, 1000), 1);
+	ASSERT_EQ(ret, 4);
+
+	fcap_cleanup_instance(&app);
+	fcap_udp_cleanup(&bad);
+	fcap_udp_cleanup(&good);
+	fcap_udp_cleanup(&peer);
+}
+
+static enum handler_code loop_recv_req(FApp app, FEvent event, FPacket res)
+{
+	uint8_t value;
+
+	fcap_view_get_key_u8(event->view, KEY_A, &value);
+	fcap_app_add_key_u8(app, KEY_B, value + 1);
+	return FCAP_RESPOND;
+}
+
+/* Sends another request from inside the handling of the first response */
+static void loop_on_done(FApp app, FEvent event, FError status, void *priv)
+{
+	struct done_ctx *ctx = (struct done_ctx *)priv;
+
+	on_done(app, event, status, priv);
+
+	if (ctx->calls == 1) {
+		fcap_app_add_key_u8(app, KEY_A, ctx->value);
+		fcap_send_req_cb(app, app->transports[0], 0, loop_on_done, priv);
+	}
+}
+
+TEST(FCAP_LOOPBACK_TESTS, short_circuits)
+{
+	struct done_ctx ctx = {};
+	static struct fcap client;
+	static struct fcap server;
+	static struct fcap_pending client_pending[1];
+	FCAP_CREATE_LOOPBACK_TRANSPORT(client_loop);
+	FCAP_CREATE_LOOPBACK_TRANSPORT(server_loop);
+	const FTransport client_transports[] = { &client_loop };
+	const FTransport server_transports[] = { &server_loop };
+
+	fcap_loopback_connect(&client_loop, &server_loop);
+	fcap_init_app(&client, client_transports, 1, NULL, 0, client_pending);
+	fcap_init_app(&server, server_transports, 1, NULL, 0, NULL);
+	server.on_request = loop_recv_req;
+
+	/* The request and its response are handled during the send */
+	fcap_app_add_key_u8(&client, KEY_A, 1);
+	ASSERT_GE(fcap_send_req_cb(&client, &client_loop, 0, loop_on_done, &ctx),
+		  0);
+	ASSERT_EQ(ctx.calls, 1);
+	ASSERT_EQ(ctx.status, FCAP_ENONE);
+	ASSERT_EQ(ctx.value, 2);
+
+	/*
+	 * The second request was sent while the server was still busy
+	 * responding, so it waits in the server's ring until it polls
+	 */
+	ASSERT_EQ(fcap_poll(&client), 0);
+	ASSERT_EQ(ctx.calls, 1);
+	ASSERT_EQ(fcap_poll(&server), 1);
+	ASSERT_EQ(ctx.calls, 2);
+	ASSERT_EQ(ctx.value, 3);
+	ASSERT_EQ(client_pending[0].num_pending, 0);
+
+	fcap_cleanup_instance(&client);
+	fcap_cleanup_instance(&server);
+}
+
+static enum handler_code shard_recv_req(FApp app, FEvent event, FPacket res)
+{
+	uint8_t value;
+
+	__atomic_fetch_add((int *)app->priv, 1, __ATOMIC_RELAXED);
+	if (fcap_view_get_key_u8(event->view, KEY_A, &value) < 0)
+		return FCAP_ABORT;
+
+	fcap_app_add_key_u8(app, KEY_B, value);
+	return FCAP_RESPOND;
+}
+
+TEST(FCAP_SHARD_TESTS, workers_share_port)
+{
+	int i;
+	int ret;
+	int handled[2] = {};
+	void *ctxs[2] = { &handled[0], &handled[1] };
+	uint8_t value;
+	char localhost[] = "127.0.0.1";
+	uint8_t bytes[MTU];
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+	struct fcap_view view;
+	static struct fcap_udp peers[8];
+	FCAP_CREATE_WORKERS(workers, 2);
+	struct fcap_shard_config config = {
+		.server_port = SHARD_TEST_PORT,
+		.middleware = NULL,
+		.num_middleware = 0,
+		.on_request = shard_recv_req,
+		.on_response = NULL,
+		.priv = ctxs,
+		.first_cpu = -1,
+	};
+
+	ASSERT_EQ(fcap_shard_start(workers, workers_size, &config), 0);
+
+	/* Peers on different ports, so the kernel spreads them between workers */
+	for (i = 0; i < 8; i++) {
+		ASSERT_EQ(fcap_udp_setup_transport(&peers[i],
+						   SHARD_PEER_PORT + i,
+						   localhost,
+						   SHARD_TEST_PORT),
+			  0);
+		fcap_builder_init(&builder, &pkt);
+		fcap_builder_add_key_u8(&builder, KEY_A, i);
+		fcap_udp_send_bytes(&peers[i],
+				    (uint8_t *)&pkt,
+				    fcap_builder_get_num_bytes(&builder));
+		fcap_udp_flush(&peers[i]);
+	}
+
+	/* Each peer gets the response to its own request, and nothing else */
+	for (i = 0; i < 8; i++) {
+		struct pollfd poll_fd = {
+			.fd = peers[i].dgram.sockfd,
+			.events = POLLIN,
+		};
+
+		while ((ret = fcap_udp_get_bytes(&peers[i], bytes, MTU)) == 0)
+			ASSERT_EQ(poll(&poll_fd, 1, 1000), 1);
+		ASSERT_GT(ret, 0);
+		ASSERT_EQ(fcap_decode_packet(&view, (FPacket)bytes, ret), 0);
+		ASSERT_EQ(fcap_view_get_key_u8(&view, KEY_B, &value), 0);
+		ASSERT_EQ(value, i);
+		ASSERT_EQ(fcap_udp_get_bytes(&peers[i], bytes, MTU), 0);
+	}
+
+	ASSERT_EQ(fcap_shard_stop(workers, workers_size), 0);
+	for (i = 0; i < 8; i++)
+		fcap_udp_cleanup(&peers[i]);
+
+	ASSERT_EQ(handled[0] + handled[1], 8);
+}
+
+TEST(FCAP_SHARD_TESTS, worker_survives_errors)
+{
+	int i;
+	int ret;
+	int handled[1] = {};
+	void *ctxs[1] = { &handled[0] };
+	char localhost[] = "127.0.0.1";
+	uint8_t bytes[MTU];
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+	struct fcap_udp peer;
+	struct pollfd poll_fd;
+	FCAP_CREATE_WORKERS(workers, 1);
+	struct fcap_shard_config config = {
+		.server_port = SHARD_TEST_PORT,
+		.middleware = NULL,
+		.num_middleware = 0,
+		.on_request = shard_recv_req,
+		.on_response = NULL,
+		.priv = ctxs,
+		.first_cpu = -1,
+	};
+
+	ASSERT_EQ(fcap_shard_start(workers, workers_size, &config), 0);
+	ASSERT_EQ(fcap_udp_setup_transport(
+			  &peer, SHARD_PEER_PORT, localhost, SHARD_TEST_PORT),
+		  0);
+
+	/* The handler aborts the first request, which is an error for the app */
+	for (i = 0; i < 2; i++) {
+		fcap_builder_init(&builder, &pkt);
+		fcap_builder_add_key_u8(&builder, i ? KEY_A : KEY_C, 1);
+		fcap_udp_send_bytes(&peer,
+				    (uint8_t *)&pkt,
+				    fcap_builder_get_num_bytes(&builder));
+	}
+	fcap_udp_flush(&peer);
+
+	/* The worker carries on and answers the second */
+	poll_fd = { .fd = peer.dgram.sockfd, .events = POLLIN };
+	while ((ret = fcap_udp_get_bytes(&peer, bytes, MTU)) == 0)
+		ASSERT_EQ(poll(&poll_fd, 1, 1000), 1);
+	ASSERT_GT(ret, 0);
+
+	/* The error is still reported once the worker is stopped */
+	ASSERT_EQ(fcap_shard_stop(workers, workers_size), -FCAP_EINVAL);
+	fcap_udp_cleanup(&peer);
+
+	ASSERT_EQ(handled[0], 2);
+}
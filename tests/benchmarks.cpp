@@ -0,0 +1,552 @@
+#include <benchmark/benchmark.h>
+#include <cstring>
+
+extern "C" {
+#include <fcap.h>
+}
+#include <fcap_schema.hpp>
+
+/* The most transports any benchmark gives an app */
+#define BENCH_MAX_TRANSPORTS 16
+
+/* The most middleware any benchmark gives an app */
+#define BENCH_MAX_MIDDLEWARE 8
+
+static int bench_get_nothing(void *priv, uint8_t *bytes, size_t length)
+{
+	return 0;
+}
+
+static int bench_send_nothing(void *priv, uint8_t *bytes, size_t length)
+{
+	return length;
+}
+
+static struct fcap_transport bench_idle = {
+	.priv = NULL,
+	.get_bytes = bench_get_nothing,
+	.send_bytes = bench_send_nothing,
+	.flush = NULL,
+	.get_fd = NULL,
+};
+
+static const FTransport bench_idle_transports[BENCH_MAX_TRANSPORTS] = {
+	&bench_idle, &bench_idle, &bench_idle, &bench_idle,
+	&bench_idle, &bench_idle, &bench_idle, &bench_idle,
+	&bench_idle, &bench_idle, &bench_idle, &bench_idle,
+	&bench_idle, &bench_idle, &bench_idle, &bench_idle,
+};
+
+/**
+ * @brief an in-memory transport which receives the same packet every time it
+ * is asked, so fcap_poll always has a full budget of work
+ * @param bytes the packet to receive
+ * @param length the length of @bytes
+*/
+struct bench_mem {
+	uint8_t bytes[MTU];
+	size_t length;
+};
+
+static int bench_mem_get_bytes(void *priv, uint8_t *bytes, size_t length)
+{
+	struct bench_mem *mem = (struct bench_mem *)priv;
+
+	memcpy(bytes, mem->bytes, mem->length);
+
+	return mem->length;
+}
+
+static enum handler_code bench_mw_request(void *priv, FEvent event, FPacket res)
+{
+	return FCAP_CONTINUE;
+}
+
+static enum handler_code bench_mw_response(void *priv, FEvent event)
+{
+	return FCAP_CONTINUE;
+}
+
+static struct fcap_middleware bench_mw = {
+	.priv = NULL,
+	.on_request = bench_mw_request,
+	.on_response = bench_mw_response,
+};
+
+static const FMiddleware bench_middleware[BENCH_MAX_MIDDLEWARE] = {
+	&bench_mw, &bench_mw, &bench_mw, &bench_mw,
+	&bench_mw, &bench_mw, &bench_mw, &bench_mw,
+};
+
+static enum handler_code bench_respond(FApp app, FEvent event, FPacket res)
+{
+	int32_t value;
+
+	fcap_app_get_key_i32(app, KEY_A, &value);
+	fcap_app_add_key_i32(app, KEY_A, value);
+
+	return FCAP_RESPOND;
+}
+
+/* Packets from a single key up to as many as the header can count */
+static void bench_key_counts(benchmark::internal::Benchmark *bench)
+{
+	bench->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Arg(16)->Arg(NUM_KEYS - 1);
+}
+
+/**
+ * @brief builds a packet with a number of i32 keys, starting from KEY_A
+*/
+static void bench_build(FBuilder builder, FPacket pkt, int num_keys)
+{
+	int i;
+
+	fcap_builder_init(builder, pkt);
+	for (i = 0; i < num_keys; i++)
+		fcap_builder_add_key_i32(builder, (FKey)i, i);
+}
+
+/*    Building Packets    */
+
+static void BM_init_packet(benchmark::State &state)
+{
+	struct fcap_packet pkt;
+
+	for (auto _ : state) {
+		fcap_init_packet(&pkt);
+		benchmark::DoNotOptimize(pkt);
+	}
+}
+BENCHMARK(BM_init_packet);
+
+/* Filling a packet with fcap_add_key, which walks the packet for every key */
+static void BM_add_key(benchmark::State &state)
+{
+	int i;
+	int32_t value = 1;
+	struct fcap_packet pkt;
+
+	for (auto _ : state) {
+		fcap_init_packet(&pkt);
+		for (i = 0; i < state.range(0); i++)
+			fcap_add_key(&pkt, (FKey)i, FCAP_INT32, &value,
+				     sizeof(value));
+		benchmark::DoNotOptimize(pkt);
+	}
+
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_add_key)->Apply(bench_key_counts);
+
+/* Filling a packet through a builder, which never walks the packet */
+static void BM_builder_add_key(benchmark::State &state)
+{
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+
+	for (auto _ : state) {
+		bench_build(&builder, &pkt, state.range(0));
+		benchmark::DoNotOptimize(pkt);
+	}
+
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_builder_add_key)->Apply(bench_key_counts);
+
+/* Filling a packet with a single batch, checked once and written in one pass */
+static void BM_add_keys(benchmark::State &state)
+{
+	int i;
+	int32_t value = 1;
+	struct fcap_packet pkt;
+	struct fcap_key_desc descs[NUM_KEYS];
+
+	for (i = 0; i < state.range(0); i++)
+		descs[i] = { (FKey)i, FCAP_INT32, &value, sizeof(value) };
+
+	for (auto _ : state) {
+		fcap_init_packet(&pkt);
+		fcap_add_keys(&pkt, descs, state.range(0));
+		benchmark::DoNotOptimize(pkt);
+	}
+
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_add_keys)->Apply(bench_key_counts);
+
+static void BM_get_num_bytes(benchmark::State &state)
+{
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+
+	bench_build(&builder, &pkt, state.range(0));
+
+	for (auto _ : state)
+		benchmark::DoNotOptimize(fcap_get_num_bytes(&pkt));
+}
+BENCHMARK(BM_get_num_bytes)->Apply(bench_key_counts);
+
+static void BM_builder_get_num_bytes(benchmark::State &state)
+{
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+
+	bench_build(&builder, &pkt, state.range(0));
+
+	for (auto _ : state)
+		benchmark::DoNotOptimize(fcap_builder_get_num_bytes(&builder));
+}
+BENCHMARK(BM_builder_get_num_bytes)->Apply(bench_key_counts);
+
+/* Building a packet and copying it out to the wire */
+static void BM_encode(benchmark::State &state)
+{
+	int num_bytes = 0;
+	uint8_t wire[MTU];
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+
+	for (auto _ : state) {
+		bench_build(&builder, &pkt, state.range(0));
+		num_bytes = fcap_builder_get_num_bytes(&builder);
+		memcpy(wire, &pkt, num_bytes);
+		benchmark::DoNotOptimize(wire);
+	}
+
+	state.SetBytesProcessed(state.iterations() * num_bytes);
+}
+BENCHMARK(BM_encode)->Apply(bench_key_counts);
+
+/*    Reading Packets    */
+
+/* Validating and indexing a received packet */
+static void BM_decode(benchmark::State &state)
+{
+	int num_bytes;
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+	struct fcap_view view;
+
+	bench_build(&builder, &pkt, state.range(0));
+	num_bytes = fcap_builder_get_num_bytes(&builder);
+
+	for (auto _ : state)
+		benchmark::DoNotOptimize(
+			fcap_decode_packet(&view, &pkt, num_bytes));
+
+	state.SetBytesProcessed(state.iterations() * num_bytes);
+}
+BENCHMARK(BM_decode)->Apply(bench_key_counts);
+
+/* Getting the last key with fcap_get_key, which walks the packet */
+static void BM_get_key(benchmark::State &state)
+{
+	int32_t value;
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+
+	bench_build(&builder, &pkt, state.range(0));
+
+	for (auto _ : state) {
+		fcap_get_key(&pkt, (FKey)(state.range(0) - 1), &value,
+			     sizeof(value));
+		benchmark::DoNotOptimize(value);
+	}
+}
+BENCHMARK(BM_get_key)->Apply(bench_key_counts);
+
+/* Getting the last key through a view, which is a direct index */
+static void BM_view_get_key(benchmark::State &state)
+{
+	int32_t value;
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+	struct fcap_view view;
+
+	bench_build(&builder, &pkt, state.range(0));
+	fcap_view_init(&view, &pkt);
+
+	for (auto _ : state) {
+		fcap_view_get_key(&view, (FKey)(state.range(0) - 1), &value,
+				  sizeof(value));
+		benchmark::DoNotOptimize(value);
+	}
+}
+BENCHMARK(BM_view_get_key)->Apply(bench_key_counts);
+
+/* Finding every key of a packet by asking for each key in turn */
+static void BM_has_every_key(benchmark::State &state)
+{
+	int key;
+	int found;
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+
+	bench_build(&builder, &pkt, state.range(0));
+
+	for (auto _ : state) {
+		found = 0;
+		for (key = 0; key < NUM_KEYS; key++)
+			found += fcap_has_key(&pkt, (FKey)key);
+		benchmark::DoNotOptimize(found);
+	}
+}
+BENCHMARK(BM_has_every_key)->Apply(bench_key_counts);
+
+/* Finding every key of a packet in a single walk */
+static void BM_iterate(benchmark::State &state)
+{
+	size_t total;
+	int num_bytes;
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+	struct fcap_iter iter;
+	struct fcap_entry entry;
+
+	bench_build(&builder, &pkt, state.range(0));
+	num_bytes = fcap_builder_get_num_bytes(&builder);
+
+	for (auto _ : state) {
+		total = 0;
+		fcap_iter_begin(&iter, &pkt, num_bytes);
+		while (fcap_iter_next(&iter, &entry) > 0)
+			total += entry.len;
+		benchmark::DoNotOptimize(total);
+	}
+}
+BENCHMARK(BM_iterate)->Apply(bench_key_counts);
+
+/* Adding and getting back a single binary key of varying length */
+static void BM_binary(benchmark::State &state)
+{
+	uint8_t data[MTU] = {};
+	uint8_t out[MTU];
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+	struct fcap_view view;
+
+	for (auto _ : state) {
+		fcap_builder_init(&builder, &pkt);
+		fcap_builder_add_key_bin(&builder, KEY_A, data, state.range(0));
+		fcap_view_init(&view, &pkt);
+		fcap_view_get_key_bin(&view, KEY_A, out, sizeof(out));
+		benchmark::DoNotOptimize(out);
+	}
+
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_binary)->Arg(1)->Arg(16)->Arg(64)->Arg(128)->Arg(250);
+
+/*
+ * Adding and getting back a single key with the typed accessors, for every
+ * type of value
+ */
+#define BENCH_TYPED(suffix, type)                                              \
+	static void BM_typed_##suffix(benchmark::State &state)                 \
+	{                                                                      \
+		type value = 1;                                                \
+		struct fcap_packet pkt;                                        \
+		struct fcap_builder builder;                                   \
+		struct fcap_view view;                                         \
+                                                                               \
+		for (auto _ : state) {                                         \
+			fcap_builder_init(&builder, &pkt);                     \
+			fcap_builder_add_key_##suffix(&builder, KEY_A, value); \
+			fcap_view_init(&view, &pkt);                           \
+			fcap_view_get_key_##suffix(&view, KEY_A, &value);      \
+			benchmark::DoNotOptimize(value);                       \
+		}                                                              \
+	}                                                                      \
+	BENCHMARK(BM_typed_##suffix);
+
+BENCH_TYPED(u8, uint8_t)
+BENCH_TYPED(u16, uint16_t)
+BENCH_TYPED(i16, int16_t)
+BENCH_TYPED(i32, int32_t)
+BENCH_TYPED(i64, int64_t)
+BENCH_TYPED(f32, float)
+BENCH_TYPED(d64, double)
+
+/*    Fixed Shape Messages    */
+
+using bench_schema = fcpp::schema<fcpp::field<KEY_A, int32_t>,
+				  fcpp::field<KEY_B, int32_t>,
+				  fcpp::field<KEY_C, int32_t>,
+				  fcpp::field<KEY_D, int32_t> >;
+
+/* The fixed shape message as a plain C struct */
+struct bench_struct {
+	int32_t a;
+	int32_t b;
+	int32_t c;
+	int32_t d;
+};
+
+static const struct fcap_field bench_fields[] = {
+	FCAP_FIELD(KEY_A, FCAP_INT32, struct bench_struct, a),
+	FCAP_FIELD(KEY_B, FCAP_INT32, struct bench_struct, b),
+	FCAP_FIELD(KEY_C, FCAP_INT32, struct bench_struct, c),
+	FCAP_FIELD(KEY_D, FCAP_INT32, struct bench_struct, d),
+};
+
+/* Reading every value of a fixed shape message with a walk per key */
+static void BM_fixed_get_key(benchmark::State &state)
+{
+	struct bench_struct values;
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+
+	bench_build(&builder, &pkt, 4);
+
+	for (auto _ : state) {
+		fcap_get_key_i32(&pkt, KEY_A, &values.a);
+		fcap_get_key_i32(&pkt, KEY_B, &values.b);
+		fcap_get_key_i32(&pkt, KEY_C, &values.c);
+		fcap_get_key_i32(&pkt, KEY_D, &values.d);
+		benchmark::DoNotOptimize(values);
+	}
+}
+BENCHMARK(BM_fixed_get_key);
+
+/* Reading every value of a fixed shape message into a struct in one walk */
+static void BM_fixed_unpack_struct(benchmark::State &state)
+{
+	struct bench_struct values;
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+	struct fcap_struct_desc desc;
+
+	fcap_struct_desc_init(&desc, bench_fields, 4);
+	bench_build(&builder, &pkt, 4);
+
+	for (auto _ : state) {
+		fcap_unpack_struct(&pkt, &desc, &values);
+		benchmark::DoNotOptimize(values);
+	}
+}
+BENCHMARK(BM_fixed_unpack_struct);
+
+/* Reading every value of a fixed shape message through a view */
+static void BM_fixed_view(benchmark::State &state)
+{
+	int32_t values[4];
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+	struct fcap_view view;
+
+	bench_build(&builder, &pkt, 4);
+
+	for (auto _ : state) {
+		fcap_decode_packet(&view, &pkt, bench_schema::num_bytes);
+		fcap_view_get_key_i32(&view, KEY_A, &values[0]);
+		fcap_view_get_key_i32(&view, KEY_B, &values[1]);
+		fcap_view_get_key_i32(&view, KEY_C, &values[2]);
+		fcap_view_get_key_i32(&view, KEY_D, &values[3]);
+		benchmark::DoNotOptimize(values);
+	}
+}
+BENCHMARK(BM_fixed_view);
+
+/* Reading every value of a fixed shape message through its schema */
+static void BM_fixed_schema(benchmark::State &state)
+{
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+	bench_schema::values values;
+
+	bench_build(&builder, &pkt, 4);
+
+	for (auto _ : state) {
+		bench_schema::decode(&pkt, bench_schema::num_bytes, values);
+		benchmark::DoNotOptimize(values);
+	}
+}
+BENCHMARK(BM_fixed_schema);
+
+/* Building a fixed shape message through its schema */
+static void BM_fixed_schema_encode(benchmark::State &state)
+{
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+
+	for (auto _ : state) {
+		fcap_builder_init(&builder, &pkt);
+		bench_schema::encode(&builder, 0, 1, 2, 3);
+		benchmark::DoNotOptimize(pkt);
+	}
+}
+BENCHMARK(BM_fixed_schema_encode);
+
+/*    The Core Loop    */
+
+/* Polling an app whose transports never have anything to read */
+static void BM_idle_poll(benchmark::State &state)
+{
+	static struct fcap app;
+
+	fcap_init_app(&app, bench_idle_transports, state.range(0), NULL, 0,
+		      NULL);
+
+	for (auto _ : state)
+		benchmark::DoNotOptimize(fcap_poll(&app));
+
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_idle_poll)->Arg(1)->Arg(10)->Arg(BENCH_MAX_TRANSPORTS);
+
+/* Building and sending a request with a single small key */
+static void BM_small_request(benchmark::State &state)
+{
+	static struct fcap app;
+
+	fcap_init_app(&app, bench_idle_transports, 1, NULL, 0, NULL);
+
+	for (auto _ : state) {
+		fcap_app_add_key_u8(&app, KEY_A, 1);
+		benchmark::DoNotOptimize(fcap_send_req(&app, &bench_idle));
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_small_request);
+
+/*
+ * Receiving, handling and responding to requests through a chain of
+ * middleware, items are packets handled
+ */
+static void BM_poll(benchmark::State &state)
+{
+	int handled = 0;
+	static struct fcap app;
+	static struct fcap_packet pkt;
+	static struct bench_mem mem;
+	static struct fcap_transport mem_transport = {
+		.priv = &mem,
+		.get_bytes = bench_mem_get_bytes,
+		.send_bytes = bench_send_nothing,
+		.flush = NULL,
+		.get_fd = NULL,
+	};
+	static const FTransport transports[] = { &mem_transport };
+	struct fcap_builder builder;
+
+	bench_build(&builder, &pkt, state.range(1));
+	mem.length = fcap_builder_get_num_bytes(&builder);
+	memcpy(mem.bytes, &pkt, mem.length);
+
+	fcap_init_app(&app, transports, 1, bench_middleware, state.range(0),
+		      NULL);
+	app.on_request = bench_respond;
+
+	for (auto _ : state)
+		handled += fcap_poll(&app);
+
+	state.SetItemsProcessed(handled);
+	state.counters["per_pkt"] = benchmark::Counter(
+		handled,
+		benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+BENCHMARK(BM_poll)->ArgsProduct({ { 0, 1, 4, BENCH_MAX_MIDDLEWARE },
+				  { 1, 8, NUM_KEYS - 1 } });
+
+BENCHMARK_MAIN();
@@ -54,6 +54,13 @@ int main()
 		exit(1);
 	}
 
+	/* The udp transport queues requests until it's flushed */
+	ret = fcap_flush(app);
+	if (ret < 0) {
+		printf("Error: Unable to flush request with code %d\n", ret);
+		exit(1);
+	}
+
 	printf("Sent!\n");
 
 	exit(1);
@@ -1,9 +1,13 @@
 #include <gtest/gtest.h>
 #include <cmath>
+#include <cstring>
 
 extern "C" {
 #include <fcap_pkt.h>
+#include <fcap_pool.h>
 }
+#include <fcap_pkt.hpp>
+#include <fcap_schema.hpp>
 
 TEST(FCAP_TESTS, basic_uint8)
 {
@@ -400,6 +404,721 @@ TEST(FCAP_TESTS, safe_double)
 	ASSERT_EQ(recv_val, sent_val);
 }
 
+TEST(FCAP_TESTS, view_many_keys)
+{
+	int ret;
+	struct fcap_packet packet;
+	struct fcap_view view;
+	FPacket pkt = &packet;
+	fcap_init_packet(pkt);
+
+	uint8_t sent_bytes[4] = {9, 8, 7, 6};
+	uint8_t recv_bytes[5];
+	uint8_t recv_u8;
+	int32_t recv_i32;
+	double recv_d64;
+
+	ASSERT_EQ(fcap_add_key_i32(pkt, KEY_C, -42), 0);
+	ASSERT_EQ(fcap_add_key_bin(pkt, KEY_AF, sent_bytes, 4), 0);
+	ASSERT_EQ(fcap_add_key_d64(pkt, KEY_A, 1.5), 0);
+	ASSERT_EQ(fcap_add_key_u8(pkt, KEY_Q, 200), 0);
+
+	ret = fcap_view_init(&view, pkt);
+	ASSERT_EQ(ret, 0);
+
+	ASSERT_EQ(fcap_view_has_key(&view, KEY_A), 1);
+	ASSERT_EQ(fcap_view_has_key(&view, KEY_AF), 1);
+	ASSERT_EQ(fcap_view_has_key(&view, KEY_B), 0);
+
+	ASSERT_EQ(fcap_view_get_key_d64(&view, KEY_A, &recv_d64), 0);
+	ASSERT_EQ(recv_d64, 1.5);
+
+	ASSERT_EQ(fcap_view_get_key_i32(&view, KEY_C, &recv_i32), 0);
+	ASSERT_EQ(recv_i32, -42);
+
+	ASSERT_EQ(fcap_view_get_key_u8(&view, KEY_Q, &recv_u8), 0);
+	ASSERT_EQ(recv_u8, 200);
+
+	ret = fcap_view_get_key(&view, KEY_AF, recv_bytes, sizeof(recv_bytes));
+	ASSERT_EQ(ret, FCAP_BINARY);
+	ASSERT_EQ(recv_bytes[0], 4);
+	ASSERT_EQ(memcmp(&recv_bytes[1], sent_bytes, 4), 0);
+}
+
+TEST(FCAP_TESTS, view_wrong_type_and_missing_key)
+{
+	float recv_f32;
+	struct fcap_packet packet;
+	struct fcap_view view;
+	FPacket pkt = &packet;
+	fcap_init_packet(pkt);
+
+	ASSERT_EQ(fcap_add_key_i32(pkt, KEY_A, 7), 0);
+	ASSERT_EQ(fcap_view_init(&view, pkt), 0);
+
+	ASSERT_EQ(fcap_view_get_key_f32(&view, KEY_A, &recv_f32), -FCAP_ETYPE);
+	ASSERT_EQ(fcap_view_get_key_f32(&view, KEY_B, &recv_f32),
+		  -FCAP_ENOKEY);
+}
+
+TEST(FCAP_TESTS, builder_keys)
+{
+	int ret;
+	struct fcap_packet packet;
+	struct fcap_builder builder;
+	FPacket pkt = &packet;
+	fcap_builder_init(&builder, pkt);
+
+	uint8_t sent_bytes[3] = {1, 2, 3};
+	float recv_f32;
+	uint8_t recv_bytes[4];
+
+	ASSERT_EQ(fcap_builder_add_key_f32(&builder, KEY_B, 2.5), 0);
+	ASSERT_EQ(fcap_builder_add_key_bin(&builder, KEY_D, sent_bytes, 3), 0);
+	ASSERT_EQ(fcap_builder_add_key_i64(&builder, KEY_A, -1), 0);
+
+	/* Duplicate keys are rejected */
+	ASSERT_EQ(fcap_builder_add_key_u8(&builder, KEY_B, 1), -FCAP_EINVAL);
+
+	ASSERT_EQ(fcap_builder_get_num_bytes(&builder), fcap_get_num_bytes(pkt));
+
+	ASSERT_EQ(fcap_get_key_f32(pkt, KEY_B, &recv_f32), 0);
+	ASSERT_EQ(recv_f32, 2.5);
+
+	ret = fcap_get_key(pkt, KEY_D, recv_bytes, sizeof(recv_bytes));
+	ASSERT_EQ(ret, FCAP_BINARY);
+	ASSERT_EQ(memcmp(&recv_bytes[1], sent_bytes, 3), 0);
+}
+
+TEST(FCAP_TESTS, builder_syncs_with_packet)
+{
+	struct fcap_packet packet;
+	struct fcap_builder builder;
+	FPacket pkt = &packet;
+	fcap_builder_init(&builder, pkt);
+
+	ASSERT_EQ(fcap_builder_add_key_u8(&builder, KEY_A, 1), 0);
+
+	/* Modify the packet behind the builders back */
+	ASSERT_EQ(fcap_add_key_u16(pkt, KEY_B, 2), 0);
+	fcap_builder_sync(&builder);
+
+	ASSERT_EQ(fcap_builder_add_key_u16(&builder, KEY_B, 3), -FCAP_EINVAL);
+	ASSERT_EQ(fcap_builder_add_key_u16(&builder, KEY_C, 3), 0);
+	ASSERT_EQ(fcap_builder_get_num_bytes(&builder), fcap_get_num_bytes(pkt));
+
+	/* The same number of keys, but not the same length */
+	fcap_init_packet(pkt);
+	ASSERT_EQ(fcap_add_key_d64(pkt, KEY_D, 1.5), 0);
+	ASSERT_EQ(fcap_add_key_u8(pkt, KEY_E, 1), 0);
+	ASSERT_EQ(fcap_add_key_u8(pkt, KEY_F, 1), 0);
+	fcap_builder_sync(&builder);
+
+	ASSERT_EQ(fcap_builder_add_key_u8(&builder, KEY_A, 1), 0);
+	ASSERT_EQ(fcap_builder_add_key_u8(&builder, KEY_D, 1), -FCAP_EINVAL);
+	ASSERT_EQ(fcap_builder_get_num_bytes(&builder), fcap_get_num_bytes(pkt));
+}
+
+TEST(FCAP_TESTS, packet_full)
+{
+	int i;
+	struct fcap_packet packet;
+	struct fcap_builder builder;
+	FPacket pkt = &packet;
+
+	uint8_t bytes[UINT8_MAX] = {};
+
+	/* A single binary value can't be bigger than the packet */
+	fcap_init_packet(pkt);
+	ASSERT_EQ(fcap_add_key_bin(pkt, KEY_A, bytes, 252), -FCAP_ENOMEM);
+	ASSERT_EQ(fcap_add_key_bin(pkt, KEY_A, bytes, 251), 0);
+	ASSERT_EQ(fcap_add_key_u8(pkt, KEY_B, 1), -FCAP_ENOMEM);
+
+	/* 28 doubles fill 252 of the 253 bytes */
+	fcap_builder_init(&builder, pkt);
+	for (i = 0; i < 28; i++)
+		ASSERT_EQ(fcap_builder_add_key_d64(&builder, (FKey)i, i), 0);
+
+	ASSERT_EQ(fcap_builder_add_key_u8(&builder, KEY_AC, 1), -FCAP_ENOMEM);
+	ASSERT_EQ(fcap_builder_get_num_bytes(&builder), MTU - 1);
+
+	/* The header can only count 31 keys, even when there is space */
+	fcap_builder_init(&builder, pkt);
+	for (i = 0; i < NUM_KEYS - 1; i++)
+		ASSERT_EQ(fcap_builder_add_key_u8(&builder, (FKey)i, i), 0);
+
+	ASSERT_EQ(fcap_builder_add_key_u8(&builder, KEY_AF, 1), -FCAP_ENOMEM);
+	ASSERT_EQ(fcap_add_key_u8(pkt, KEY_AF, 1), -FCAP_ENOMEM);
+	ASSERT_EQ(pkt->header.num_keys, NUM_KEYS - 1);
+}
+
+TEST(FCAP_TESTS, decode_valid)
+{
+	int num_bytes;
+	int16_t recv_i16;
+	uint8_t sent_bytes[5] = {5, 4, 3, 2, 1};
+	struct fcap_packet packet;
+	struct fcap_builder builder;
+	struct fcap_view view;
+	FPacket pkt = &packet;
+	fcap_builder_init(&builder, pkt);
+
+	ASSERT_EQ(fcap_builder_add_key_bin(&builder, KEY_E, sent_bytes, 5), 0);
+	ASSERT_EQ(fcap_builder_add_key_i16(&builder, KEY_F, -3), 0);
+	num_bytes = fcap_builder_get_num_bytes(&builder);
+
+	ASSERT_EQ(fcap_decode_packet(&view, pkt, num_bytes), 0);
+	ASSERT_EQ(fcap_view_get_key_i16(&view, KEY_F, &recv_i16), 0);
+	ASSERT_EQ(recv_i16, -3);
+
+	/* An empty packet is only a header */
+	fcap_init_packet(pkt);
+	ASSERT_EQ(fcap_decode_packet(&view, pkt, 2), 0);
+	ASSERT_EQ(fcap_view_has_key(&view, KEY_A), 0);
+}
+
+TEST(FCAP_TESTS, decode_malformed)
+{
+	int num_bytes;
+	uint8_t sent_bytes[5] = {5, 4, 3, 2, 1};
+	struct fcap_packet packet;
+	struct fcap_builder builder;
+	struct fcap_view view;
+	FPacket pkt = &packet;
+	fcap_builder_init(&builder, pkt);
+
+	ASSERT_EQ(fcap_builder_add_key_u16(&builder, KEY_A, 1), 0);
+	ASSERT_EQ(fcap_builder_add_key_bin(&builder, KEY_B, sent_bytes, 5), 0);
+	num_bytes = fcap_builder_get_num_bytes(&builder);
+
+	/* Too short for a header or bigger than a packet */
+	ASSERT_EQ(fcap_decode_packet(&view, pkt, 1), -FCAP_EINVAL);
+	ASSERT_EQ(fcap_decode_packet(&view, pkt, MTU + 1), -FCAP_EINVAL);
+
+	/* Truncated and trailing bytes */
+	ASSERT_EQ(fcap_decode_packet(&view, pkt, num_bytes - 1), -FCAP_EINVAL);
+	ASSERT_EQ(fcap_decode_packet(&view, pkt, num_bytes + 1), -FCAP_EINVAL);
+
+	/* Binary length running past the received bytes */
+	pkt->ktv_bytes[4] = 6;
+	ASSERT_EQ(fcap_decode_packet(&view, pkt, num_bytes), -FCAP_EINVAL);
+	pkt->ktv_bytes[4] = 5;
+
+	/* More keys than there are bytes for */
+	pkt->header.num_keys = 3;
+	ASSERT_EQ(fcap_decode_packet(&view, pkt, num_bytes), -FCAP_EINVAL);
+	pkt->header.num_keys = 2;
+
+	/* Unknown version */
+	pkt->header.version = 1;
+	ASSERT_EQ(fcap_decode_packet(&view, pkt, num_bytes), -FCAP_EINVAL);
+	pkt->header.version = 0;
+
+	/* The same key twice */
+	((struct fcap_ktv *)&pkt->ktv_bytes[3])->key = KEY_A;
+	ASSERT_EQ(fcap_decode_packet(&view, pkt, num_bytes), -FCAP_EINVAL);
+	((struct fcap_ktv *)&pkt->ktv_bytes[3])->key = KEY_B;
+
+	ASSERT_EQ(fcap_decode_packet(&view, pkt, num_bytes), 0);
+}
+
+TEST(FCAP_TESTS, pool_acquire_release)
+{
+	int i;
+	FPacket pkts[40];
+	struct fcap_packet outside;
+	FCAP_CREATE_POOL(pool, 40);
+
+	/* Every packet can be taken, and each is different */
+	for (i = 0; i < 40; i++) {
+		pkts[i] = fcap_pool_acquire(pool);
+		ASSERT_NE(pkts[i], nullptr);
+		ASSERT_TRUE(i == 0 || pkts[i] != pkts[i - 1]);
+	}
+	ASSERT_EQ(fcap_pool_acquire(pool), nullptr);
+
+	/* A released packet is the next one handed out */
+	ASSERT_EQ(fcap_pool_release(pool, pkts[35]), 0);
+	ASSERT_EQ(fcap_pool_acquire(pool), pkts[35]);
+
+	/* A held packet is only given back once every reference is released */
+	ASSERT_EQ(fcap_pool_hold(pool, pkts[3]), 2);
+	ASSERT_EQ(fcap_pool_release(pool, pkts[3]), 1);
+	ASSERT_EQ(fcap_pool_acquire(pool), nullptr);
+	ASSERT_EQ(fcap_pool_release(pool, pkts[3]), 0);
+	ASSERT_EQ(fcap_pool_release(pool, pkts[3]), -FCAP_EINVAL);
+	ASSERT_EQ(fcap_pool_acquire(pool), pkts[3]);
+
+	/* Packets which aren't from the pool are refused */
+	ASSERT_EQ(fcap_pool_hold(pool, &outside), -FCAP_EINVAL);
+	ASSERT_EQ(fcap_pool_release(pool, &outside), -FCAP_EINVAL);
+	ASSERT_EQ(fcap_pool_release(pool, (FPacket)((uint8_t *)pkts[0] + 1)),
+		  -FCAP_EINVAL);
+
+	for (i = 0; i < 40; i++)
+		ASSERT_EQ(fcap_pool_release(pool, pkts[i]), 0);
+	ASSERT_EQ(pool->num_free, 40);
+}
+
+using schema_test_msg = fcpp::schema<fcpp::field<KEY_C, uint16_t>,
+				     fcpp::field<KEY_A, double>,
+				     fcpp::field<KEY_F, std::array<uint8_t, 3> >,
+				     fcpp::field<KEY_B, int64_t> >;
+
+TEST(FCAP_TESTS, schema_matches_c_layout)
+{
+	double d;
+	int64_t i64;
+	uint16_t u16;
+	uint8_t bin[4];
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+	struct fcap_view view;
+	schema_test_msg::values values;
+	std::array<uint8_t, 3> blob = { 1, 2, 3 };
+
+	static_assert(schema_test_msg::num_bytes == 2 + 3 + 9 + 5 + 9);
+	static_assert(std::is_same_v<schema_test_msg::type_of<KEY_A>, double>);
+
+	/* What the schema encodes, the C core reads */
+	fcap_builder_init(&builder, &pkt);
+	schema_test_msg::encode(
+		&builder, uint16_t(500), 2.5, blob, int64_t(-7));
+	ASSERT_EQ(fcap_builder_get_num_bytes(&builder),
+		  (int)schema_test_msg::num_bytes);
+	ASSERT_EQ(fcap_get_num_bytes(&pkt), (int)schema_test_msg::num_bytes);
+	ASSERT_EQ(fcap_decode_packet(&view, &pkt, schema_test_msg::num_bytes),
+		  0);
+	ASSERT_EQ(fcap_view_get_key_u16(&view, KEY_C, &u16), 0);
+	ASSERT_EQ(u16, 500);
+	ASSERT_EQ(fcap_view_get_key_d64(&view, KEY_A, &d), 0);
+	ASSERT_EQ(d, 2.5);
+	ASSERT_EQ(fcap_view_get_key_bin(&view, KEY_F, bin, sizeof(bin)), 0);
+	ASSERT_EQ(bin[0], 3);
+	ASSERT_EQ(bin[3], 3);
+	ASSERT_EQ(fcap_view_get_key_i64(&view, KEY_B, &i64), 0);
+	ASSERT_EQ(i64, -7);
+
+	/* The builder carries on as if the keys had been added one by one */
+	ASSERT_EQ(fcap_builder_add_key_u8(&builder, KEY_A, 1), -FCAP_EINVAL);
+
+	/* And what the C core builds in schema order, the schema reads */
+	fcap_builder_init(&builder, &pkt);
+	fcap_builder_add_key_u16(&builder, KEY_C, 9);
+	fcap_builder_add_key_d64(&builder, KEY_A, -1.0);
+	fcap_builder_add_key_bin(&builder, KEY_F, blob.data(), blob.size());
+	fcap_builder_add_key_i64(&builder, KEY_B, 1LL << 40);
+	ASSERT_EQ(schema_test_msg::decode(
+			  &pkt, fcap_builder_get_num_bytes(&builder), values),
+		  0);
+	ASSERT_EQ(std::get<0>(values), 9);
+	ASSERT_EQ(std::get<1>(values), -1.0);
+	ASSERT_EQ(std::get<2>(values), blob);
+	ASSERT_EQ(std::get<3>(values), 1LL << 40);
+	ASSERT_EQ(schema_test_msg::get<KEY_B>(&pkt), 1LL << 40);
+
+	schema_test_msg::set<KEY_C>(&pkt, (uint16_t)10);
+	ASSERT_EQ(schema_test_msg::get<KEY_C>(&pkt), 10);
+}
+
+TEST(FCAP_TESTS, schema_rejects_other_layouts)
+{
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+	schema_test_msg::values values;
+	std::array<uint8_t, 3> blob = { 1, 2, 3 };
+
+	/* The same keys in another order */
+	fcap_builder_init(&builder, &pkt);
+	fcap_builder_add_key_d64(&builder, KEY_A, -1.0);
+	fcap_builder_add_key_u16(&builder, KEY_C, 9);
+	fcap_builder_add_key_bin(&builder, KEY_F, blob.data(), blob.size());
+	fcap_builder_add_key_i64(&builder, KEY_B, 1);
+	ASSERT_EQ(schema_test_msg::decode(
+			  &pkt, fcap_builder_get_num_bytes(&builder), values),
+		  -FCAP_EINVAL);
+
+	/* A key of the wrong type */
+	fcap_builder_init(&builder, &pkt);
+	fcap_builder_add_key_i16(&builder, KEY_C, 9);
+	fcap_builder_add_key_d64(&builder, KEY_A, -1.0);
+	fcap_builder_add_key_bin(&builder, KEY_F, blob.data(), blob.size());
+	fcap_builder_add_key_i64(&builder, KEY_B, 1);
+	ASSERT_EQ(schema_test_msg::decode(
+			  &pkt, fcap_builder_get_num_bytes(&builder), values),
+		  -FCAP_EINVAL);
+
+	/* A binary value of another length, which is the same total length */
+	fcap_builder_init(&builder, &pkt);
+	fcap_builder_add_key_u16(&builder, KEY_C, 9);
+	fcap_builder_add_key_d64(&builder, KEY_A, -1.0);
+	fcap_builder_add_key_bin(&builder, KEY_F, blob.data(), 2);
+	fcap_builder_add_key_i64(&builder, KEY_B, 1);
+	ASSERT_EQ(schema_test_msg::decode(&pkt, schema_test_msg::num_bytes,
+					  values),
+		  -FCAP_EINVAL);
+
+	/* Too short */
+	schema_test_msg::encode(&builder, uint16_t(1), 1.0, blob, int64_t(1));
+	ASSERT_EQ(schema_test_msg::decode(&pkt, schema_test_msg::num_bytes - 1,
+					  values),
+		  -FCAP_EINVAL);
+}
+
+TEST(FCAP_TESTS, cpp_view_in_place)
+{
+	int i;
+	int16_t i16;
+	uint16_t u16;
+	struct fcap_packet pkt;
+	fcpp::view view;
+	fcpp::builder builder(&pkt);
+	fcpp::span<const uint8_t> bin;
+	uint8_t blob[] = { 7, 8, 9 };
+	FKey keys[] = { KEY_A, KEY_C, KEY_E };
+	size_t sizes[] = { 2, 3, 8 };
+
+	ASSERT_EQ(builder.add(KEY_E, 2.5), 0);
+	ASSERT_EQ(builder.add(KEY_A, (uint16_t)300), 0);
+	ASSERT_EQ(builder.add(KEY_C, fcpp::span<const uint8_t>(blob, 3)), 0);
+	ASSERT_EQ(builder.add(KEY_A, (uint8_t)1), -FCAP_EINVAL);
+
+	ASSERT_EQ(view.decode(&pkt, builder.num_bytes()), 0);
+	ASSERT_EQ(view.size(), 3u);
+	ASSERT_TRUE(view.has(KEY_C));
+	ASSERT_FALSE(view.has(KEY_B));
+
+	ASSERT_EQ(view.get(KEY_A, u16), 0);
+	ASSERT_EQ(u16, 300);
+	ASSERT_EQ(view.get(KEY_A, i16), -FCAP_ETYPE);
+	ASSERT_EQ(view.get(KEY_B, u16), -FCAP_ENOKEY);
+	ASSERT_EQ(view.get(KEY_A, bin), -FCAP_ETYPE);
+
+	/* Binary values point into the packet rather than being copied out */
+	ASSERT_EQ(view.get(KEY_C, bin), 0);
+	ASSERT_EQ(bin.size(), 3u);
+	ASSERT_GT(bin.data(), (const uint8_t *)&pkt);
+	ASSERT_LT(bin.data(), (const uint8_t *)&pkt + sizeof(pkt));
+	ASSERT_EQ(memcmp(bin.data(), blob, sizeof(blob)), 0);
+
+	/* Keys are visited in key order whatever order they were added in */
+	i = 0;
+	for (fcpp::ktv ktv : view) {
+		ASSERT_LT(i, 3);
+		ASSERT_EQ(ktv.key, keys[i]);
+		ASSERT_EQ(ktv.value.size(), sizes[i]);
+		i++;
+	}
+	ASSERT_EQ(i, 3);
+}
+
+TEST(FCAP_TESTS, cpp_packet_handle)
+{
+	FCAP_CREATE_POOL(pool, 2);
+
+	fcpp::packet a = fcpp::packet::acquire(pool);
+	ASSERT_TRUE(a);
+	ASSERT_EQ(pool->num_free, 1);
+
+	{
+		/* Moving hands over the reference rather than taking another */
+		fcpp::packet b = std::move(a);
+		ASSERT_FALSE(a);
+		ASSERT_TRUE(b);
+		ASSERT_EQ(pool->num_free, 1);
+
+		fcpp::packet c = fcpp::packet::hold(pool, b.get());
+		ASSERT_EQ(c.get(), b.get());
+
+		fcpp::packet d = fcpp::packet::acquire(pool);
+		ASSERT_FALSE(fcpp::packet::acquire(pool));
+		ASSERT_EQ(pool->num_free, 0);
+	}
+	ASSERT_EQ(pool->num_free, 2);
+
+	a = fcpp::packet::acquire(pool);
+	a = fcpp::packet::acquire(pool);
+	ASSERT_EQ(pool->num_free, 1);
+	a.reset();
+	ASSERT_EQ(pool->num_free, 2);
+
+	struct fcap_packet outside;
+	ASSERT_FALSE(fcpp::packet::hold(pool, &outside));
+}
+
+TEST(FCAP_TESTS, add_keys_batch)
+{
+	int32_t i32;
+	uint8_t bin[4];
+	uint16_t u16 = 500;
+	int32_t value = -3;
+	uint8_t blob[] = { 1, 2, 3 };
+	struct fcap_packet pkt;
+	struct fcap_packet expected;
+	struct fcap_builder builder;
+	struct fcap_key_desc descs[] = {
+		{ KEY_C, FCAP_UINT16, &u16, sizeof(u16) },
+		{ KEY_A, FCAP_BINARY, blob, sizeof(blob) },
+		{ KEY_B, FCAP_INT32, &value, sizeof(value) },
+	};
+
+	/* A batch lays out the same bytes as adding the keys one by one */
+	fcap_init_packet(&expected);
+	fcap_add_key_u16(&expected, KEY_C, u16);
+	fcap_add_key_bin(&expected, KEY_A, blob, sizeof(blob));
+	fcap_add_key_i32(&expected, KEY_B, value);
+
+	fcap_init_packet(&pkt);
+	ASSERT_EQ(fcap_add_keys(&pkt, descs, 3), 0);
+	ASSERT_EQ(fcap_get_num_bytes(&pkt), fcap_get_num_bytes(&expected));
+	ASSERT_EQ(memcmp(&pkt, &expected, fcap_get_num_bytes(&pkt)), 0);
+	ASSERT_EQ(fcap_get_key_i32(&pkt, KEY_B, &i32), 0);
+	ASSERT_EQ(i32, value);
+	ASSERT_EQ(fcap_get_key_bin(&pkt, KEY_A, bin, sizeof(bin)), 0);
+	ASSERT_EQ(bin[0], 3);
+
+	/* Keys already in the packet count as duplicates */
+	fcap_init_packet(&pkt);
+	fcap_add_key_i32(&pkt, KEY_B, 1);
+	ASSERT_EQ(fcap_add_keys(&pkt, descs, 3), -FCAP_EINVAL);
+	ASSERT_EQ(pkt.header.num_keys, 1);
+
+	/* As do keys repeated within the batch */
+	descs[2].key = KEY_C;
+	fcap_init_packet(&pkt);
+	ASSERT_EQ(fcap_add_keys(&pkt, descs, 3), -FCAP_EINVAL);
+	ASSERT_EQ(pkt.header.num_keys, 0);
+	descs[2].key = KEY_B;
+
+	/* A value of the wrong size for its type */
+	descs[2].size = 2;
+	ASSERT_EQ(fcap_add_keys(&pkt, descs, 3), -FCAP_EINVAL);
+	ASSERT_EQ(pkt.header.num_keys, 0);
+	descs[2].size = sizeof(value);
+
+	/* Through a builder, which carries on after the batch */
+	fcap_builder_init(&builder, &pkt);
+	ASSERT_EQ(fcap_builder_add_key_u8(&builder, KEY_D, 1), 0);
+	ASSERT_EQ(fcap_builder_add_keys(&builder, descs, 3), 0);
+	ASSERT_EQ(fcap_builder_add_key_u8(&builder, KEY_A, 1), -FCAP_EINVAL);
+	ASSERT_EQ(fcap_builder_add_key_u8(&builder, KEY_E, 1), 0);
+	ASSERT_EQ(fcap_builder_get_num_bytes(&builder),
+		  fcap_get_num_bytes(&pkt));
+	ASSERT_EQ(pkt.header.num_keys, 5);
+}
+
+TEST(FCAP_TESTS, add_keys_capacity)
+{
+	int i;
+	uint8_t big[200] = {};
+	struct fcap_packet pkt;
+	struct fcap_key_desc descs[NUM_KEYS];
+
+	/* Too many bytes is rejected before anything is written */
+	descs[0] = { KEY_A, FCAP_BINARY, big, sizeof(big) };
+	descs[1] = { KEY_B, FCAP_BINARY, big, 60 };
+	fcap_init_packet(&pkt);
+	ASSERT_EQ(fcap_add_keys(&pkt, descs, 2), -FCAP_ENOMEM);
+	ASSERT_EQ(pkt.header.num_keys, 0);
+	ASSERT_EQ(fcap_add_keys(&pkt, descs, 1), 0);
+
+	/* As is more keys than the header can count */
+	for (i = 0; i < NUM_KEYS; i++)
+		descs[i] = { (FKey)i, FCAP_UINT8, big, 1 };
+	fcap_init_packet(&pkt);
+	ASSERT_EQ(fcap_add_keys(&pkt, descs, NUM_KEYS), -FCAP_ENOMEM);
+	ASSERT_EQ(fcap_add_keys(&pkt, descs, NUM_KEYS - 1), 0);
+	ASSERT_EQ(pkt.header.num_keys, NUM_KEYS - 1);
+
+	/* An empty batch changes nothing */
+	ASSERT_EQ(fcap_add_keys(&pkt, NULL, 0), 0);
+	ASSERT_EQ(pkt.header.num_keys, NUM_KEYS - 1);
+}
+
+struct struct_test_msg {
+	uint16_t id;
+	float temp;
+	uint8_t name[9];
+	int64_t count;
+};
+
+static const struct fcap_field struct_test_fields[] = {
+	FCAP_FIELD(KEY_D, FCAP_UINT16, struct struct_test_msg, id),
+	FCAP_FIELD(KEY_A, FCAP_FLOAT, struct struct_test_msg, temp),
+	FCAP_FIELD(KEY_B, FCAP_BINARY, struct struct_test_msg, name),
+	FCAP_FIELD(KEY_F, FCAP_INT64, struct struct_test_msg, count),
+};
+
+TEST(FCAP_TESTS, struct_pack_unpack)
+{
+	float temp;
+	uint8_t name[9];
+	struct fcap_packet pkt;
+	struct fcap_struct_desc desc;
+	struct struct_test_msg in = { 7, 21.5f, { 5, 'h', 'e', 'l', 'l', 'o' },
+				      -9 };
+	struct struct_test_msg out = {};
+
+	ASSERT_EQ(fcap_struct_desc_init(&desc, struct_test_fields, 4), 0);
+
+	/* Packed structs read back through the normal getters */
+	fcap_init_packet(&pkt);
+	ASSERT_EQ(fcap_add_key_u8(&pkt, KEY_C, 1), 0);
+	ASSERT_EQ(fcap_pack_struct(&pkt, &desc, &in), 0);
+	ASSERT_EQ(pkt.header.num_keys, 5);
+	ASSERT_EQ(fcap_get_key_f32(&pkt, KEY_A, &temp), 0);
+	ASSERT_EQ(temp, 21.5f);
+	ASSERT_EQ(fcap_get_key_bin(&pkt, KEY_B, name, sizeof(name)), 0);
+	ASSERT_EQ(memcmp(name, in.name, 6), 0);
+
+	/* Keys not in the table, like KEY_C, are skipped */
+	ASSERT_EQ(fcap_unpack_struct(&pkt, &desc, &out), 4);
+	ASSERT_EQ(out.id, 7);
+	ASSERT_EQ(out.temp, 21.5f);
+	ASSERT_EQ(memcmp(out.name, in.name, 6), 0);
+	ASSERT_EQ(out.count, -9);
+
+	/* Fields the packet doesn't have are left alone */
+	fcap_init_packet(&pkt);
+	fcap_add_key_u16(&pkt, KEY_D, 8);
+	out.count = 3;
+	ASSERT_EQ(fcap_unpack_struct(&pkt, &desc, &out), 1);
+	ASSERT_EQ(out.id, 8);
+	ASSERT_EQ(out.count, 3);
+
+	/* A key with another type than its field */
+	fcap_add_key_i32(&pkt, KEY_A, 1);
+	ASSERT_EQ(fcap_unpack_struct(&pkt, &desc, &out), -FCAP_ETYPE);
+
+	/* A binary value longer than its member */
+	fcap_init_packet(&pkt);
+	fcap_add_key_bin(&pkt, KEY_B, (uint8_t *)"too long!", 9);
+	ASSERT_EQ(fcap_unpack_struct(&pkt, &desc, &out), -FCAP_ENOMEM);
+
+	/* And a binary length which overruns its own member */
+	in.name[0] = 9;
+	fcap_init_packet(&pkt);
+	ASSERT_EQ(fcap_pack_struct(&pkt, &desc, &in), -FCAP_EINVAL);
+	ASSERT_EQ(pkt.header.num_keys, 0);
+}
+
+TEST(FCAP_TESTS, struct_desc_rejects_bad_tables)
+{
+	struct fcap_struct_desc desc;
+	struct fcap_field fields[2] = {
+		FCAP_FIELD(KEY_A, FCAP_INT32, struct struct_test_msg, count),
+		FCAP_FIELD(KEY_A, FCAP_INT64, struct struct_test_msg, count),
+	};
+
+	/* A member of the wrong size for its type */
+	ASSERT_EQ(fcap_struct_desc_init(&desc, fields, 1), -FCAP_EINVAL);
+
+	/* A key used twice */
+	fields[0].type = FCAP_INT64;
+	ASSERT_EQ(fcap_struct_desc_init(&desc, fields, 1), 0);
+	ASSERT_EQ(fcap_struct_desc_init(&desc, fields, 2), -FCAP_EINVAL);
+}
+
+/* Sums the value bytes of every KTV, stopping at KEY_C */
+static int visit_test_fn(void *priv, const struct fcap_entry *entry)
+{
+	size_t *total = (size_t *)priv;
+
+	if (entry->key == KEY_C)
+		return 7;
+
+	*total += entry->len;
+	return 0;
+}
+
+TEST(FCAP_TESTS, iterate_ktvs)
+{
+	int i;
+	int num_bytes;
+	size_t total;
+	struct fcap_packet pkt;
+	struct fcap_iter iter;
+	struct fcap_entry entry;
+	uint8_t blob[] = { 4, 5, 6, 7 };
+	FKey keys[] = { KEY_E, KEY_B, KEY_C };
+	FType types[] = { FCAP_DOUBLE, FCAP_BINARY, FCAP_UINT8 };
+	size_t lens[] = { 8, 4, 1 };
+
+	fcap_init_packet(&pkt);
+	fcap_add_key_d64(&pkt, KEY_E, 1.5);
+	fcap_add_key_bin(&pkt, KEY_B, blob, sizeof(blob));
+	fcap_add_key_u8(&pkt, KEY_C, 3);
+	num_bytes = fcap_get_num_bytes(&pkt);
+
+	/* Every KTV comes back in packet order, pointing into the packet */
+	ASSERT_EQ(fcap_iter_begin(&iter, &pkt, num_bytes), 0);
+	for (i = 0; i < 3; i++) {
+		ASSERT_EQ(fcap_iter_next(&iter, &entry), 1);
+		ASSERT_EQ(entry.key, keys[i]);
+		ASSERT_EQ(entry.type, types[i]);
+		ASSERT_EQ(entry.len, lens[i]);
+		ASSERT_GT(entry.value, (const uint8_t *)&pkt);
+		ASSERT_LE(entry.value + entry.len,
+			  (const uint8_t *)&pkt + num_bytes);
+	}
+	ASSERT_EQ(fcap_iter_next(&iter, &entry), 0);
+	ASSERT_EQ(fcap_iter_next(&iter, &entry), 0);
+
+	fcap_iter_begin(&iter, &pkt, num_bytes);
+	fcap_iter_next(&iter, &entry);
+	fcap_iter_next(&iter, &entry);
+	ASSERT_EQ(memcmp(entry.value, blob, sizeof(blob)), 0);
+
+	/* The visitor sees the same KTVs and can stop the walk early */
+	total = 0;
+	ASSERT_EQ(fcap_visit_packet(&pkt, num_bytes, visit_test_fn, &total),
+		  7);
+	ASSERT_EQ(total, 12u);
+
+	fcap_init_packet(&pkt);
+	fcap_add_key_d64(&pkt, KEY_E, 1.5);
+	total = 0;
+	ASSERT_EQ(fcap_visit_packet(&pkt, fcap_get_num_bytes(&pkt),
+				    visit_test_fn, &total),
+		  0);
+	ASSERT_EQ(total, 8u);
+}
+
+TEST(FCAP_TESTS, iterate_bounds_checked)
+{
+	int i;
+	int ret;
+	int num_bytes;
+	size_t total;
+	struct fcap_packet pkt;
+	struct fcap_iter iter;
+	struct fcap_entry entry;
+	uint8_t blob[] = { 4, 5, 6, 7 };
+
+	fcap_init_packet(&pkt);
+	fcap_add_key_u16(&pkt, KEY_A, 1);
+	fcap_add_key_bin(&pkt, KEY_B, blob, sizeof(blob));
+	num_bytes = fcap_get_num_bytes(&pkt);
+
+	/* However short the packet, nothing past the received bytes is read */
+	for (i = 2; i < num_bytes; i++) {
+		ASSERT_EQ(fcap_iter_begin(&iter, &pkt, i), 0);
+		while ((ret = fcap_iter_next(&iter, &entry)) > 0)
+			ASSERT_LE(entry.value + entry.len,
+				  (const uint8_t *)&pkt + i);
+		ASSERT_EQ(ret, -FCAP_EINVAL);
+	}
+
+	ASSERT_EQ(fcap_iter_begin(&iter, &pkt, 1), -FCAP_EINVAL);
+	ASSERT_EQ(fcap_iter_begin(&iter, &pkt, MTU + 1), -FCAP_EINVAL);
+
+	/* A header claiming more keys than were received */
+	pkt.header.num_keys = 3;
+	total = 0;
+	ASSERT_EQ(fcap_visit_packet(&pkt, num_bytes, visit_test_fn, &total),
+		  -FCAP_EINVAL);
+}
+
 int main(int argc, char **argv)
 {
 	::testing::InitGoogleTest(&argc, argv);
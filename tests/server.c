@@ -51,10 +51,10 @@ int main()
 	/* Get the first instance */
 	fcap_init_instance(app);
 
-	/* Poll everything! */
+	/* Poll everything, sleeping while there's nothing to do */
 	printf("Running!\n");
 	while (1) {
-		ret = fcap_poll(app);
+		ret = fcap_poll_wait(app, -1);
 		if (ret < 0) {
 			printf("Error: Failed to poll transports!");
 			break;
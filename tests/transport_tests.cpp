@@ -0,0 +1,389 @@
+#include <gtest/gtest.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+extern "C" {
+#include <fcap.h>
+#include <fcap_loopback.h>
+#include <fcap_shm.h>
+#include <fcap_udp.h>
+#include <fcap_unix.h>
+#ifdef FCAP_HAVE_URING
+#include <fcap_uring.h>
+#endif
+}
+
+#define UDP_TEST_PORT_A (FCAP_PORT + 10)
+#define UDP_TEST_PORT_B (FCAP_PORT + 11)
+
+TEST(FCAP_TRANSPORT_TESTS, udp_batched_receive)
+{
+	int i;
+	int ret;
+	static struct fcap_udp udp_a;
+	static struct fcap_udp udp_b;
+	uint8_t bytes[MTU];
+	char localhost[] = "127.0.0.1";
+
+	ret = fcap_udp_setup_transport(
+		&udp_a, UDP_TEST_PORT_A, localhost, UDP_TEST_PORT_B);
+	ASSERT_EQ(ret, 0);
+	ret = fcap_udp_setup_transport(
+		&udp_b, UDP_TEST_PORT_B, localhost, UDP_TEST_PORT_A);
+	ASSERT_EQ(ret, 0);
+
+	/* Send more than a single batch worth of datagrams */
+	for (i = 0; i < FCAP_DGRAM_BATCH_SIZE + 4; i++) {
+		memset(bytes, i, i + 1);
+		ret = fcap_udp_send_bytes(&udp_a, bytes, i + 1);
+		ASSERT_EQ(ret, i + 1);
+	}
+	ASSERT_EQ(fcap_udp_flush(&udp_a), 0);
+
+	for (i = 0; i < FCAP_DGRAM_BATCH_SIZE + 4; i++) {
+		ret = fcap_udp_get_bytes(&udp_b, bytes, sizeof(bytes));
+		ASSERT_EQ(ret, i + 1);
+		ASSERT_EQ(bytes[0], i);
+		ASSERT_EQ(bytes[i], i);
+	}
+
+	/* Nothing left */
+	ASSERT_EQ(fcap_udp_get_bytes(&udp_b, bytes, sizeof(bytes)), 0);
+
+	fcap_udp_cleanup(&udp_a);
+	fcap_udp_cleanup(&udp_b);
+}
+
+TEST(FCAP_TRANSPORT_TESTS, udp_queued_send)
+{
+	int i;
+	int ret;
+	static struct fcap_udp udp_a;
+	static struct fcap_udp udp_b;
+	uint8_t bytes[MTU];
+	char localhost[] = "127.0.0.1";
+
+	ret = fcap_udp_setup_transport(
+		&udp_a, UDP_TEST_PORT_A, localhost, UDP_TEST_PORT_B);
+	ASSERT_EQ(ret, 0);
+	ret = fcap_udp_setup_transport(
+		&udp_b, UDP_TEST_PORT_B, localhost, UDP_TEST_PORT_A);
+	ASSERT_EQ(ret, 0);
+
+	for (i = 0; i < 3; i++) {
+		bytes[0] = i;
+		ASSERT_EQ(fcap_udp_send_bytes(&udp_a, bytes, 1), 1);
+	}
+
+	/* Nothing goes out until the queue is flushed */
+	ASSERT_EQ(fcap_udp_get_bytes(&udp_b, bytes, sizeof(bytes)), 0);
+	ASSERT_EQ(fcap_udp_flush(&udp_a), 0);
+
+	for (i = 0; i < 3; i++) {
+		ASSERT_EQ(fcap_udp_get_bytes(&udp_b, bytes, sizeof(bytes)), 1);
+		ASSERT_EQ(bytes[0], i);
+	}
+
+	/* A full queue is flushed to make room */
+	for (i = 0; i < FCAP_DGRAM_QUEUE_SIZE + 1; i++)
+		ASSERT_EQ(fcap_udp_send_bytes(&udp_a, bytes, 1), 1);
+	ASSERT_EQ(udp_a.dgram.tx_count, 1);
+
+	/* Too big to ever be a packet */
+	ASSERT_EQ(fcap_udp_send_bytes(&udp_a, bytes, MTU + 1), -FCAP_EINVAL);
+
+	fcap_udp_cleanup(&udp_a);
+	fcap_udp_cleanup(&udp_b);
+}
+
+#ifdef FCAP_HAVE_URING
+TEST(FCAP_TRANSPORT_TESTS, uring_loopback)
+{
+	int i;
+	int ret;
+	static struct fcap_uring uring;
+	static struct fcap_udp udp;
+	uint8_t bytes[MTU];
+	char localhost[] = "127.0.0.1";
+	struct pollfd poll_fd;
+
+	ret = fcap_uring_setup_transport(
+		&uring, UDP_TEST_PORT_A, localhost, UDP_TEST_PORT_B);
+	if (ret == -ENOSYS || ret == -EPERM || ret == -EOPNOTSUPP)
+		GTEST_SKIP() << "io_uring multishot receive is not available";
+	ASSERT_EQ(ret, 0);
+
+	ret = fcap_udp_setup_transport(
+		&udp, UDP_TEST_PORT_B, localhost, UDP_TEST_PORT_A);
+	ASSERT_EQ(ret, 0);
+
+	/* Sends only go out once flushed */
+	for (i = 0; i < 4; i++) {
+		bytes[0] = i;
+		ASSERT_EQ(fcap_uring_send_bytes(&uring, bytes, 1), 1);
+	}
+	ASSERT_EQ(fcap_udp_get_bytes(&udp, bytes, sizeof(bytes)), 0);
+	ASSERT_EQ(fcap_uring_flush(&uring), 0);
+
+	for (i = 0; i < 4; i++) {
+		poll_fd = { .fd = fcap_udp_get_fd(&udp), .events = POLLIN };
+		while ((ret = fcap_udp_get_bytes(&udp, bytes, MTU)) == 0)
+			poll(&poll_fd, 1, 1000);
+
+		ASSERT_EQ(ret, 1);
+		ASSERT_EQ(bytes[0], i);
+	}
+
+	/* Send back more datagrams than there are receive buffers */
+	for (i = 0; i < FCAP_URING_NUM_BUFS + 8; i++) {
+		memset(bytes, i, i % MTU + 1);
+		ASSERT_EQ(fcap_udp_send_bytes(&udp, bytes, i % MTU + 1),
+			  i % MTU + 1);
+		ASSERT_GE(fcap_udp_flush(&udp), 0);
+	}
+
+	for (i = 0; i < FCAP_URING_NUM_BUFS + 8; i++) {
+		poll_fd = { .fd = fcap_uring_get_fd(&uring), .events = POLLIN };
+		while ((ret = fcap_uring_get_bytes(&uring, bytes, MTU)) == 0)
+			poll(&poll_fd, 1, 1000);
+
+		ASSERT_EQ(ret, i % MTU + 1);
+		ASSERT_EQ(bytes[0], i);
+		ASSERT_EQ(bytes[i % MTU], i);
+	}
+
+	fcap_uring_cleanup(&uring);
+	fcap_udp_cleanup(&udp);
+}
+#endif /* FCAP_HAVE_URING */
+
+TEST(FCAP_TRANSPORT_TESTS, loopback_ring)
+{
+	int i;
+	uint8_t bytes[MTU];
+	FCAP_CREATE_LOOPBACK_TRANSPORT(loop_a);
+	FCAP_CREATE_LOOPBACK_TRANSPORT(loop_b);
+
+	fcap_loopback_connect(&loop_a, &loop_b);
+
+	/* Fill b's ring from a */
+	for (i = 0; i < FCAP_LOOPBACK_QUEUE_SIZE; i++) {
+		memset(bytes, i, i + 1);
+		ASSERT_EQ(fcap_loopback_send_bytes(&loop_a_priv, bytes, i + 1),
+			  i + 1);
+	}
+	ASSERT_EQ(fcap_loopback_send_bytes(&loop_a_priv, bytes, 1),
+		  -FCAP_EAGAIN);
+
+	/* Nothing was sent the other way */
+	ASSERT_EQ(fcap_loopback_get_bytes(&loop_a_priv, bytes, sizeof(bytes)),
+		  0);
+
+	for (i = 0; i < FCAP_LOOPBACK_QUEUE_SIZE; i++) {
+		ASSERT_EQ(fcap_loopback_get_bytes(
+				  &loop_b_priv, bytes, sizeof(bytes)),
+			  i + 1);
+		ASSERT_EQ(bytes[0], i);
+		ASSERT_EQ(bytes[i], i);
+	}
+
+	ASSERT_EQ(fcap_loopback_get_bytes(&loop_b_priv, bytes, sizeof(bytes)),
+		  0);
+}
+
+TEST(FCAP_TRANSPORT_TESTS, shm_pair_wakeups)
+{
+	int i;
+	static struct fcap_shm shm_a;
+	static struct fcap_shm shm_b;
+	uint8_t bytes[MTU];
+	struct pollfd poll_fd;
+
+	ASSERT_EQ(fcap_shm_setup_pair(&shm_a, &shm_b, 1), 0);
+	poll_fd = { .fd = fcap_shm_get_fd(&shm_b), .events = POLLIN };
+	ASSERT_GE(poll_fd.fd, 0);
+
+	/* Nothing sent, nothing to wake up for */
+	ASSERT_EQ(fcap_shm_get_bytes(&shm_b, bytes, sizeof(bytes)), 0);
+	ASSERT_EQ(poll(&poll_fd, 1, 0), 0);
+
+	/* Fill the ring, only the first packet needs a wakeup */
+	for (i = 0; i < FCAP_SHM_RING_SIZE; i++) {
+		bytes[0] = i;
+		ASSERT_EQ(fcap_shm_send_bytes(&shm_a, bytes, 1), 1);
+	}
+	ASSERT_EQ(fcap_shm_send_bytes(&shm_a, bytes, 1), -FCAP_EAGAIN);
+	ASSERT_EQ(poll(&poll_fd, 1, 0), 1);
+
+	for (i = 0; i < FCAP_SHM_RING_SIZE; i++) {
+		ASSERT_EQ(fcap_shm_get_bytes(&shm_b, bytes, sizeof(bytes)), 1);
+		ASSERT_EQ(bytes[0], (uint8_t)i);
+	}
+
+	/* Finding the ring empty clears the wakeup */
+	ASSERT_EQ(fcap_shm_get_bytes(&shm_b, bytes, sizeof(bytes)), 0);
+	ASSERT_EQ(poll(&poll_fd, 1, 0), 0);
+
+	/* The other direction works too */
+	bytes[0] = 42;
+	ASSERT_EQ(fcap_shm_send_bytes(&shm_b, bytes, 1), 1);
+	ASSERT_EQ(fcap_shm_get_bytes(&shm_a, bytes, sizeof(bytes)), 1);
+	ASSERT_EQ(bytes[0], 42);
+
+	/* A wakeup which fails is counted, but the packet is still sent */
+	close(shm_a.tx_efd);
+	shm_a.tx_efd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	ASSERT_GE(shm_a.tx_efd, 0);
+	ASSERT_EQ(fcap_shm_send_bytes(&shm_a, bytes, 1), 1);
+	ASSERT_EQ(shm_a.missed_wakeups, 1);
+	ASSERT_EQ(fcap_shm_get_bytes(&shm_b, bytes, sizeof(bytes)), 1);
+
+	fcap_shm_cleanup(&shm_a);
+	fcap_shm_cleanup(&shm_b);
+}
+
+TEST(FCAP_TRANSPORT_TESTS, shm_named)
+{
+	static struct fcap_shm shm_a;
+	static struct fcap_shm shm_b;
+	uint8_t bytes[MTU];
+	char name[32];
+
+	snprintf(name, sizeof(name), "/fcap_test_%d", getpid());
+
+	/* Opening needs the object to exist, creating needs it not to */
+	ASSERT_EQ(fcap_shm_setup_transport(&shm_b, name, 0), -ENOENT);
+	ASSERT_EQ(fcap_shm_setup_transport(&shm_a, name, 1), 0);
+	ASSERT_EQ(fcap_shm_setup_transport(&shm_b, name, 1), -EEXIST);
+	ASSERT_EQ(fcap_shm_setup_transport(&shm_b, name, 0), 0);
+	ASSERT_EQ(fcap_shm_get_fd(&shm_a), -1);
+
+	memset(bytes, 7, 10);
+	ASSERT_EQ(fcap_shm_send_bytes(&shm_a, bytes, 10), 10);
+	memset(bytes, 0, 10);
+	ASSERT_EQ(fcap_shm_get_bytes(&shm_b, bytes, sizeof(bytes)), 10);
+	ASSERT_EQ(bytes[9], 7);
+	ASSERT_EQ(fcap_shm_get_bytes(&shm_a, bytes, sizeof(bytes)), 0);
+
+	fcap_shm_cleanup(&shm_b);
+	fcap_shm_cleanup(&shm_a);
+
+	/* The creator removes the object */
+	ASSERT_EQ(fcap_shm_setup_transport(&shm_b, name, 0), -ENOENT);
+}
+
+TEST(FCAP_TRANSPORT_TESTS, unix_reply_to_sender)
+{
+	int i;
+	static struct fcap_unix server;
+	static struct fcap_unix clients[2];
+	uint8_t bytes[MTU];
+	char server_path[64];
+	char file_path[64];
+
+	/* An abstract server, which replies to whoever it last heard from */
+	snprintf(server_path, sizeof(server_path), "@fcap_test_%d", getpid());
+	ASSERT_EQ(fcap_unix_setup_transport(&server, server_path, NULL), 0);
+
+	/* Nothing received yet, so nobody to reply to */
+	ASSERT_EQ(fcap_unix_send_bytes(&server, bytes, 1), -FCAP_EINVAL);
+
+	/* One client on an unnamed address and one on a file */
+	snprintf(file_path, sizeof(file_path), "/tmp/fcap_test_%d", getpid());
+	ASSERT_EQ(fcap_unix_setup_transport(&clients[0], NULL, server_path),
+		  0);
+	ASSERT_EQ(fcap_unix_setup_transport(&clients[1], file_path,
+					    server_path),
+		  0);
+	ASSERT_EQ(access(file_path, F_OK), 0);
+
+	for (i = 0; i < 2; i++) {
+		bytes[0] = i;
+		ASSERT_EQ(fcap_unix_send_bytes(&clients[i], bytes, 1), 1);
+		ASSERT_EQ(fcap_unix_flush(&clients[i]), 0);
+	}
+
+	/* Each reply is queued while its request is the last one read */
+	for (i = 0; i < 2; i++) {
+		ASSERT_EQ(fcap_unix_get_bytes(&server, bytes, sizeof(bytes)),
+			  1);
+		ASSERT_EQ(bytes[0], i);
+		bytes[0] = 10 + i;
+		ASSERT_EQ(fcap_unix_send_bytes(&server, bytes, 1), 1);
+	}
+	ASSERT_EQ(fcap_unix_flush(&server), 0);
+
+	for (i = 0; i < 2; i++) {
+		ASSERT_EQ(fcap_unix_get_bytes(&clients[i], bytes,
+					      sizeof(bytes)),
+			  1);
+		ASSERT_EQ(bytes[0], 10 + i);
+	}
+
+	fcap_unix_cleanup(&clients[0]);
+	fcap_unix_cleanup(&clients[1]);
+	fcap_unix_cleanup(&server);
+
+	/* The socket file goes with the socket */
+	ASSERT_NE(access(file_path, F_OK), 0);
+}
+
+TEST(FCAP_TRANSPORT_TESTS, unix_peer_gone)
+{
+	static struct fcap_unix server;
+	static struct fcap_unix client;
+	uint8_t bytes[MTU];
+	char server_path[64];
+
+	snprintf(server_path, sizeof(server_path), "@fcap_gone_%d", getpid());
+	ASSERT_EQ(fcap_unix_setup_transport(&server, server_path, NULL), 0);
+	ASSERT_EQ(fcap_unix_setup_transport(&client, NULL, server_path), 0);
+
+	bytes[0] = 1;
+	ASSERT_EQ(fcap_unix_send_bytes(&client, bytes, 1), 1);
+	ASSERT_EQ(fcap_unix_flush(&client), 0);
+	fcap_unix_cleanup(&client);
+
+	/* The reply has nowhere to go, so it's dropped rather than an error */
+	ASSERT_EQ(fcap_unix_get_bytes(&server, bytes, sizeof(bytes)), 1);
+	ASSERT_EQ(fcap_unix_send_bytes(&server, bytes, 1), 1);
+	ASSERT_EQ(fcap_unix_flush(&server), 0);
+	ASSERT_EQ(fcap_unix_take_drops(&server), 1);
+	ASSERT_EQ(fcap_unix_take_drops(&server), 0);
+
+	fcap_unix_cleanup(&server);
+}
+
+TEST(FCAP_TRANSPORT_TESTS, unix_bind_path)
+{
+	int fd;
+	static struct fcap_unix sock;
+	char path[64];
+
+	snprintf(path, sizeof(path), "/tmp/fcap_test_bind_%d", getpid());
+
+	/* Something which isn't a socket is never removed */
+	fd = open(path, O_CREAT | O_WRONLY, 0600);
+	ASSERT_GE(fd, 0);
+	close(fd);
+	ASSERT_EQ(fcap_unix_setup_transport(&sock, path, NULL), -EADDRINUSE);
+	ASSERT_EQ(access(path, F_OK), 0);
+	unlink(path);
+
+	/* Nor is the socket of a live process */
+	ASSERT_EQ(fcap_unix_setup_transport(&sock, path, NULL), 0);
+	fd = sock.dgram.sockfd;
+	ASSERT_EQ(fcap_unix_setup_transport(&sock, path, NULL), -EADDRINUSE);
+
+	/* But one left behind by a socket which has closed is */
+	close(fd);
+	ASSERT_EQ(access(path, F_OK), 0);
+	ASSERT_EQ(fcap_unix_setup_transport(&sock, path, NULL), 0);
+
+	fcap_unix_cleanup(&sock);
+	ASSERT_NE(access(path, F_OK), 0);
+}
@@ -0,0 +1,425 @@
+/*
+ * End-to-end UDP benchmark, a server and a client on loopback in one process
+ *
+ * Usage: fcap_udp_bench [-m pingpong|flood] [-n requests] [-w warmup]
+ *                       [-r requests/sec] [-k keys] [-b binary bytes]
+ *                       [-s spin us]
+ *
+ * pingpong sends a request and waits for its response before sending the next,
+ * measuring round-trip latency. With -r the requests are paced at that rate.
+ * flood sends requests at a fixed rate (-r) without waiting for responses,
+ * up to a window of outstanding requests, measuring sustained throughput.
+ * Both sides sleep in fcap_poll_wait while idle, -s lets them spin first.
+ *
+ * When paced, latency is measured from when each request was meant to be sent
+ * rather than when it was, so a stall that holds up later requests shows up in
+ * their latency too, rather than being hidden (coordinated omission). Unpaced
+ * ping-pong has no schedule to fall behind, so it measures the best case
+ */
+#define _GNU_SOURCE
+
+#include <fcap.h>
+#include <fcap_udp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVER_PORT (FCAP_PORT + 40)
+#define CLIENT_PORT (FCAP_PORT + 41)
+#define LOCALHOST "127.0.0.1"
+
+/* How long to wait for the last responses before giving up on them */
+#define DRAIN_TIMEOUT_NS 1000000000ull
+
+/*
+ * Histogram precision, each power of two is split into 2^HIST_SUB_BITS
+ * linear buckets, so a value is reported at most 1 / 2^HIST_SUB_BITS (under
+ * 1%) above itself
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_NUM_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+/**
+ * @brief a log-linear histogram of latencies in nanoseconds, in the style of
+ * HdrHistogram: constant relative precision over the whole range with
+ * constant time recording
+*/
+struct histogram {
+	uint64_t counts[HIST_NUM_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+};
+
+static int hist_index(uint64_t value)
+{
+	int shift;
+
+	if (value < 2 * HIST_SUB_COUNT)
+		return value;
+
+	/*
+	 * The top bit picks the bucket, the HIST_SUB_BITS bits after it the sub
+	 * bucket, so value >> shift is in [HIST_SUB_COUNT, 2 * HIST_SUB_COUNT)
+	 */
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+
+	return shift * HIST_SUB_COUNT + (value >> shift);
+}
+
+/**
+ * @brief the highest value which lands in a bucket
+*/
+static uint64_t hist_value(int index)
+{
+	int shift = index / HIST_SUB_COUNT - 1;
+	uint64_t sub = index % HIST_SUB_COUNT + HIST_SUB_COUNT;
+
+	if (index < 2 * HIST_SUB_COUNT)
+		return index;
+
+	return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(struct histogram *hist, uint64_t value)
+{
+	hist->counts[hist_index(value)]++;
+	hist->total++;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+static uint64_t hist_percentile(struct histogram *hist, double percentile)
+{
+	int i;
+	uint64_t seen = 0;
+	uint64_t target = hist->total * percentile / 100.0;
+
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < HIST_NUM_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= target)
+			return hist_value(i) < hist->max ? hist_value(i) :
+							   hist->max;
+	}
+
+	return hist->max;
+}
+
+/**
+ * @brief the benchmark options
+ * @param flood whether to run open loop rather than ping-pong
+ * @param num_requests the number of requests to measure
+ * @param warmup the number of requests to send before measuring
+ * @param rate the requests per second to send, 0 for as fast as possible
+ * @param num_keys the number of i32 keys in each request
+ * @param binary_len the length of a binary key in each request, 0 for none
+ * @param spin_us how long both sides spin before sleeping while idle
+*/
+struct options {
+	int flood;
+	uint64_t num_requests;
+	uint64_t warmup;
+	uint64_t rate;
+	int num_keys;
+	int binary_len;
+	uint32_t spin_us;
+};
+
+/**
+ * @brief the state of the client
+ * @param intended_ns when each request was meant to be sent
+ * @param done the number of requests which have finished
+ * @param failed the number of requests which timed out
+ * @param interval_ns the time between requests when paced, 0 if not
+*/
+struct client {
+	struct options opts;
+	struct histogram hist;
+	uint64_t *intended_ns;
+	uint64_t done;
+	uint64_t failed;
+	uint64_t interval_ns;
+};
+
+static volatile int server_running = 1;
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static enum handler_code server_recv_req(FApp app, FEvent event, FPacket res)
+{
+	fcap_app_add_key_u8(app, KEY_A, 0);
+	return FCAP_RESPOND;
+}
+
+static void *server_run(void *arg)
+{
+	FApp app = arg;
+
+	while (server_running)
+		fcap_poll_wait(app, 100);
+
+	return NULL;
+}
+
+static void client_done(FApp app, FEvent event, FError status, void *priv)
+{
+	struct client *client = app->priv;
+	uint64_t seq = (uintptr_t)priv;
+	uint64_t latency_ns = now_ns() - client->intended_ns[seq];
+
+	client->done++;
+
+	if (status != FCAP_ENONE) {
+		client->failed++;
+		return;
+	}
+
+	if (seq < client->opts.warmup)
+		return;
+
+	hist_record(&client->hist, latency_ns);
+}
+
+static void client_build(struct client *client, FBuilder builder,
+			 FPacket pkt)
+{
+	int i;
+	uint8_t binary[MTU] = {};
+
+	fcap_builder_init(builder, pkt);
+	for (i = 0; i < client->opts.num_keys; i++)
+		fcap_builder_add_key_i32(builder, (FKey)i, i);
+
+	if (client->opts.binary_len)
+		fcap_builder_add_key_bin(builder,
+					 (FKey)client->opts.num_keys,
+					 binary,
+					 client->opts.binary_len);
+}
+
+/**
+ * @brief handles responses until a point in time, sleeping while there is
+ * more than a millisecond to go and polling after that
+*/
+static void client_wait(FApp app, uint64_t until_ns)
+{
+	uint64_t now;
+
+	while ((now = now_ns()) < until_ns) {
+		if (until_ns - now > 1000000)
+			fcap_poll_wait(app, (until_ns - now) / 1000000 - 1);
+		else
+			fcap_poll(app);
+	}
+}
+
+static int client_run(struct client *client, FApp app, FTransport transport)
+{
+	int ret;
+	uint64_t seq;
+	uint64_t start_ns;
+	uint64_t total = client->opts.warmup + client->opts.num_requests;
+	struct fcap_packet pkt;
+	struct fcap_builder builder;
+
+	client_build(client, &builder, &pkt);
+
+	start_ns = now_ns();
+	for (seq = 0; seq < total; seq++) {
+		/* Pace the requests, otherwise send each as soon as possible */
+		client->intended_ns[seq] = now_ns();
+		if (client->interval_ns) {
+			client->intended_ns[seq] =
+				start_ns + seq * client->interval_ns;
+			client_wait(app, client->intended_ns[seq]);
+		}
+
+		/* The window is full, make room */
+		while ((ret = fcap_send_async(app,
+					      transport,
+					      &builder,
+					      1000,
+					      client_done,
+					      (void *)(uintptr_t)seq)) ==
+		       -FCAP_EAGAIN)
+			fcap_poll_wait(app, 1000);
+
+		if (ret < 0)
+			return ret;
+
+		fcap_flush(app);
+
+		/* Ping-pong waits for every response before the next request */
+		while (!client->opts.flood && client->done <= seq)
+			fcap_poll_wait(app, 1000);
+	}
+
+	start_ns = now_ns();
+	while (client->done < total && now_ns() - start_ns < DRAIN_TIMEOUT_NS)
+		fcap_poll_wait(app, 1);
+
+	return 0;
+}
+
+static void usage(char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-m pingpong|flood] [-n requests] [-w warmup] "
+		"[-r requests/sec] [-k keys] [-b binary bytes] [-s spin us]\n",
+		name);
+	exit(1);
+}
+
+FCAP_CREATE_UDP_TRANSPORT(server_udp);
+FCAP_SET_TRANSPORTS(server_transports, &server_udp)
+FCAP_SET_MIDDLEWARE(server_middleware)
+FCAP_CREATE_APP(server, server_transports, server_middleware,
+		.on_request = server_recv_req)
+
+FCAP_CREATE_UDP_TRANSPORT(client_udp);
+FCAP_SET_TRANSPORTS(client_transports, &client_udp)
+FCAP_SET_MIDDLEWARE(client_middleware)
+FCAP_CREATE_APP(client_app, client_transports, client_middleware)
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int ret;
+	uint64_t start_ns;
+	uint64_t elapsed_ns;
+	pthread_t server_thread;
+	static struct client client = {
+		.opts = {
+			.flood = 0,
+			.num_requests = 100000,
+			.warmup = 1000,
+			.rate = 0,
+			.num_keys = 1,
+			.binary_len = 0,
+			.spin_us = 0,
+		},
+	};
+
+	while ((opt = getopt(argc, argv, "m:n:w:r:k:b:s:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "flood") == 0)
+				client.opts.flood = 1;
+			else if (strcmp(optarg, "pingpong") != 0)
+				usage(argv[0]);
+			break;
+		case 'n':
+			client.opts.num_requests = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			client.opts.warmup = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			client.opts.rate = strtoull(optarg, NULL, 0);
+			break;
+		case 'k':
+			client.opts.num_keys = atoi(optarg);
+			break;
+		case 'b':
+			client.opts.binary_len = atoi(optarg);
+			break;
+		case 's':
+			client.opts.spin_us = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (client.opts.flood && client.opts.rate == 0) {
+		fprintf(stderr, "Error: flood needs a rate (-r)\n");
+		exit(1);
+	}
+
+	if (client.opts.num_keys < 0 || client.opts.num_keys >= NUM_KEYS - 1) {
+		fprintf(stderr, "Error: too many keys\n");
+		exit(1);
+	}
+
+	if (client.opts.rate)
+		client.interval_ns = 1000000000ull / client.opts.rate;
+
+	client.intended_ns = calloc(client.opts.warmup +
+					    client.opts.num_requests,
+				    sizeof(uint64_t));
+	if (!client.intended_ns) {
+		fprintf(stderr, "Error: out of memory\n");
+		exit(1);
+	}
+
+	ret = fcap_udp_setup_transport(
+		&server_udp_priv, SERVER_PORT, LOCALHOST, CLIENT_PORT);
+	if (ret < 0) {
+		printf("Error: Failed to set up server udp with code %d!\n",
+		       ret);
+		exit(1);
+	}
+
+	ret = fcap_udp_setup_transport(
+		&client_udp_priv, CLIENT_PORT, LOCALHOST, SERVER_PORT);
+	if (ret < 0) {
+		printf("Error: Failed to set up client udp with code %d!\n",
+		       ret);
+		exit(1);
+	}
+
+	fcap_init_instance(server);
+	fcap_init_instance(client_app);
+	client_app->priv = &client;
+	fcap_set_spin(server, client.opts.spin_us);
+	fcap_set_spin(client_app, client.opts.spin_us);
+
+	pthread_create(&server_thread, NULL, server_run, server);
+
+	start_ns = now_ns();
+	ret = client_run(&client, client_app, &client_udp);
+	elapsed_ns = now_ns() - start_ns;
+
+	server_running = 0;
+	pthread_join(server_thread, NULL);
+
+	if (ret < 0) {
+		printf("Error: Failed to send request with code %d\n", ret);
+		exit(1);
+	}
+
+	printf("mode %s, %d keys, %d binary bytes\n",
+	       client.opts.flood ? "flood" : "pingpong",
+	       client.opts.num_keys,
+	       client.opts.binary_len);
+	printf("requests  %llu (%llu timed out)\n",
+	       (unsigned long long)client.done,
+	       (unsigned long long)client.failed);
+	printf("rate      %.0f requests/sec\n",
+	       client.done * 1e9 / elapsed_ns);
+	printf("p50       %.2f us\n", hist_percentile(&client.hist, 50) / 1e3);
+	printf("p99       %.2f us\n", hist_percentile(&client.hist, 99) / 1e3);
+	printf("p99.9     %.2f us\n",
+	       hist_percentile(&client.hist, 99.9) / 1e3);
+	printf("max       %.2f us\n", client.hist.max / 1e3);
+
+	fcap_udp_cleanup(&server_udp_priv);
+	fcap_udp_cleanup(&client_udp_priv);
+	free(client.intended_ns);
+
+	return client.failed ? 1 : 0;
+}